@@ -11,57 +11,242 @@
 #include <fcntl.h>
 #include <time.h>
 #include <stdint.h>
-#define WIFLY_PORT "2000"
+#include <poll.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include "powerduino_protocol.h"
 #define WIFLY_ADDR "169.254.1.1"
 #define BUF_SIZE 64
+#define REPLY_SIZE MAX_FRAME_DATA_SIZE
 #define SOCKET_OFF 0
 #define SOCKET_ON 1
 #define TIMEOUT_MAX_RETRY 5
-#define MASTER_COMMAND_TRANSMISSION_START 31
-#define SLAVE_COMMAND_ACK 30
-#define MASTER_COMMAND_TOGGLE_SOCKET 29
-#define MASTER_COMMAND_REQUEST_SOCKET_STATUS 28
-#define MASTER_COMMAND_SET_TIME 27
-#define MASTER_COMMAND_ENERGY_QUERY 26
-#define PRINT_USAGE_AND_CONTINUE() {print_usage();continue;}
+#define PRINT_USAGE_AND_RETURN() {print_usage();return;}
 #define CLEAR_CMD_BUF() memset(cmd_buf, 0, BUF_SIZE)
 #define CLEAR_SEND_BUF() memset(send_buf, 0, BUF_SIZE)
-#define CLEAR_RECV_BUF() memset(recv_buf, 0, BUF_SIZE)
-#define TIMEOUT_SECONDS 15
+#define CLEAR_RECV_BUF() memset(recv_buf, 0, REPLY_SIZE)
+#define RTO_INITIAL_MS 1000
+#define RTO_MIN_MS 100
+#define RTO_MAX_MS 4000
+// time the power strip may spend on an energy query over a number of
+// months. whole hours, days and months come out of its rollup files, a
+// record each, with up to 23 hours and 30 days on either side of the
+// months. only the partial hours at the two ends are read from the log
+#define ENERGY_QUERY_ROLLUP_MS 10
+#define ENERGY_QUERY_LOG_HOUR_MS 200
+#define ENERGY_QUERY_BUDGET_MS(months) ((2 * (23 + 30) + (months)) * ENERGY_QUERY_ROLLUP_MS + 2 * ENERGY_QUERY_LOG_HOUR_MS)
+// how fast the serial link behind the WiFi module is
+#define LINK_BYTES_PER_SEC 960
+#define LOG_READ_BUDGET_MS (FRAME_SIZE(LOG_CHUNK_MAX_SIZE) * 1000 / LINK_BYTES_PER_SEC)
+#define SHED_STATUS_BUDGET_MS (FRAME_SIZE(SHED_STATUS_MAX_SIZE) * 1000 / LINK_BYTES_PER_SEC)
+// errors returned by the functions talking to the power strip
+#define ERR_TIMEOUT -1
+#define ERR_DISCONNECTED -2
+#define ERR_REQUEST -3
+#define ERR_REPLY -4
+#define WIFI_INIT_FLUSH_MS 3000
+#define RX_BUF_SIZE 512
+#define MAX_IN_FLIGHT 8
+#define PIPELINE_DEPTH 4
+#define DAEMON_SOCKET_PATH "/tmp/powerduino.sock"
+#define DAEMON_STALE_MS 2000
+#define DAEMON_CMD_TIMEOUT_MS 1000
+#define DAEMON_CONNECT_TIMEOUT_MS 2000
+#define DAEMON_BACKOFF_MIN_MS 500
+#define DAEMON_BACKOFF_MAX_MS 30000
+#define ADDR_SIZE 64
+#define PORT_SIZE 8
+#define FLEET_MAX_STRIPS 1024
+#define FLEET_POLL_MS 1000
+#define FLEET_ENERGY_MS 60000
+#define FLEET_REPORT_MS 10000
+#define FLEET_CONNECT_TIMEOUT_MS 5000
+#define FLEET_BACKOFF_MIN_MS 500
+#define FLEET_BACKOFF_MAX_MS 60000
+#define STRIP_DISCONNECTED 0
+#define STRIP_CONNECTING 1
+#define STRIP_GREETING 2
+#define STRIP_READY 3
 #define ONE_DAY_IN_SEC 86400
 #define ONE_HOUR_IN_SEC 3600
 #define KWH_IN_J 3600000
 #define CENT_PER_KWH 9
-#define MAINS_VOLTAGE_RMS 120
+#define MIRROR_DIR "powerduino_logs"
+#define PATH_SIZE 256
 
 char cmd_buf[BUF_SIZE];
 uint8_t send_buf[BUF_SIZE];
-uint8_t recv_buf[BUF_SIZE];
+uint8_t recv_buf[REPLY_SIZE];
 int32_t sockfd;
+// bytes received from the socket but not consumed yet
+// live in rx_buf[rx_head] to rx_buf[rx_tail - 1]
+uint8_t rx_buf[RX_BUF_SIZE];
+int32_t rx_head, rx_tail;
+
+// a request sent to the power strip, kept until its response
+// with the same tag comes back so it can be resent on timeout
+struct request_slot
+{
+    int32_t in_use;
+    int32_t answered;
+    uint8_t tag;
+    uint8_t data[BUF_SIZE];
+    int32_t len;
+    uint8_t reply[REPLY_SIZE];
+    int32_t reply_len;
+    int32_t retries;
+    // time the power strip needs on top of a round-trip
+    int32_t budget_ms;
+    int64_t sent;
+    int64_t deadline;
+};
+struct request_slot request_slots[MAX_IN_FLIGHT];
+uint8_t next_tag;
+
+// round-trip time of a power strip connection, smoothed the way TCP
+// does it (RFC 6298) to decide how long to wait before resending
+struct rtt_estimator
+{
+    int32_t samples;
+    int64_t srtt_ms;
+    int64_t rttvar_ms;
+    int64_t rto_ms;
+};
+struct rtt_estimator link_rtt = {0, 0, 0, RTO_INITIAL_MS};
+// set when a command fails, it's the exit status of -c
+int32_t command_failed;
+
+// frames pushed by the power strip after MASTER_COMMAND_SUBSCRIBE,
+// they all carry the tag of the subscribe request
+int32_t telemetry_active;
+uint8_t telemetry_tag;
+struct telemetry_state telemetry;
+uint32_t telemetry_frames, telemetry_bytes, telemetry_skipped;
+
+// daemon mode: the latest socket status response and when it
+// was received, a time of 0 means none has been yet
+uint8_t status_cache[BUF_SIZE];
+int64_t status_cache_time;
+// set when a command might have changed socket states
+int32_t status_cache_dirty;
+// ERR_ code of the last failed refresh or reconnect, 0 once one worked
+int32_t status_cache_error;
+int32_t stale_ms = DAEMON_STALE_MS;
+char daemon_path[sizeof(((struct sockaddr_un*)0)->sun_path)] = DAEMON_SOCKET_PATH;
+
+// fleet mode: a request sent to one of the strips
+struct fleet_request
+{
+    int32_t active;
+    uint8_t tag;
+    int64_t sent;
+    int64_t deadline;
+};
+
+// fleet mode: everything about the connection to one power strip
+struct strip
+{
+    char host[ADDR_SIZE];
+    char port[PORT_SIZE];
+    int32_t fd;
+    int32_t state;
+    uint8_t rx_buf[RX_BUF_SIZE];
+    int32_t rx_head, rx_tail;
+    uint8_t next_tag;
+    struct fleet_request status_req;
+    struct fleet_request energy_req;
+    int64_t next_status;
+    int64_t next_energy;
+    // connect timeout, end of greeting, or when to reconnect,
+    // depending on state
+    int64_t timer;
+    int32_t backoff_ms;
+    int32_t failures;
+    uint8_t status[BUF_SIZE];
+    int64_t status_time;
+    uint32_t energy[4];
+    int64_t energy_time;
+    struct rtt_estimator rtt;
+    uint32_t timeouts;
+    uint32_t reconnects;
+};
+int32_t fleet_poll_ms = FLEET_POLL_MS;
+
+// local copy of the power strip's log files, same names and content
+char mirror_dir[PATH_SIZE] = MIRROR_DIR;
 
 void do_command();
-int32_t recv_from_client(uint8_t *buf);
-void send_to_client(uint8_t *buf, int32_t len);
+void run_command();
+void run_daemon(const char *host, const char *port);
+int32_t reconnect_link(const char *host, const char *port);
+void serve_client(int32_t client_fd);
+int32_t refresh_status_cache();
+void remove_daemon_socket();
+void handle_signal(int sig);
+int32_t connect_to_daemon();
+int32_t daemon_request(char *line);
+void do_command_via_daemon();
+void parse_address(char *addr, char *host, char *port);
+void run_fleet(char *list_file);
+void strip_connect(struct strip *s, int32_t epfd, int64_t now);
+void strip_disconnect(struct strip *s, int32_t epfd, int64_t now);
+void strip_handle_event(struct strip *s, uint32_t events, int32_t epfd, int64_t now);
+void strip_handle_timer(struct strip *s, int32_t epfd, int64_t now);
+int64_t strip_next_timer(struct strip *s);
+int32_t strip_send(struct strip *s, struct fleet_request *req, uint8_t *data, int32_t len, int64_t now);
+void strip_handle_frame(struct strip *s, uint8_t tag, uint8_t *message, int32_t len, int64_t now);
+void print_fleet_report(struct strip *strips, int32_t count, int64_t now);
+int32_t recv_from_client(int64_t deadline);
+int32_t send_to_client(uint8_t *buf, int32_t len, int32_t budget_ms, int32_t reply_size);
+int32_t send_shed_request(int32_t len, int32_t budget_ms);
+int32_t submit_request(uint8_t *buf, int32_t len, int32_t budget_ms);
+int32_t transmit_request(struct request_slot *r);
+int32_t wait_for_reply(int32_t slot, uint8_t *buf);
+void cancel_request(int32_t slot);
+void close_link();
+void print_error(int32_t err);
+void rtt_update(struct rtt_estimator *e, int64_t rtt_ms);
+int64_t rtt_timeout(struct rtt_estimator *e, int32_t retries);
+void print_socket_status(uint8_t *buf);
+void watch_socket_status(int32_t count);
+void stream_telemetry(int32_t interval_ms);
+void sync_log_mirror(int32_t days);
+int32_t sync_log_day(time_t day_utc);
+void handle_telemetry(uint8_t *message, int32_t len);
 void print_usage();
 void send_cmd_toggle_socket(int32_t socket_num, int32_t socket_state);
+void send_cmd_set_sockets(uint8_t socket_mask, uint8_t state_mask);
 void wifi_init();
 void send_cmd_request_socket_status();
-int32_t recv_one_byte(uint8_t* c, int32_t timeout);
+void send_cmd_trip_status();
+void send_cmd_trip_config(int32_t socket_index, int32_t limit_mA);
+void print_trip_status(uint8_t *buf);
+void send_cmd_boot_status();
+void send_cmd_shed_status();
+void send_cmd_shed_config(int32_t budget_mA, int32_t hysteresis_mA, uint8_t *order);
+void print_shed_status(uint8_t *buf);
+void print_shed_events(uint8_t *buf);
+void send_cmd_log_config(int32_t deadband_mA, int32_t interval_sec);
+int32_t fill_rx_buf(int32_t timeout_ms);
+int64_t get_time_ms();
 void send_cmd_set_time();
-void int32_to_char(long int32, uint8_t *c);
-void int16_to_char(int32_t int16, uint8_t *c);
-int32_t char_to_int16(uint8_t* c);
-long char_to_int32(uint8_t* c);
 void send_cmd_energy_query(time_t start_utc, time_t end_utc);
 int32_t is_number(char c);
-void flush_recv_buf(int32_t timeout);
+void flush_recv_buf(int32_t timeout_ms);
 
-void flush_recv_buf(int32_t timeout)
+// discard everything in rx_buf as well as anything that arrives
+// until the socket has been quiet for timeout_ms
+void flush_recv_buf(int32_t timeout_ms)
 {
-    uint8_t c;
-    int32_t count = 0;
-    while(recv_one_byte(&c, timeout) == 0)
-        count++;
+    int32_t count = rx_tail - rx_head;
+    rx_head = rx_tail = 0;
+    while(fill_rx_buf(timeout_ms) > 0)
+    {
+        count += rx_tail - rx_head;
+        rx_head = rx_tail = 0;
+    }
     count > 0 ? printf("flushed %d bytes\n", count) : count;
 }
 
@@ -83,27 +268,93 @@ void *get_in_addr(struct sockaddr *sa)
 int32_t main(int32_t argc, char *argv[])
 {
     struct addrinfo hints, *servinfo, *p;
-    int32_t rv;
+    int32_t rv, opt;
     char s[INET6_ADDRSTRLEN];
     srand(time(NULL));
-    char wifly_address[20];
+    char wifly_address[ADDR_SIZE];
+    char wifly_port[PORT_SIZE];
+    int32_t daemon_mode = 0;
+    char *one_shot = NULL;
+    char *fleet_file = NULL;
+
+    while((opt = getopt(argc, argv, "dc:s:u:f:p:l:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'f':
+            fleet_file = optarg;
+            break;
+
+            case 'p':
+            fleet_poll_ms = atoi(optarg);
+            break;
+
+            case 'd':
+            daemon_mode = 1;
+            break;
+
+            case 'c':
+            one_shot = optarg;
+            break;
+
+            case 's':
+            stale_ms = atoi(optarg);
+            break;
+
+            case 'u':
+            strncpy(daemon_path, optarg, sizeof(daemon_path) - 1);
+            break;
+
+            case 'l':
+            strncpy(mirror_dir, optarg, PATH_SIZE - 1);
+            break;
+
+            default:
+            argc = -1;
+        }
+    }
     
-    if(argc > 2) 
+    if(argc < 0 || argc - optind > 1) 
     {
-        fprintf(stderr,"usage: 445_PC, 445_PC addr\n");
+        fprintf(stderr,"usage: 445_PC [-d] [-s stale_ms] [-u socket_path] [-l log_mirror_dir] [-c command] [addr[:port]]\n");
+        fprintf(stderr,"       445_PC -f address_list [-p poll_ms]\n");
         exit(1);
     }
 
-    if(argc == 2)
-        strcpy(wifly_address, argv[1]);
-    else
-        strcpy(wifly_address, WIFLY_ADDR);
+    if(fleet_file != NULL)
+    {
+        run_fleet(fleet_file);
+        return 0;
+    }
+
+    parse_address(argc - optind == 1 ? argv[optind] : WIFLY_ADDR, wifly_address, wifly_port);
+
+    if(one_shot != NULL)
+    {
+        CLEAR_CMD_BUF();
+        snprintf(cmd_buf, BUF_SIZE, "%s\n", one_shot);
+    }
+
+    // if a daemon is already talking to the power strip,
+    // just pass the commands to it
+    if(!daemon_mode)
+    {
+        if(one_shot != NULL && daemon_request(cmd_buf) == 0)
+            return 0;
+        int32_t fd = connect_to_daemon();
+        if(one_shot == NULL && fd != -1)
+        {
+            close(fd);
+            do_command_via_daemon();
+            return 0;
+        }
+    }
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    if ((rv = getaddrinfo(wifly_address, WIFLY_PORT, &hints, &servinfo)) != 0) 
+    if ((rv = getaddrinfo(wifly_address, wifly_port, &hints, &servinfo)) != 0) 
     {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return 1;
@@ -138,7 +389,16 @@ int32_t main(int32_t argc, char *argv[])
     printf("445_PC: connected to %s\n", s);
 
     freeaddrinfo(servinfo);
-    do_command(sockfd);
+    if(daemon_mode)
+        run_daemon(wifly_address, wifly_port);
+    else if(one_shot != NULL)
+    {
+        wifi_init();
+        run_command();
+        return command_failed;
+    }
+    else
+        do_command();
     close(sockfd);
     return 0;
 }
@@ -149,7 +409,7 @@ void wifi_init()
 {
     printf("Flushing receive buffer...\n");
     fcntl(sockfd, F_SETFL, O_NONBLOCK); // set socket to non-block
-    flush_recv_buf(3);
+    flush_recv_buf(WIFI_INIT_FLUSH_MS);
     CLEAR_RECV_BUF();
     printf("Ready.\n");
 }
@@ -169,333 +429,1692 @@ void do_command()
         // quit
         if(strcmp(cmd_buf, "q\n") == 0)
             return;
+        run_command();
+    }
+}
 
-        // toggle socket.
-        else if((cmd_buf[0] == 's') && (cmd_buf[1] <= '3' && cmd_buf[1] >= '1'))
-        {
-            if(strcmp(cmd_buf+2, "1\n") == 0)
-                send_cmd_toggle_socket(cmd_buf[1], SOCKET_ON);
-
-            else if(strcmp(cmd_buf+2, "0\n") == 0)
-                send_cmd_toggle_socket(cmd_buf[1], SOCKET_OFF);
-
-            else
-                PRINT_USAGE_AND_CONTINUE();
-        }
-        // socket state
-        else if(strcmp(cmd_buf, "ss\n") == 0)
-            send_cmd_request_socket_status();
-        // all on
-        else if(strcmp(cmd_buf, "a1\n") == 0)
-        {
-            for(char i = '1'; i <= '4'; i ++)
-                send_cmd_toggle_socket(i, SOCKET_ON);
-        }
-        // all off
-        else if(strcmp(cmd_buf, "a0\n") == 0)
+// interactive shell of a thin client, every command
+// is carried out by the daemon
+void do_command_via_daemon()
+{
+    while(1)
+    {
+        CLEAR_CMD_BUF();
+        printf("$: ");
+        if(fgets(cmd_buf, BUF_SIZE-1, stdin) == NULL)
+            return;
+        if(strcmp(cmd_buf, "q\n") == 0)
+            return;
+        if(daemon_request(cmd_buf) == -1)
         {
-            for(char i = '1'; i <= '4'; i++)
-                send_cmd_toggle_socket(i, SOCKET_OFF);
+            printf("lost connection to daemon\n");
+            return;
         }
-        // set time
-        else if(strcmp(cmd_buf, "st\n") == 0)
-            send_cmd_set_time();
-        // calculate energy
-        else if(cmd_buf[0] == 'e' && is_number(cmd_buf[1])) // e3h
-        {
-            int32_t duration = atoi(&cmd_buf[1]);
-            if(duration == 0)
-                PRINT_USAGE_AND_CONTINUE();
-
-            // get the position of the first letter after numbers
-            int32_t i = 1;
-            for(; i < strlen(cmd_buf) - 1; i++)
-                if(!is_number(cmd_buf[i]))
-                    break;
-
-            printf("energy used during the past %d ", duration);
-            switch(cmd_buf[i])
-            {
-                case 'h':
-                printf("hour");
-                if(duration > 1)
-                    printf("s");
-                printf(":\n");
-                send_cmd_energy_query(time(0) - ONE_HOUR_IN_SEC * duration, time(0));
-                break;
-
-                case 'd':
-                printf("day");
-                if(duration > 1)
-                    printf("s");
-                printf(":\n");
-                send_cmd_energy_query(time(0) - ONE_DAY_IN_SEC * duration, time(0));
-                break;
+    }
+}
 
-                case 'w':
-                printf("week");
-                if(duration > 1)
-                    printf("s");
-                printf(":\n");
-                send_cmd_energy_query(time(0) - ONE_DAY_IN_SEC * 7 * duration, time(0));
-                break;
+// connect to the daemon's Unix domain socket,
+// returns the socket or -1 if there's no daemon
+int32_t connect_to_daemon()
+{
+    struct sockaddr_un addr;
+    int32_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1)
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    // daemon_path is the size of sun_path and always ends in a 0
+    memcpy(addr.sun_path, daemon_path, sizeof(addr.sun_path));
+    if(connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-                case 'm':
-                printf("month");
-                if(duration > 1)
-                    printf("s");
-                printf(":\n");
-                send_cmd_energy_query(time(0) - ONE_DAY_IN_SEC * 30 * duration, time(0));
-                break;
+// send one command line to the daemon and print its response,
+// returns -1 if the daemon can't be reached
+int32_t daemon_request(char *line)
+{
+    char buf[256];
+    ssize_t count;
+    int32_t fd = connect_to_daemon();
+    if(fd == -1)
+        return -1;
+    if(write(fd, line, strlen(line)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    // daemon closes the connection after the response
+    shutdown(fd, SHUT_WR);
+    while((count = read(fd, buf, sizeof buf)) > 0)
+        fwrite(buf, 1, count, stdout);
+    fflush(stdout);
+    close(fd);
+    return 0;
+}
 
-                case 'y':
-                printf("year");
-                if(duration > 1)
-                    printf("s");
-                printf(":\n");
-                send_cmd_energy_query(time(0) - ONE_DAY_IN_SEC * 365 * duration, time(0));
-                break;
+// keep the connection to the power strip open and carry out commands
+// from local clients on a Unix domain socket one at a time. socket
+// status is refreshed in the background so ss can be answered
+// without waiting for the power strip. a failed refresh or a lost
+// connection is retried with backoff, clients are served meanwhile
+void run_daemon(const char *host, const char *port)
+{
+    struct sockaddr_un addr;
+    int32_t listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd == -1)
+    {
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    // daemon_path is the size of sun_path and always ends in a 0
+    memcpy(addr.sun_path, daemon_path, sizeof(addr.sun_path));
+    // remove the socket file left by a previous daemon
+    unlink(daemon_path);
+    if(bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(listen_fd, 16) == -1)
+    {
+        perror("bind");
+        exit(1);
+    }
+    atexit(remove_daemon_socket);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    // a client leaving early shouldn't kill the daemon
+    signal(SIGPIPE, SIG_IGN);
 
-                default:
-                printf("\'%c\'? I don't know what that is.\n", cmd_buf[i]);
-                printf("e#[h,d,w,m,y]: get energy usage for the last # hour/day/week/month/year\n");
+    wifi_init();
+    printf("listening on %s\n", daemon_path);
+    int64_t retry_time = 0;
+    int32_t backoff_ms = 0;
+    while(1)
+    {
+        // refresh the cache at half the staleness bound, but not
+        // before the next retry is due
+        int64_t now = get_time_ms();
+        int64_t due = status_cache_dirty ? now : status_cache_time + stale_ms / 2;
+        if(sockfd == -1 || due < retry_time)
+            due = retry_time;
+        if(due <= now)
+        {
+            int32_t rv = sockfd == -1 ? reconnect_link(host, port) : refresh_status_cache();
+            status_cache_error = rv < 0 && sockfd == -1 ? ERR_DISCONNECTED : rv;
+            if(rv == 0)
+            {
+                backoff_ms = 0;
+                retry_time = 0;
                 continue;
             }
+            // the wait doubles after every failure, with some jitter
+            backoff_ms = backoff_ms < DAEMON_BACKOFF_MIN_MS ? DAEMON_BACKOFF_MIN_MS
+                : backoff_ms * 2 <= DAEMON_BACKOFF_MAX_MS ? backoff_ms * 2 : DAEMON_BACKOFF_MAX_MS;
+            retry_time = now + backoff_ms / 2 + rand() % (backoff_ms / 2 + 1);
+            continue;
         }
-        // energy between two points in time
-        // eg YYYY MM DD hr min sec YYYY MM DD hr min sec
-        else if(strncmp(cmd_buf, "eq ", 3) == 0)
-        {
-            int32_t date_valus[12];
-            for(int32_t i = 0, j = 0; i < strlen(cmd_buf) - 1; i++)
-                if((cmd_buf[i] == ' ') && (cmd_buf[i + 1] != ' '))
-                {
-                    date_valus[j] = atol(&cmd_buf[i]);
-                    if(++j >= 12)
-                        break;
-                }
-            struct tm start_tm_local, end_tm_local;
-            start_tm_local.tm_year = date_valus[0] - 1900;
-            start_tm_local.tm_mon = date_valus[1] - 1;
-            start_tm_local.tm_mday = date_valus[2];
-            start_tm_local.tm_hour = date_valus[3];
-            start_tm_local.tm_min = date_valus[4];
-            start_tm_local.tm_sec = date_valus[5];
-            start_tm_local.tm_isdst = -1;
-            end_tm_local.tm_year = date_valus[6] - 1900;
-            end_tm_local.tm_mon = date_valus[7] - 1;
-            end_tm_local.tm_mday = date_valus[8];
-            end_tm_local.tm_hour = date_valus[9];
-            end_tm_local.tm_min = date_valus[10];
-            end_tm_local.tm_sec = date_valus[11];
-            end_tm_local.tm_isdst = -1;
-            send_cmd_energy_query(mktime(&start_tm_local), mktime(&end_tm_local));
-        }
-        // debug command, flush recv_buf
-        else if(strcmp(cmd_buf, "f\n") == 0)
-            flush_recv_buf(1);
-        else
-            PRINT_USAGE_AND_CONTINUE();
+        int64_t time_left = due - now;
+        struct pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, time_left) <= 0)
+            continue;
+        int32_t client_fd = accept(listen_fd, NULL, NULL);
+        if(client_fd == -1)
+            continue;
+        serve_client(client_fd);
+        close(client_fd);
     }
 }
 
-// ask power strip how much energy it has used between start_utc and
-// end_utc, then print it out in kWh, as well as the cost in $.
-void send_cmd_energy_query(time_t start_utc, time_t end_utc)
+// connect to the power strip again after the link was lost, returns
+// 0 for success. gives up after DAEMON_CONNECT_TIMEOUT_MS so clients
+// aren't kept waiting
+int32_t reconnect_link(const char *host, const char *port)
 {
-    // fill send_buf with command and two dates
-    send_buf[0] = MASTER_COMMAND_ENERGY_QUERY;
-    int32_to_char(start_utc, send_buf + 1);
-    int32_to_char(end_utc, send_buf + 5);
-    send_to_client(send_buf, 9);
-    // now the result is in recv_buf
-    uint32_t result[4];
-    double total_kwh = 0;
-    for(int32_t i = 0; i < 3; i++)
+    struct addrinfo hints, *servinfo;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, port, &hints, &servinfo) != 0)
+        return -1;
+    int32_t fd = socket(servinfo->ai_family, servinfo->ai_socktype | SOCK_NONBLOCK, servinfo->ai_protocol);
+    int32_t rv = fd == -1 ? -1 : connect(fd, servinfo->ai_addr, servinfo->ai_addrlen);
+    freeaddrinfo(servinfo);
+    if(rv == -1 && fd != -1 && errno == EINPROGRESS)
     {
-        // get the result out of recv_buf and print it out
-        result[i] = char_to_int32(recv_buf + i * 4);
-        double kwh = (double)result[i] / KWH_IN_J;
-        total_kwh += kwh;
-        printf("Socket %d: %.4fkWh, $%.4f\n", i+1, kwh, kwh * CENT_PER_KWH / 100);
+        struct pollfd pfd;
+        int32_t err = 0;
+        socklen_t err_len = sizeof err;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, DAEMON_CONNECT_TIMEOUT_MS) == 1
+            && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0)
+            rv = 0;
     }
-    printf("   Total: %.4fkWh, $%.4f\n", total_kwh, total_kwh * CENT_PER_KWH / 100);
+    if(rv == -1)
+    {
+        if(fd != -1)
+            close(fd);
+        return -1;
+    }
+    sockfd = fd;
+    printf("reconnected to %s:%s\n", host, port);
+    wifi_init();
+    status_cache_dirty = 1;
+    return 0;
 }
 
-// send current time to set the RTC in power strip
-void send_cmd_set_time()
+// read one command line from a client and send
+// everything printed while carrying it out back
+void serve_client(int32_t client_fd)
 {
-    send_buf[0] = MASTER_COMMAND_SET_TIME;
-    int32_to_char(time(0), send_buf+1);
-    send_to_client(send_buf, 5);
-}
+    int32_t len = 0;
+    int64_t deadline = get_time_ms() + DAEMON_CMD_TIMEOUT_MS;
+    CLEAR_CMD_BUF();
+    CLEAR_SEND_BUF();
+    while(len < BUF_SIZE - 1 && (len == 0 || cmd_buf[len - 1] != '\n'))
+    {
+        struct pollfd pfd;
+        pfd.fd = client_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int64_t time_left = deadline - get_time_ms();
+        if(time_left <= 0 || poll(&pfd, 1, time_left) <= 0)
+            return;
+        ssize_t count = read(client_fd, cmd_buf + len, BUF_SIZE - 1 - len);
+        if(count <= 0)
+            return;
+        len += count;
+    }
 
-// ask power strip the state of each socket
-void send_cmd_request_socket_status()
-{   
-    // fill send_buf
-    send_buf[0] = MASTER_COMMAND_REQUEST_SOCKET_STATUS;
-    send_to_client(send_buf, 1);
-    // now recv_buf has the result
-    int32_t socket_current[4];
-    // copy the result to socket_current
-    for(int32_t i = 0; i < 4; i++)
-        socket_current[i] = char_to_int16(&recv_buf[1+2*i]);
-    // then print everything out
-    for(int32_t i = 0; i < 3; i++)
+    // point stdout at the client for the duration of the command
+    fflush(stdout);
+    int32_t saved_stdout = dup(STDOUT_FILENO);
+    dup2(client_fd, STDOUT_FILENO);
+    if(strcmp(cmd_buf, "ss\n") == 0)
     {
-        printf("Socket %d: ", i + 1);
-        if(recv_buf[0] & (1 << i))
-            printf("ON");
+        // never wait for the power strip here, the daemon loop keeps
+        // retrying. a stale status is still sent, with its age
+        int64_t age = get_time_ms() - status_cache_time;
+        int32_t stale = status_cache_time == 0 || age > stale_ms || status_cache_dirty;
+        if(status_cache_time == 0)
+            printf("no socket status yet\n");
         else
-            printf("OFF");
-        double current = (double)socket_current[i] / 1000;
-        printf(", %.3fA, %.3fW\n", current, current * MAINS_VOLTAGE_RMS);
+            print_socket_status(status_cache);
+        if(status_cache_time != 0 && stale)
+            printf("status is %lld ms old\n", (long long)age);
+        if(stale && status_cache_error != 0)
+            print_error(status_cache_error);
     }
+    // a stream would tie up the daemon, and only one subscription
+    // per power strip connection is possible anyway
+    else if(cmd_buf[0] == 't' && is_number(cmd_buf[1]))
+        printf("streaming needs a direct connection to the power strip\n");
+    else if(strcmp(cmd_buf, "q\n") != 0)
+    {
+        run_command();
+        // the command might have changed socket states
+        status_cache_dirty = 1;
+    }
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
 }
 
-// ask power strip to toggle socket 
-void send_cmd_toggle_socket(int32_t socket_num, int32_t socket_state)
+// ask power strip for socket status and keep the response,
+// returns 0 for success, or one of the ERR_ codes
+int32_t refresh_status_cache()
 {
-    send_buf[0] = MASTER_COMMAND_TOGGLE_SOCKET;
-    send_buf[1] = socket_num - '1';
-    send_buf[2] = socket_state;
-    send_to_client(send_buf, 3);
+    CLEAR_SEND_BUF();
+    send_buf[0] = MASTER_COMMAND_REQUEST_SOCKET_STATUS;
+    int32_t rv = send_to_client(send_buf, 1, 0, SOCKET_STATUS_SIZE);
+    if(rv < 0)
+        return rv;
+    memcpy(status_cache, recv_buf, BUF_SIZE);
+    status_cache_time = get_time_ms();
+    status_cache_dirty = 0;
+    return 0;
+}
+
+void remove_daemon_socket()
+{
+    unlink(daemon_path);
+}
+
+void handle_signal(int sig)
+{
+    (void)sig;
+    exit(0);
 }
 
-// attach a header then send len bytes from start of buf to 
-// the power strip, then wait for its response.
-void send_to_client(uint8_t *buf, int32_t len)
+// split addr into host and port, port is WIFLY_PORT if not given
+void parse_address(char *addr, char *host, char *port)
 {
-    if(len <= 0 || len > 255)
+    char *colon = strchr(addr, ':');
+    memset(host, 0, ADDR_SIZE);
+    memset(port, 0, PORT_SIZE);
+    // more than one colon is an IPv6 address without port
+    if(colon == NULL || strchr(colon + 1, ':') != NULL)
     {
-        printf("send to client invalid message length\n");
+        strncpy(host, addr, ADDR_SIZE - 1);
+        strcpy(port, WIFLY_PORT);
         return;
     }
-    // assemble header
-    uint8_t header[2];
-    header[0] = MASTER_COMMAND_TRANSMISSION_START;
-    header[1] = len;
-    // retry if timeout happens
-    for (int32_t i = 0; i < TIMEOUT_MAX_RETRY; i++)
+    strncpy(host, addr, colon - addr < ADDR_SIZE - 1 ? colon - addr : ADDR_SIZE - 1);
+    strncpy(port, colon + 1, PORT_SIZE - 1);
+}
+
+// poll every power strip listed in list_file, one host[:port] per line,
+// over non-blocking connections in a single epoll loop. socket status
+// and energy usage are queried periodically and summed up over the
+// whole fleet
+void run_fleet(char *list_file)
+{
+    char line[ADDR_SIZE + PORT_SIZE];
+    int32_t count = 0;
+    FILE *fp = strcmp(list_file, "-") == 0 ? stdin : fopen(list_file, "r");
+    if(fp == NULL)
+    {
+        perror(list_file);
+        exit(1);
+    }
+    struct strip *strips = calloc(FLEET_MAX_STRIPS, sizeof(struct strip));
+    while(count < FLEET_MAX_STRIPS && fgets(line, sizeof line, fp) != NULL)
     {
-        if(i > 0)
-            printf("send command timeout, retry #%d\n", i);
-        // send out header
-        if(send(sockfd, header, 2, 0) == -1)
+        line[strcspn(line, " \t\r\n#")] = 0;
+        if(line[0] == 0)
+            continue;
+        parse_address(line, strips[count].host, strips[count].port);
+        strips[count].fd = -1;
+        strips[count].rtt.rto_ms = RTO_INITIAL_MS;
+        count++;
+    }
+    if(fp != stdin)
+        fclose(fp);
+    if(count == 0)
+    {
+        fprintf(stderr, "no address in %s\n", list_file);
+        exit(1);
+    }
+
+    int32_t epfd = epoll_create1(0);
+    if(epfd == -1)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+    // a strip closing its connection shouldn't kill the poller
+    signal(SIGPIPE, SIG_IGN);
+    printf("polling %d power strips\n", count);
+    int64_t now = get_time_ms();
+    for(int32_t i = 0; i < count; i++)
+        strip_connect(&strips[i], epfd, now);
+
+    struct epoll_event events[64];
+    int64_t next_report = now + FLEET_REPORT_MS;
+    while(1)
+    {
+        // sleep until the earliest timer of any strip
+        int64_t wake = next_report;
+        for(int32_t i = 0; i < count; i++)
         {
-            perror("send");
-            exit(0);
+            int64_t t = strip_next_timer(&strips[i]);
+            if(t < wake)
+                wake = t;
         }
-        // send out data
-        if(send(sockfd, buf, len, 0) == -1)
+        now = get_time_ms();
+        int32_t n = epoll_wait(epfd, events, 64, wake > now ? wake - now : 0);
+        if(n == -1 && errno != EINTR)
         {
-            perror("send");
-            exit(0);
+            perror("epoll_wait");
+            exit(1);
+        }
+        now = get_time_ms();
+        for(int32_t i = 0; i < n; i++)
+            strip_handle_event(events[i].data.ptr, events[i].events, epfd, now);
+        for(int32_t i = 0; i < count; i++)
+            if(strip_next_timer(&strips[i]) <= now)
+                strip_handle_timer(&strips[i], epfd, now);
+        if(now >= next_report)
+        {
+            print_fleet_report(strips, count, now);
+            next_report = now + FLEET_REPORT_MS;
         }
-        // wait for response
-        if(recv_from_client(recv_buf) == 0)
-            return;
     }
-    // if all retries result in timeout, exit the program
-    printf("can not reach client\n");
-    exit(0);
 }
 
-// listen to power strip's response, return -1 for fail, 0 for success
-// result is stored in buf                               
-int32_t recv_from_client(uint8_t *buf)
+// start a non-blocking connection to a strip, on failure
+// another attempt is scheduled after backoff
+void strip_connect(struct strip *s, int32_t epfd, int64_t now)
 {
-    int32_t message_length;
-    uint8_t c;
-    memset(buf, 0, BUF_SIZE);
-    // discard incoming bytes until the start of slave's response
-    do
+    struct addrinfo hints, *servinfo;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(s->host, s->port, &hints, &servinfo) != 0)
     {
-        if(recv_one_byte(&c, TIMEOUT_SECONDS) == -1)
-            return -1;
+        strip_disconnect(s, epfd, now);
+        return;
+    }
+    s->fd = socket(servinfo->ai_family, servinfo->ai_socktype | SOCK_NONBLOCK, servinfo->ai_protocol);
+    if(s->fd == -1 || (connect(s->fd, servinfo->ai_addr, servinfo->ai_addrlen) == -1 && errno != EINPROGRESS))
+    {
+        freeaddrinfo(servinfo);
+        strip_disconnect(s, epfd, now);
+        return;
     }
-    while(c != SLAVE_COMMAND_ACK);
+    freeaddrinfo(servinfo);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = s;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+    s->state = STRIP_CONNECTING;
+    s->timer = now + FLEET_CONNECT_TIMEOUT_MS;
+    s->rx_head = s->rx_tail = 0;
+    s->status_req.active = 0;
+    s->energy_req.active = 0;
+    s->failures = 0;
+}
 
-    // now we have received slave's ACK, the next byte is
-    // slave's message length
-    if(recv_one_byte(&c, TIMEOUT_SECONDS) == -1)
-        return -1;
-    message_length = c;
-    // receive corresponding number of bytes and store them
-    // in buf
-    for (int32_t i = 0; i < message_length && i < BUF_SIZE; i++)
+// drop the connection to a strip and schedule a reconnect,
+// the wait doubles after every failure and has some jitter
+// so a rack of strips doesn't reconnect in lockstep
+void strip_disconnect(struct strip *s, int32_t epfd, int64_t now)
+{
+    if(s->fd != -1)
     {
-        if(recv_one_byte(&c, TIMEOUT_SECONDS) == -1)
-            return -1;
-        buf[i] = c;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+        close(s->fd);
+        s->fd = -1;
+        s->reconnects++;
     }
-    return 0;
+    if(s->backoff_ms < FLEET_BACKOFF_MIN_MS)
+        s->backoff_ms = FLEET_BACKOFF_MIN_MS;
+    else if(s->backoff_ms * 2 <= FLEET_BACKOFF_MAX_MS)
+        s->backoff_ms *= 2;
+    else
+        s->backoff_ms = FLEET_BACKOFF_MAX_MS;
+    s->state = STRIP_DISCONNECTED;
+    s->timer = now + s->backoff_ms / 2 + rand() % (s->backoff_ms / 2 + 1);
 }
 
-// get one byte from socket, if nothing available
-// return -1 afer timeout seconds
-int32_t recv_one_byte(uint8_t* c, int32_t timeout)
+void strip_handle_event(struct strip *s, uint32_t events, int32_t epfd, int64_t now)
 {
-    uint8_t byte_buf[1];
-    time_t now = time(0);
-    while(time(0) - now < timeout)
-        if(recv(sockfd, byte_buf, 1, 0) != -1)
+    if(s->state == STRIP_CONNECTING)
+    {
+        int32_t err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0 || (events & (EPOLLERR | EPOLLHUP)))
         {
-            *c = byte_buf[0];
-            return 0;
+            strip_disconnect(s, epfd, now);
+            return;
         }
-    return -1;
-}
+        // connected, only wait for incoming bytes from now on
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+        s->state = STRIP_GREETING;
+        s->timer = now + WIFI_INIT_FLUSH_MS;
+    }
+    if(!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
 
-void print_usage()
-{
-    printf("\n");
-    printf("usage:\n");
-    printf("s[1,2,3][0,1]:      toggle socket. s10 turns socket 1 off, s21 turns socket 2 on, etc.\n");
-    printf("a1:                 turn on all sockets\n");
-    printf("a0:                 turn off all sockets\n");
-    printf("ss:                 get socket status\n");
-    printf("e#[h,d,w,m,y]:      get energy usage for the past # hour/day/week/month/year\n");
-    printf("eq YYYY MM DD HH MM SS YYYY MM DD HH MM SS:\n");
-    printf("                    get energy query between two timestamps\n");
-    printf("st:                 set power strip's RTC\n");
-    printf("q:                  quit\n");
-    printf("\n");
-}
+    // read everything available
+    while(1)
+    {
+        if(s->rx_head > 0)
+        {
+            memmove(s->rx_buf, s->rx_buf + s->rx_head, s->rx_tail - s->rx_head);
+            s->rx_tail -= s->rx_head;
+            s->rx_head = 0;
+        }
+        if(s->rx_tail == RX_BUF_SIZE)
+            s->rx_tail = 0;
+        ssize_t count = recv(s->fd, s->rx_buf + s->rx_tail, RX_BUF_SIZE - s->rx_tail, 0);
+        if(count == 0 || (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            strip_disconnect(s, epfd, now);
+            return;
+        }
+        if(count == -1)
+            break;
+        s->rx_tail += count;
+    }
 
-// fill the byte array with each byte in an int32_t, little endian
-void int32_to_char(long int32, uint8_t *c)
-{
-    c[0] = int32 & 0xff;
-    c[1] = (int32 & 0xff00) >> 8;
-    c[2] = (int32 & 0xff0000) >> 16;
-    c[3] = (int32 & 0xff000000) >> 24;
+    // flush out WiFi module's greeting, it's over once
+    // the strip has been quiet for WIFI_INIT_FLUSH_MS
+    if(s->state == STRIP_GREETING)
+    {
+        s->rx_head = s->rx_tail = 0;
+        s->timer = now + WIFI_INIT_FLUSH_MS;
+        return;
+    }
+
+    uint8_t tag;
+    uint8_t *message;
+    int32_t len;
+    while((len = parse_frame(s->rx_buf, &s->rx_head, s->rx_tail, SLAVE_COMMAND_ACK, &tag, &message)) != -1)
+        strip_handle_frame(s, tag, message, len, now);
 }
 
-// fill the byte array with each byte in an int16_t, little endian
-void int16_to_char(int32_t int16, uint8_t *c)
+// a response of the wrong size is dropped, the request times out
+// and goes out again
+void strip_handle_frame(struct strip *s, uint8_t tag, uint8_t *message, int32_t len, int64_t now)
 {
-    c[0] = int16 & 0xff;
-    c[1] = (int16 & 0xff00) >> 8;
+    struct fleet_request *req = NULL;
+    if(s->status_req.active && s->status_req.tag == tag && len == SOCKET_STATUS_SIZE)
+    {
+        req = &s->status_req;
+        memcpy(s->status, message, SOCKET_STATUS_SIZE);
+        s->status_time = now;
+    }
+    else if(s->energy_req.active && s->energy_req.tag == tag && len == ENERGY_RESULT_SIZE)
+    {
+        req = &s->energy_req;
+        for(int32_t i = 0; i < 4; i++)
+            s->energy[i] = char_to_int32(message + 4 * i);
+        s->energy_time = now;
+    }
+    // a late response to a request that timed out, or a bad one
+    if(req == NULL)
+        return;
+    req->active = 0;
+    // energy queries mostly measure the power strip's SD card
+    if(req == &s->status_req)
+        rtt_update(&s->rtt, now - req->sent);
+    s->failures = 0;
+    s->backoff_ms = 0;
 }
 
-// extract an int16_t from a byte array, little endian
-int32_t char_to_int16(uint8_t* c)
+// earliest time strip_handle_timer() has something to do
+int64_t strip_next_timer(struct strip *s)
 {
-    int32_t ret = 0;
-    ret = c[0];
-    ret |= c[1] << 8;
-    return ret;
+    if(s->state != STRIP_READY)
+        return s->timer;
+    int64_t t = s->status_req.active ? s->status_req.deadline : s->next_status;
+    if(s->energy_req.active)
+        return s->energy_req.deadline < t ? s->energy_req.deadline : t;
+    return s->next_energy < t ? s->next_energy : t;
 }
 
-// extract an int32_t from a byte array, little endian
-long char_to_int32(uint8_t* c)
+void strip_handle_timer(struct strip *s, int32_t epfd, int64_t now)
 {
-    long ret = 0;
-    ret = c[0];
-    ret |= c[1] << 8;
-    ret |= c[2] << 16;
-    ret |= c[3] << 24;
-    return ret;
-}
\ No newline at end of file
+    switch(s->state)
+    {
+        case STRIP_DISCONNECTED:
+        strip_connect(s, epfd, now);
+        return;
+
+        case STRIP_CONNECTING:
+        strip_disconnect(s, epfd, now);
+        return;
+
+        case STRIP_GREETING:
+        s->state = STRIP_READY;
+        s->next_status = now;
+        s->next_energy = now;
+        break;
+    }
+
+    // give up on requests that took too long, too
+    // many in a row means the connection is dead
+    struct fleet_request *reqs[2] = {&s->status_req, &s->energy_req};
+    for(int32_t i = 0; i < 2; i++)
+        if(reqs[i]->active && reqs[i]->deadline <= now)
+        {
+            reqs[i]->active = 0;
+            s->timeouts++;
+            if(++s->failures >= TIMEOUT_MAX_RETRY)
+            {
+                strip_disconnect(s, epfd, now);
+                return;
+            }
+        }
+
+    uint8_t data[9];
+    if(!s->status_req.active && s->next_status <= now)
+    {
+        data[0] = MASTER_COMMAND_REQUEST_SOCKET_STATUS;
+        s->next_status = now + fleet_poll_ms;
+        if(strip_send(s, &s->status_req, data, 1, now) == -1)
+        {
+            strip_disconnect(s, epfd, now);
+            return;
+        }
+    }
+    if(!s->energy_req.active && s->next_energy <= now)
+    {
+        // energy used during the past day
+        data[0] = MASTER_COMMAND_ENERGY_QUERY;
+        int32_to_char(time(0) - ONE_DAY_IN_SEC, data + 1);
+        int32_to_char(time(0), data + 5);
+        s->next_energy = now + FLEET_ENERGY_MS;
+        if(strip_send(s, &s->energy_req, data, 9, now) == -1)
+            strip_disconnect(s, epfd, now);
+        else
+            s->energy_req.deadline += ENERGY_QUERY_BUDGET_MS(1);
+    }
+}
+
+// send a request to a strip without waiting, returns -1 if it can't be sent
+int32_t strip_send(struct strip *s, struct fleet_request *req, uint8_t *data, int32_t len, int64_t now)
+{
+    uint8_t frame[FRAME_SIZE(BUF_SIZE)];
+    req->tag = s->next_tag++;
+    int32_t frame_len = build_frame(frame, MASTER_COMMAND_TRANSMISSION_START, req->tag, data, len);
+    // requests are tiny, a short write means the connection is in trouble
+    if(send(s->fd, frame, frame_len, 0) != frame_len)
+        return -1;
+    req->active = 1;
+    req->sent = now;
+    req->deadline = now + rtt_timeout(&s->rtt, s->failures);
+    return 0;
+}
+
+// print every strip's latest readings and the total of the fleet
+void print_fleet_report(struct strip *strips, int32_t count, int64_t now)
+{
+    int32_t up = 0;
+    double total_current = 0, total_power = 0, total_kwh = 0;
+    printf("\n%-22s %-5s %-8s %9s %9s %10s %6s %5s\n", "strip", "state", "sockets", "current", "power", "energy 24h", "rtt", "drops");
+    for(int32_t i = 0; i < count; i++)
+    {
+        struct strip *s = &strips[i];
+        char addr[ADDR_SIZE + PORT_SIZE];
+        char sockets[5] = "----";
+        double current = 0, power = 0, kwh = 0;
+        snprintf(addr, sizeof addr, "%s:%s", s->host, s->port);
+        if(s->state == STRIP_READY)
+            up++;
+        // readings older than a few poll periods are left out
+        if(s->state == STRIP_READY && s->status_time > 0 && now - s->status_time < fleet_poll_ms * 3 + RTO_MAX_MS)
+        {
+            for(int32_t j = 0; j < 4; j++)
+            {
+                sockets[j] = s->status[0] & (1 << j) ? '1' : '0';
+                current += (double)char_to_int16(&s->status[1 + 2 * j]) / 1000;
+                power += (double)char_to_int16(&s->status[9 + 2 * j]) / 10;
+            }
+            total_current += current;
+            total_power += power;
+        }
+        if(s->energy_time > 0)
+        {
+            for(int32_t j = 0; j < 4; j++)
+                kwh += (double)s->energy[j] / KWH_IN_J;
+            total_kwh += kwh;
+        }
+        printf("%-22s %-5s %-8s %8.3fA %8.1fW %7.3fkWh %4lldms %5u\n", addr,
+            s->state == STRIP_READY ? "up" : "down", sockets, current, power,
+            kwh, (long long)s->rtt.srtt_ms, s->timeouts + s->reconnects);
+    }
+    printf("fleet: %d/%d up, %.3fA, %.1fW, %.3fkWh in the past 24 hours\n", up, count,
+        total_current, total_power, total_kwh);
+    fflush(stdout);
+}
+
+// parse the command in cmd_buf and carry it out
+void run_command()
+{
+    command_failed = 0;
+    // toggle socket.
+    if((cmd_buf[0] == 's') && (cmd_buf[1] <= '3' && cmd_buf[1] >= '1'))
+    {
+        if(strcmp(cmd_buf+2, "1\n") == 0)
+            send_cmd_toggle_socket(cmd_buf[1], SOCKET_ON);
+
+        else if(strcmp(cmd_buf+2, "0\n") == 0)
+            send_cmd_toggle_socket(cmd_buf[1], SOCKET_OFF);
+
+        else
+            PRINT_USAGE_AND_RETURN();
+    }
+    // socket state
+    else if(strcmp(cmd_buf, "ss\n") == 0)
+        send_cmd_request_socket_status();
+    // all on
+    else if(strcmp(cmd_buf, "a1\n") == 0)
+        send_cmd_set_sockets(0xf, 0xf);
+    // all off
+    else if(strcmp(cmd_buf, "a0\n") == 0)
+        send_cmd_set_sockets(0xf, 0);
+    // set several sockets at once, eg m1x0: socket 1 on,
+    // socket 2 unchanged, socket 3 off
+    else if(cmd_buf[0] == 'm' && strlen(cmd_buf) > 2)
+    {
+        uint8_t socket_mask = 0, state_mask = 0;
+        int32_t i = 1;
+        for(; cmd_buf[i] != '\n' && cmd_buf[i] != 0; i++)
+        {
+            if(i > 4 || (cmd_buf[i] != '0' && cmd_buf[i] != '1' && cmd_buf[i] != 'x'))
+                break;
+            if(cmd_buf[i] == 'x')
+                continue;
+            socket_mask |= 1 << (i - 1);
+            if(cmd_buf[i] == '1')
+                state_mask |= 1 << (i - 1);
+        }
+        if(cmd_buf[i] != '\n')
+            PRINT_USAGE_AND_RETURN();
+        send_cmd_set_sockets(socket_mask, state_mask);
+    }
+    // watch socket status
+    else if(cmd_buf[0] == 'w' && is_number(cmd_buf[1]))
+    {
+        int32_t count = atoi(&cmd_buf[1]);
+        if(count <= 0)
+            PRINT_USAGE_AND_RETURN();
+        watch_socket_status(count);
+    }
+    // overcurrent trips
+    else if(strcmp(cmd_buf, "tr\n") == 0)
+        send_cmd_trip_status();
+    // one socket's current limit, eg tl210000
+    else if(cmd_buf[0] == 't' && cmd_buf[1] == 'l' && cmd_buf[2] >= '1' && cmd_buf[2] <= '4' && is_number(cmd_buf[3]))
+    {
+        int32_t limit_mA = atoi(&cmd_buf[3]);
+        if(limit_mA > 0xffff)
+            PRINT_USAGE_AND_RETURN();
+        send_cmd_trip_config(cmd_buf[2] - '1', limit_mA);
+    }
+    // how fast the sockets were back after the last reset
+    else if(strcmp(cmd_buf, "up\n") == 0)
+        send_cmd_boot_status();
+    // current budget and shed events
+    else if(strcmp(cmd_buf, "b\n") == 0)
+        send_cmd_shed_status();
+    // how much of the budget a restore has to leave free
+    else if(cmd_buf[0] == 'b' && cmd_buf[1] == 'h' && is_number(cmd_buf[2]))
+    {
+        int32_t hysteresis_mA = atoi(&cmd_buf[2]);
+        if(hysteresis_mA > 0xffff)
+            PRINT_USAGE_AND_RETURN();
+        send_cmd_shed_config(-1, hysteresis_mA, NULL);
+    }
+    // order sockets get shed in, eg bo4321
+    else if(cmd_buf[0] == 'b' && cmd_buf[1] == 'o' && strlen(cmd_buf) == 7)
+    {
+        uint8_t order[4];
+        for(int32_t i = 0; i < 4; i++)
+        {
+            if(cmd_buf[2 + i] < '1' || cmd_buf[2 + i] > '4')
+                PRINT_USAGE_AND_RETURN();
+            order[i] = cmd_buf[2 + i] - '1';
+        }
+        send_cmd_shed_config(-1, -1, order);
+    }
+    // whole strip current budget
+    else if(cmd_buf[0] == 'b' && is_number(cmd_buf[1]))
+    {
+        int32_t budget_mA = atoi(&cmd_buf[1]);
+        if(budget_mA > 0xffff)
+            PRINT_USAGE_AND_RETURN();
+        send_cmd_shed_config(budget_mA, -1, NULL);
+    }
+    // stream socket status
+    else if(cmd_buf[0] == 't' && is_number(cmd_buf[1]))
+    {
+        int32_t interval_ms = atoi(&cmd_buf[1]);
+        if(interval_ms <= 0 || interval_ms > 0xffff)
+            PRINT_USAGE_AND_RETURN();
+        stream_telemetry(interval_ms);
+    }
+    // log deadband
+    else if(strcmp(cmd_buf, "lc\n") == 0)
+        send_cmd_log_config(-1, -1);
+    else if(cmd_buf[0] == 'l' && cmd_buf[1] == 'd' && is_number(cmd_buf[2]))
+    {
+        int32_t deadband_mA = atoi(&cmd_buf[2]);
+        if(deadband_mA > 0xffff)
+            PRINT_USAGE_AND_RETURN();
+        send_cmd_log_config(deadband_mA, -1);
+    }
+    else if(cmd_buf[0] == 'l' && cmd_buf[1] == 'i' && is_number(cmd_buf[2]))
+    {
+        int32_t interval_sec = atoi(&cmd_buf[2]);
+        if(interval_sec < LOG_PERIOD_SEC || interval_sec > LOG_MAX_INTERVAL_SEC)
+            PRINT_USAGE_AND_RETURN();
+        send_cmd_log_config(-1, interval_sec);
+    }
+    // copy new log entries to the mirror
+    else if(cmd_buf[0] == 'l' && is_number(cmd_buf[1]))
+    {
+        int32_t days = atoi(&cmd_buf[1]);
+        if(days <= 0)
+            PRINT_USAGE_AND_RETURN();
+        sync_log_mirror(days);
+    }
+    // set time
+    else if(strcmp(cmd_buf, "st\n") == 0)
+        send_cmd_set_time();
+    // calculate energy
+    else if(cmd_buf[0] == 'e' && is_number(cmd_buf[1])) // e3h
+    {
+        int32_t duration = atoi(&cmd_buf[1]);
+        if(duration == 0)
+            PRINT_USAGE_AND_RETURN();
+
+        // get the position of the first letter after numbers
+        int32_t i = 1;
+        for(; i < (int32_t)strlen(cmd_buf) - 1; i++)
+            if(!is_number(cmd_buf[i]))
+                break;
+
+        printf("energy used during the past %d ", duration);
+        switch(cmd_buf[i])
+        {
+            case 'h':
+            printf("hour");
+            if(duration > 1)
+                printf("s");
+            printf(":\n");
+            send_cmd_energy_query(time(0) - ONE_HOUR_IN_SEC * duration, time(0));
+            break;
+
+            case 'd':
+            printf("day");
+            if(duration > 1)
+                printf("s");
+            printf(":\n");
+            send_cmd_energy_query(time(0) - ONE_DAY_IN_SEC * duration, time(0));
+            break;
+
+            case 'w':
+            printf("week");
+            if(duration > 1)
+                printf("s");
+            printf(":\n");
+            send_cmd_energy_query(time(0) - ONE_DAY_IN_SEC * 7 * duration, time(0));
+            break;
+
+            case 'm':
+            printf("month");
+            if(duration > 1)
+                printf("s");
+            printf(":\n");
+            send_cmd_energy_query(time(0) - ONE_DAY_IN_SEC * 30 * duration, time(0));
+            break;
+
+            case 'y':
+            printf("year");
+            if(duration > 1)
+                printf("s");
+            printf(":\n");
+            send_cmd_energy_query(time(0) - ONE_DAY_IN_SEC * 365 * duration, time(0));
+            break;
+
+            default:
+            printf("\'%c\'? I don't know what that is.\n", cmd_buf[i]);
+            printf("e#[h,d,w,m,y]: get energy usage for the last # hour/day/week/month/year\n");
+            return;
+        }
+    }
+    // energy between two points in time
+    // eg YYYY MM DD hr min sec YYYY MM DD hr min sec
+    else if(strncmp(cmd_buf, "eq ", 3) == 0)
+    {
+        int32_t date_valus[12];
+        for(int32_t i = 0, j = 0; i < (int32_t)strlen(cmd_buf) - 1; i++)
+            if((cmd_buf[i] == ' ') && (cmd_buf[i + 1] != ' '))
+            {
+                date_valus[j] = atol(&cmd_buf[i]);
+                if(++j >= 12)
+                    break;
+            }
+        struct tm start_tm_local, end_tm_local;
+        start_tm_local.tm_year = date_valus[0] - 1900;
+        start_tm_local.tm_mon = date_valus[1] - 1;
+        start_tm_local.tm_mday = date_valus[2];
+        start_tm_local.tm_hour = date_valus[3];
+        start_tm_local.tm_min = date_valus[4];
+        start_tm_local.tm_sec = date_valus[5];
+        start_tm_local.tm_isdst = -1;
+        end_tm_local.tm_year = date_valus[6] - 1900;
+        end_tm_local.tm_mon = date_valus[7] - 1;
+        end_tm_local.tm_mday = date_valus[8];
+        end_tm_local.tm_hour = date_valus[9];
+        end_tm_local.tm_min = date_valus[10];
+        end_tm_local.tm_sec = date_valus[11];
+        end_tm_local.tm_isdst = -1;
+        send_cmd_energy_query(mktime(&start_tm_local), mktime(&end_tm_local));
+    }
+    // debug command, flush recv_buf
+    else if(strcmp(cmd_buf, "f\n") == 0)
+        flush_recv_buf(1000);
+    else
+        PRINT_USAGE_AND_RETURN();
+}
+
+// ask power strip how much energy it has used between start_utc and
+// end_utc, then print it out in kWh, as well as the cost in $.
+void send_cmd_energy_query(time_t start_utc, time_t end_utc)
+{
+    // fill send_buf with command and two dates
+    send_buf[0] = MASTER_COMMAND_ENERGY_QUERY;
+    int32_to_char(start_utc, send_buf + 1);
+    int32_to_char(end_utc, send_buf + 5);
+    // the power strip reads a rollup record per month in the range
+    int32_t months = end_utc > start_utc ? (end_utc - start_utc) / (28 * ONE_DAY_IN_SEC) + 1 : 1;
+    if(send_to_client(send_buf, 9, ENERGY_QUERY_BUDGET_MS(months), ENERGY_RESULT_SIZE) < 0)
+        return;
+    // now the result is in recv_buf
+    uint32_t result[4];
+    double total_kwh = 0;
+    for(int32_t i = 0; i < 4; i++)
+    {
+        // get the result out of recv_buf and print it out
+        result[i] = char_to_int32(recv_buf + i * 4);
+        double kwh = (double)result[i] / KWH_IN_J;
+        total_kwh += kwh;
+        printf("Socket %d: %.4fkWh, $%.4f\n", i+1, kwh, kwh * CENT_PER_KWH / 100);
+    }
+    printf("   Total: %.4fkWh, $%.4f\n", total_kwh, total_kwh * CENT_PER_KWH / 100);
+}
+
+// send current time to set the RTC in power strip
+void send_cmd_set_time()
+{
+    send_buf[0] = MASTER_COMMAND_SET_TIME;
+    int32_to_char(time(0), send_buf+1);
+    send_to_client(send_buf, 5, 0, 0);
+}
+
+// ask power strip the state of each socket
+void send_cmd_request_socket_status()
+{   
+    // fill send_buf
+    send_buf[0] = MASTER_COMMAND_REQUEST_SOCKET_STATUS;
+    if(send_to_client(send_buf, 1, 0, SOCKET_STATUS_SIZE) < 0)
+        return;
+    // now recv_buf has the result
+    print_socket_status(recv_buf);
+}
+
+// ask power strip which sockets tripped on overcurrent and how fast
+void send_cmd_trip_status()
+{
+    send_buf[0] = MASTER_COMMAND_TRIP_STATUS;
+    if(send_to_client(send_buf, 1, 0, TRIP_STATUS_SIZE) < 0)
+        return;
+    print_trip_status(recv_buf);
+}
+
+// set one socket's current limit, 0 turns its trip off
+void send_cmd_trip_config(int32_t socket_index, int32_t limit_mA)
+{
+    send_buf[0] = MASTER_COMMAND_TRIP_CONFIG;
+    send_buf[1] = socket_index;
+    int16_to_char(limit_mA, send_buf + 2);
+    if(send_to_client(send_buf, 1 + TRIP_CONFIG_SIZE, 0, TRIP_STATUS_SIZE) < 0)
+        return;
+    // with the limiter off every limit reads 0
+    uint8_t zero[8] = {0};
+    if(memcmp(recv_buf + 12, zero, 8) == 0)
+        printf("current limiter is off, the limit applies once it's on\n");
+    else if(char_to_int16(recv_buf + 12 + 2 * socket_index) != limit_mA)
+        printf("power strip didn't take the new limit\n");
+    print_trip_status(recv_buf);
+}
+
+// print out a trip status response
+void print_trip_status(uint8_t *buf)
+{
+    static const char *trip_names[] = {"ok", "tripped, RMS over limit", "tripped, peak over limit"};
+    for(int32_t i = 0; i < 4; i++)
+    {
+        uint8_t trip = buf[3 * i];
+        uint16_t limit_mA = char_to_int16(&buf[12 + 2 * i]);
+        printf("Socket %d: ", i + 1);
+        if(limit_mA == 0)
+            printf("no limit, ");
+        else
+            printf("limit %.3fA, ", (double)limit_mA / 1000);
+        printf("%s", trip < 3 ? trip_names[trip] : "?");
+        if(trip != 0)
+            printf(" after %.1fms", (double)char_to_int16(&buf[3 * i + 1]) / 1000);
+        printf("\n");
+    }
+}
+
+// ask power strip where its sockets got their state from after the
+// last reset, and how long it took
+void send_cmd_boot_status()
+{
+    static const char *source_names[] = {"nothing stored", "EEPROM snapshot", "state file on the SD card"};
+    send_buf[0] = MASTER_COMMAND_BOOT_STATUS;
+    if(send_to_client(send_buf, 1, 0, BOOT_STATUS_SIZE) < 0)
+        return;
+    uint8_t source = recv_buf[0];
+    printf("sockets set from: %s\n", source < 3 ? source_names[source] : "?");
+    printf("sockets set after: %.3fms\n", (double)(uint32_t)char_to_int32(&recv_buf[1]) / 1000);
+    uint32_t card_ms = char_to_int32(&recv_buf[5]);
+    if(card_ms == BOOT_CARD_NOT_MOUNTED)
+        printf("SD card not mounted\n");
+    else
+        printf("SD card mounted after: %ums\n", card_ms);
+}
+
+// ask power strip for its current budget and the shed events it
+// keeps, a page at a time
+void send_cmd_shed_status()
+{
+    send_buf[0] = MASTER_COMMAND_SHED_STATUS;
+    int16_to_char(0, send_buf + 1);
+    if(send_shed_request(3, SHED_STATUS_BUDGET_MS) < 0)
+        return;
+    print_shed_status(recv_buf);
+    while(recv_buf[11] == SHED_EVENT_MAX)
+    {
+        uint8_t *last = recv_buf + SHED_STATUS_HEADER_SIZE + (SHED_EVENT_MAX - 1) * SHED_EVENT_SIZE;
+        uint16_t from_seq = (uint16_t)char_to_int16(last) + 1;
+        if(from_seq == (uint16_t)char_to_int16(recv_buf + 9))
+            return;
+        send_buf[0] = MASTER_COMMAND_SHED_STATUS;
+        int16_to_char(from_seq, send_buf + 1);
+        if(send_shed_request(3, SHED_STATUS_BUDGET_MS) < 0)
+            return;
+        print_shed_events(recv_buf);
+    }
+}
+
+// change part of the shed config, -1 or NULL keeps what the power
+// strip has
+void send_cmd_shed_config(int32_t budget_mA, int32_t hysteresis_mA, uint8_t *order)
+{
+    uint8_t config[8];
+    send_buf[0] = MASTER_COMMAND_SHED_STATUS;
+    int16_to_char(0, send_buf + 1);
+    if(send_shed_request(3, SHED_STATUS_BUDGET_MS) < 0)
+        return;
+    memcpy(config, recv_buf, 8);
+    if(budget_mA >= 0)
+        int16_to_char(budget_mA, config);
+    if(hysteresis_mA >= 0)
+        int16_to_char(hysteresis_mA, config + 2);
+    if(order != NULL)
+        memcpy(config + 4, order, 4);
+    send_buf[0] = MASTER_COMMAND_SHED_CONFIG;
+    memcpy(send_buf + 1, config, 8);
+    if(send_shed_request(9, 0) < 0)
+        return;
+    // the power strip keeps its old config if the order isn't every socket once
+    if(memcmp(recv_buf, config, 8) != 0)
+        printf("power strip didn't take the new config\n");
+    print_shed_status(recv_buf);
+}
+
+// change part of the log config, -1 keeps what the power strip has.
+// with both -1 it's only shown
+void send_cmd_log_config(int32_t deadband_mA, int32_t interval_sec)
+{
+    uint8_t config[LOG_CONFIG_SIZE];
+    send_buf[0] = MASTER_COMMAND_LOG_CONFIG;
+    memset(send_buf + 1, 0, LOG_CONFIG_SIZE);
+    if(send_to_client(send_buf, 1 + LOG_CONFIG_SIZE, 0, LOG_CONFIG_SIZE) < 0)
+        return;
+    memcpy(config, recv_buf, LOG_CONFIG_SIZE);
+    if(deadband_mA >= 0 || interval_sec >= 0)
+    {
+        if(deadband_mA >= 0)
+            int16_to_char(deadband_mA, config);
+        if(interval_sec >= 0)
+            int16_to_char(interval_sec, config + 2);
+        send_buf[0] = MASTER_COMMAND_LOG_CONFIG;
+        memcpy(send_buf + 1, config, LOG_CONFIG_SIZE);
+        if(send_to_client(send_buf, 1 + LOG_CONFIG_SIZE, 0, LOG_CONFIG_SIZE) < 0)
+            return;
+        if(memcmp(recv_buf, config, LOG_CONFIG_SIZE) != 0)
+            printf("power strip didn't take the new config\n");
+    }
+    uint16_t deadband = char_to_int16(recv_buf);
+    if(deadband == 0)
+        printf("logging every reading\n");
+    else
+        printf("logging readings that move more than %.3fA, at least every %ds\n", (double)deadband / 1000, char_to_int16(recv_buf + 2));
+}
+
+// print out a shed status response
+void print_shed_status(uint8_t *buf)
+{
+    uint16_t budget_mA = char_to_int16(buf);
+    if(budget_mA == 0)
+        printf("current budget off\n");
+    else
+        printf("current budget: %.3fA, restores leave %.3fA free\n", (double)budget_mA / 1000, (double)char_to_int16(buf + 2) / 1000);
+    printf("shed order:");
+    for(int32_t i = 0; i < 4; i++)
+        printf(" %d", buf[4 + i] + 1);
+    printf("\nshed now:");
+    for(int32_t i = 0; i < 4; i++)
+        if(buf[8] & (1 << i))
+            printf(" %d", i + 1);
+    printf(buf[8] == 0 ? " none\n" : "\n");
+    print_shed_events(buf);
+}
+
+// print out the events of a shed status response
+void print_shed_events(uint8_t *buf)
+{
+    for(int32_t i = 0; i < buf[11]; i++)
+    {
+        uint8_t *e = buf + SHED_STATUS_HEADER_SIZE + i * SHED_EVENT_SIZE;
+        time_t t = char_to_int32(e + 2);
+        char time_buf[32];
+        strftime(time_buf, sizeof time_buf, "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("%s socket %d %s, strip at %.3fA\n", time_buf, (e[6] & ~SHED_EVENT_RESTORE) + 1,
+            e[6] & SHED_EVENT_RESTORE ? "restored" : "shed", (double)char_to_int16(e + 7) / 1000);
+    }
+}
+
+// print out a socket status response
+void print_socket_status(uint8_t *buf)
+{
+    double voltage = (double)char_to_int16(&buf[17]) / 10;
+    for(int32_t i = 0; i < 4; i++)
+    {
+        printf("Socket %d: ", i + 1);
+        if(buf[0] & (1 << i))
+            printf("ON");
+        else
+            printf("OFF");
+        double current = (double)char_to_int16(&buf[1 + 2 * i]) / 1000;
+        double power = (double)char_to_int16(&buf[9 + 2 * i]) / 10;
+        printf(", %.3fA, %.1fW", current, power);
+        // power factor is real power over apparent power
+        if(current > 0 && voltage > 0)
+            printf(", PF %.2f", power / (current * voltage) > 1 ? 1 : power / (current * voltage));
+        printf("\n");
+    }
+    printf("Mains: %.1fV\n", voltage);
+}
+
+// ask power strip for socket status count times, keeping up to
+// PIPELINE_DEPTH requests in flight so each reading doesn't
+// pay for a full round-trip
+void watch_socket_status(int32_t count)
+{
+    int32_t slots[PIPELINE_DEPTH];
+    int32_t sent = 0, done = 0;
+    int64_t start = get_time_ms();
+    send_buf[0] = MASTER_COMMAND_REQUEST_SOCKET_STATUS;
+    while(done < count)
+    {
+        // keep the pipeline full
+        while(sent < count && sent - done < PIPELINE_DEPTH)
+        {
+            slots[sent % PIPELINE_DEPTH] = submit_request(send_buf, 1, 0);
+            if(slots[sent % PIPELINE_DEPTH] < 0)
+                break;
+            sent++;
+        }
+        // responses are printed in the order the requests went out
+        int32_t rv = sent > done ? wait_for_reply(slots[done % PIPELINE_DEPTH], recv_buf) : ERR_REQUEST;
+        if(rv >= 0 && rv != SOCKET_STATUS_SIZE)
+            rv = ERR_REPLY;
+        if(rv < 0)
+        {
+            print_error(rv);
+            while(++done < sent)
+                cancel_request(slots[done % PIPELINE_DEPTH]);
+            return;
+        }
+        printf("#%d\n", ++done);
+        print_socket_status(recv_buf);
+    }
+    int64_t elapsed = get_time_ms() - start;
+    printf("%d readings in %lldms\n", count, (long long)elapsed);
+}
+
+// subscribe to socket status every interval_ms and print each frame
+// as the power strip pushes it, until enter is pressed. then
+// unsubscribe and print how many bytes it took
+void stream_telemetry(int32_t interval_ms)
+{
+    memset(&telemetry, 0, sizeof telemetry);
+    telemetry_frames = telemetry_bytes = telemetry_skipped = 0;
+    send_buf[0] = MASTER_COMMAND_SUBSCRIBE;
+    int16_to_char(interval_ms, send_buf + 1);
+    int32_t slot = submit_request(send_buf, 3, 0);
+    if(slot < 0)
+        return;
+    telemetry_tag = request_slots[slot].tag;
+    int32_t rv = wait_for_reply(slot, recv_buf);
+    if(rv < 0)
+    {
+        print_error(rv);
+        return;
+    }
+    telemetry_active = 1;
+    printf("streaming every %dms, press enter to stop\n", interval_ms);
+    int64_t start = get_time_ms();
+    while(1)
+    {
+        struct pollfd pfd[2];
+        pfd[0].fd = STDIN_FILENO;
+        pfd[1].fd = sockfd;
+        pfd[0].events = pfd[1].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        if(poll(pfd, 2, -1) == -1 && errno != EINTR)
+            break;
+        if(pfd[0].revents)
+        {
+            CLEAR_CMD_BUF();
+            fgets(cmd_buf, BUF_SIZE, stdin);
+            break;
+        }
+        if(pfd[1].revents)
+        {
+            if(fill_rx_buf(0) == -1)
+            {
+                close_link();
+                print_error(ERR_DISCONNECTED);
+                break;
+            }
+            // telemetry frames are handed to handle_telemetry()
+            while(recv_from_client(0) == 0);
+        }
+    }
+    telemetry_active = 0;
+    int64_t elapsed = get_time_ms() - start;
+
+    send_buf[0] = MASTER_COMMAND_SUBSCRIBE;
+    int16_to_char(0, send_buf + 1);
+    if(sockfd != -1)
+        send_to_client(send_buf, 3, 0, 0);
+    printf("%u frames in %lldms, %u skipped waiting for a key frame\n", telemetry_frames,
+        (long long)elapsed, telemetry_skipped);
+    if(telemetry_frames > 0)
+        printf("%.1f bytes per frame, polling takes %d\n", (double)telemetry_bytes / telemetry_frames,
+            FRAME_SIZE(1) + FRAME_SIZE(SOCKET_STATUS_SIZE));
+}
+
+// decode a telemetry frame and print the socket status it carries
+void handle_telemetry(uint8_t *message, int32_t len)
+{
+    telemetry_frames++;
+    telemetry_bytes += FRAME_SIZE(len);
+    if(decode_telemetry(&telemetry, message, len) == -1)
+    {
+        telemetry_skipped++;
+        return;
+    }
+    printf("#%-3d", telemetry.seq);
+    for(int32_t i = 0; i < 4; i++)
+        printf("  %d: %-3s %.3fA", i + 1, telemetry.sockets & (1 << i) ? "ON" : "OFF",
+            (double)telemetry.current[i] / 1000);
+    printf("\n");
+}
+
+// bring the mirror of the last days day files up to date, only the
+// part of each file that isn't in the mirror yet is transferred
+void sync_log_mirror(int32_t days)
+{
+    int64_t start = get_time_ms();
+    int32_t total = 0;
+    mkdir(mirror_dir, 0755);
+    for(int32_t i = days - 1; i >= 0; i--)
+    {
+        int32_t count = sync_log_day(time(0) - (time_t)i * ONE_DAY_IN_SEC);
+        if(count == -1)
+        {
+            command_failed = 1;
+            return;
+        }
+        total += count;
+    }
+    printf("%d new bytes in %lldms\n", total, (long long)(get_time_ms() - start));
+}
+
+// fetch the part of the log file of the day day_utc is in that's
+// missing from the mirror, up to PIPELINE_DEPTH chunks at a time.
+// returns the number of bytes added, or -1 if it fails
+int32_t sync_log_day(time_t day_utc)
+{
+    char path[PATH_SIZE];
+    struct tm *tm = gmtime(&day_utc);
+    if(snprintf(path, PATH_SIZE, "%s/%d%02d%02d", mirror_dir, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday) >= PATH_SIZE)
+    {
+        fprintf(stderr, "log mirror path too long\n");
+        return -1;
+    }
+    uint32_t offset = 0;
+    FILE *mirror_file = fopen(path, "r+b");
+    if(mirror_file == NULL)
+        mirror_file = fopen(path, "w+b");
+    if(mirror_file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    fseek(mirror_file, 0, SEEK_END);
+    offset = ftell(mirror_file);
+    // the last block of a block log is written again until the power
+    // strip moves on to the next one, so it's always fetched again
+    uint8_t magic[4];
+    if(offset > 0 && fseek(mirror_file, 0, SEEK_SET) == 0 && fread(magic, 1, 4, mirror_file) == 4
+        && memcmp(magic, LOG_BLOCK_MAGIC, 4) == 0)
+        offset = (offset - 1) / LOG_BLOCK_SIZE * LOG_BLOCK_SIZE;
+    fseek(mirror_file, offset, SEEK_SET);
+    int32_t slots[PIPELINE_DEPTH];
+    // file size on the power strip isn't known until the first reply
+    uint32_t file_size = 0;
+    int32_t size_known = 0, added = 0, bad_chunks = 0;
+    while(!size_known || offset < file_size)
+    {
+        // ask for the next few chunks at once, or only one to learn the size
+        int32_t count = 0;
+        for(uint32_t o = offset; count < (size_known ? PIPELINE_DEPTH : 1) && (!size_known || o < file_size); o += LOG_CHUNK_SIZE)
+        {
+            send_buf[0] = MASTER_COMMAND_LOG_READ;
+            int32_to_char(day_utc, send_buf + 1);
+            int32_to_char(o, send_buf + 5);
+            // later chunks wait for the earlier ones to go through the link
+            slots[count] = submit_request(send_buf, 9, (count + 1) * LOG_READ_BUDGET_MS);
+            if(slots[count] < 0)
+                break;
+            count++;
+        }
+        if(count == 0)
+        {
+            fclose(mirror_file);
+            return -1;
+        }
+        // chunks are written in order, anything after a bad one is
+        // thrown away and asked for again
+        int32_t bad = 0;
+        for(int32_t i = 0; i < count; i++)
+        {
+            int32_t len = wait_for_reply(slots[i], recv_buf);
+            if(len < 0)
+            {
+                print_error(len);
+                while(++i < count)
+                    cancel_request(slots[i]);
+                fclose(mirror_file);
+                return -1;
+            }
+            if(bad)
+                continue;
+            len -= 2;
+            if(len < LOG_CHUNK_HEADER_SIZE || crc16_ccitt(0xffff, recv_buf, len) != char_to_int16(recv_buf + len)
+                || (uint32_t)char_to_int32(recv_buf + 4) != offset)
+            {
+                bad = 1;
+                if(++bad_chunks > TIMEOUT_MAX_RETRY)
+                {
+                    printf("%s: too many bad chunks\n", path);
+                    fclose(mirror_file);
+                    return -1;
+                }
+                continue;
+            }
+            file_size = char_to_int32(recv_buf);
+            size_known = 1;
+            // the file on the power strip got smaller, start over
+            if(file_size < offset)
+            {
+                printf("%s: mirror is longer than the log file, fetching it again\n", path);
+                fclose(mirror_file);
+                mirror_file = fopen(path, "wb");
+                if(mirror_file == NULL)
+                {
+                    perror(path);
+                    return -1;
+                }
+                offset = 0;
+                bad = 1;
+                continue;
+            }
+            fwrite(recv_buf + LOG_CHUNK_HEADER_SIZE, 1, len - LOG_CHUNK_HEADER_SIZE, mirror_file);
+            offset += len - LOG_CHUNK_HEADER_SIZE;
+            added += len - LOG_CHUNK_HEADER_SIZE;
+        }
+    }
+    fclose(mirror_file);
+    if(added > 0)
+        printf("%s: %d new bytes, %u total\n", path, added, file_size);
+    return added;
+}
+
+// ask power strip to toggle socket 
+void send_cmd_toggle_socket(int32_t socket_num, int32_t socket_state)
+{
+    send_buf[0] = MASTER_COMMAND_TOGGLE_SOCKET;
+    send_buf[1] = socket_num - '1';
+    send_buf[2] = socket_state;
+    send_to_client(send_buf, 3, 0, 0);
+}
+
+// ask power strip to set several sockets in one go, each socket
+// in socket_mask is set to its bit in state_mask. prints out the
+// resulting socket states
+void send_cmd_set_sockets(uint8_t socket_mask, uint8_t state_mask)
+{
+    send_buf[0] = MASTER_COMMAND_SET_SOCKETS;
+    send_buf[1] = socket_mask;
+    send_buf[2] = state_mask;
+    if(send_to_client(send_buf, 3, 0, 1) < 0)
+        return;
+    // recv_buf[0] has the state of all sockets
+    for(int32_t i = 0; i < 4; i++)
+        printf("Socket %d: %s\n", i + 1, recv_buf[0] & (1 << i) ? "ON" : "OFF");
+}
+
+// attach a header then send len bytes from start of buf to the power
+// strip, then wait for its response. budget_ms is how long the power
+// strip needs to carry it out, reply_size how long the response has
+// to be, -1 for any length. returns the response length, or one of
+// the ERR_ codes after printing what went wrong
+int32_t send_to_client(uint8_t *buf, int32_t len, int32_t budget_ms, int32_t reply_size)
+{
+    int32_t slot = submit_request(buf, len, budget_ms);
+    if(slot < 0)
+    {
+        command_failed = 1;
+        return slot;
+    }
+    int32_t rv = wait_for_reply(slot, recv_buf);
+    if(rv >= 0 && reply_size != -1 && rv != reply_size)
+        rv = ERR_REPLY;
+    if(rv >= 0)
+        return rv;
+    print_error(rv);
+    return rv;
+}
+
+// send a shed status or config request from send_buf, the events in
+// the response have to fit in it. returns 0, or one of the ERR_ codes
+int32_t send_shed_request(int32_t len, int32_t budget_ms)
+{
+    int32_t rv = send_to_client(send_buf, len, budget_ms, -1);
+    if(rv < 0)
+        return rv;
+    if(rv < SHED_STATUS_HEADER_SIZE || rv != SHED_STATUS_HEADER_SIZE + recv_buf[11] * SHED_EVENT_SIZE)
+    {
+        print_error(ERR_REPLY);
+        return ERR_REPLY;
+    }
+    return 0;
+}
+
+void print_error(int32_t err)
+{
+    command_failed = 1;
+    if(err == ERR_TIMEOUT)
+        printf("power strip is not responding\n");
+    else if(err == ERR_DISCONNECTED)
+        printf("not connected to power strip\n");
+    else if(err == ERR_REPLY)
+        printf("power strip sent a response of the wrong size\n");
+}
+
+// send len bytes from start of buf to the power strip with a new tag
+// without waiting for the response, returns the request's slot
+// number, or one of the ERR_ codes if it can't be sent
+int32_t submit_request(uint8_t *buf, int32_t len, int32_t budget_ms)
+{
+    if(len <= 0 || len > 255 || len > BUF_SIZE)
+    {
+        printf("send to client invalid message length\n");
+        return ERR_REQUEST;
+    }
+    if(sockfd == -1)
+        return ERR_DISCONNECTED;
+    for(int32_t i = 0; i < MAX_IN_FLIGHT; i++)
+    {
+        struct request_slot *r = &request_slots[i];
+        if(r->in_use)
+            continue;
+        r->in_use = 1;
+        r->answered = 0;
+        r->tag = next_tag++;
+        memcpy(r->data, buf, len);
+        r->len = len;
+        memset(r->reply, 0, REPLY_SIZE);
+        r->retries = 0;
+        r->budget_ms = budget_ms;
+        int32_t rv = transmit_request(r);
+        if(rv < 0)
+        {
+            r->in_use = 0;
+            return rv;
+        }
+        return i;
+    }
+    printf("too many requests in flight\n");
+    return ERR_REQUEST;
+}
+
+// attach a header to a request and send it out, the deadline doubles
+// with every resend. returns 0, or ERR_DISCONNECTED
+int32_t transmit_request(struct request_slot *r)
+{
+    uint8_t frame[FRAME_SIZE(BUF_SIZE)];
+    int32_t frame_len = build_frame(frame, MASTER_COMMAND_TRANSMISSION_START, r->tag, r->data, r->len);
+    if(sockfd == -1)
+        return ERR_DISCONNECTED;
+    if(send(sockfd, frame, frame_len, 0) == -1)
+    {
+        perror("send");
+        close_link();
+        return ERR_DISCONNECTED;
+    }
+    r->sent = get_time_ms();
+    r->deadline = r->sent + rtt_timeout(&link_rtt, r->retries) + r->budget_ms;
+    return 0;
+}
+
+// wait for the response of the request in slot and copy it to buf.
+// responses to other requests that arrive in the meantime are kept
+// in their own slots. resends the request if timeout happens,
+// returns the response length, or one of the ERR_ codes
+int32_t wait_for_reply(int32_t slot, uint8_t *buf)
+{
+    struct request_slot *r = &request_slots[slot];
+    while(!r->answered)
+    {
+        int32_t rv = recv_from_client(r->deadline);
+        if(rv == 0)
+            continue;
+        if(rv == ERR_TIMEOUT && ++r->retries < TIMEOUT_MAX_RETRY)
+        {
+            printf("no response in %lldms, retry #%d\n", (long long)(get_time_ms() - r->sent), r->retries);
+            rv = transmit_request(r);
+        }
+        if(rv < 0)
+        {
+            r->in_use = 0;
+            return rv;
+        }
+    }
+    memcpy(buf, r->reply, REPLY_SIZE);
+    r->in_use = 0;
+    return r->reply_len;
+}
+
+// give up on a request, its response is dropped if it ever comes
+void cancel_request(int32_t slot)
+{
+    request_slots[slot].in_use = 0;
+}
+
+// the connection to the power strip is gone, requests fail from now on
+void close_link()
+{
+    if(sockfd == -1)
+        return;
+    close(sockfd);
+    sockfd = -1;
+}
+
+void rtt_update(struct rtt_estimator *e, int64_t rtt_ms)
+{
+    if(e->samples++ == 0)
+    {
+        e->srtt_ms = rtt_ms;
+        e->rttvar_ms = rtt_ms / 2;
+    }
+    else
+    {
+        int64_t err = e->srtt_ms > rtt_ms ? e->srtt_ms - rtt_ms : rtt_ms - e->srtt_ms;
+        e->rttvar_ms = (3 * e->rttvar_ms + err) / 4;
+        e->srtt_ms = (7 * e->srtt_ms + rtt_ms) / 8;
+    }
+    e->rto_ms = e->srtt_ms + 4 * e->rttvar_ms;
+    if(e->rto_ms < RTO_MIN_MS)
+        e->rto_ms = RTO_MIN_MS;
+    if(e->rto_ms > RTO_MAX_MS)
+        e->rto_ms = RTO_MAX_MS;
+}
+
+// how long to wait for a response after the retries-th resend
+int64_t rtt_timeout(struct rtt_estimator *e, int32_t retries)
+{
+    int64_t timeout = e->rto_ms << (retries < 6 ? retries : 6);
+    return timeout > RTO_MAX_MS ? RTO_MAX_MS : timeout;
+}
+
+// listen to power strip until one response arrives or deadline
+// passes, the response is stored in the slot of the request with
+// the same tag. returns 0 for success, ERR_TIMEOUT or ERR_DISCONNECTED
+int32_t recv_from_client(int64_t deadline)
+{
+    int32_t message_length;
+    uint8_t tag;
+    uint8_t *message;
+    while(1)
+    {
+        message_length = parse_frame(rx_buf, &rx_head, rx_tail, SLAVE_COMMAND_ACK, &tag, &message);
+        if(message_length != -1 && telemetry_active && tag == telemetry_tag)
+        {
+            handle_telemetry(message, message_length);
+            return 0;
+        }
+        if(message_length != -1)
+        {
+            // late responses to requests that were resent
+            // or given up on are dropped here
+            for(int32_t i = 0; i < MAX_IN_FLIGHT; i++)
+            {
+                struct request_slot *r = &request_slots[i];
+                if(r->in_use && !r->answered && r->tag == tag)
+                {
+                    // only plain round-trips that weren't resent tell
+                    // how fast the link is
+                    if(r->retries == 0 && r->budget_ms == 0)
+                        rtt_update(&link_rtt, get_time_ms() - r->sent);
+                    memcpy(r->reply, message, message_length);
+                    r->reply_len = message_length;
+                    r->answered = 1;
+                    break;
+                }
+            }
+            return 0;
+        }
+        int64_t time_left = deadline - get_time_ms();
+        if(time_left <= 0)
+            return ERR_TIMEOUT;
+        if(fill_rx_buf(time_left) == -1)
+        {
+            close_link();
+            return ERR_DISCONNECTED;
+        }
+    }
+}
+
+// wait up to timeout_ms for the socket to become readable, then
+// pull everything available into rx_buf with a single recv().
+// returns number of bytes received, 0 on timeout, -1 on error
+int32_t fill_rx_buf(int32_t timeout_ms)
+{
+    // move unread bytes to the front to make room
+    if(rx_head > 0)
+    {
+        memmove(rx_buf, rx_buf + rx_head, rx_tail - rx_head);
+        rx_tail -= rx_head;
+        rx_head = 0;
+    }
+    // a full buffer means the stream is garbage, drop it
+    if(rx_tail == RX_BUF_SIZE)
+        rx_tail = 0;
+
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int32_t rv = poll(&pfd, 1, timeout_ms);
+    if(rv == -1)
+    {
+        if(errno == EINTR)
+            return 0;
+        perror("poll");
+        return -1;
+    }
+    if(rv == 0)
+        return 0;
+
+    ssize_t count = recv(sockfd, rx_buf + rx_tail, RX_BUF_SIZE - rx_tail, 0);
+    if(count == 0)
+    {
+        printf("connection closed by power strip\n");
+        return -1;
+    }
+    if(count == -1)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        perror("recv");
+        return -1;
+    }
+    rx_tail += count;
+    return count;
+}
+
+// milliseconds from a monotonic clock, used for timeouts
+int64_t get_time_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void print_usage()
+{
+    printf("\n");
+    printf("usage:\n");
+    printf("s[1,2,3][0,1]:      toggle socket. s10 turns socket 1 off, s21 turns socket 2 on, etc.\n");
+    printf("a1:                 turn on all sockets\n");
+    printf("a0:                 turn off all sockets\n");
+    printf("m[0,1,x]...:        set several sockets at once. m1x0 turns socket 1 on,\n");
+    printf("                    leaves socket 2 alone and turns socket 3 off\n");
+    printf("ss:                 get socket status\n");
+    printf("w#:                 get socket status # times, pipelined\n");
+    printf("tr:                 show which sockets the current limiter tripped\n");
+    printf("tl[1-4]#:           trip the socket over # mA while the limiter is on. tl25000 sets\n");
+    printf("                    socket 2 to 5A, tl20 turns its trip off\n");
+    printf("up:                 show how fast the sockets were set after the last reset\n");
+    printf("b:                  show the current budget and the latest sockets shed and restored\n");
+    printf("b#:                 shed sockets while the strip draws more than # mA, b0 turns it off\n");
+    printf("bh#:                only restore a socket if # mA of the budget stay free\n");
+    printf("bo[1-4]x4:          order sockets get shed in. bo4321 sheds socket 4 first\n");
+    printf("t#:                 stream socket status every # ms until enter is pressed\n");
+    printf("l#:                 copy new log entries of the past # days to the log mirror\n");
+    printf("lc:                 show which readings get logged\n");
+    printf("ld#:                only log readings once a current moves more than # mA,\n");
+    printf("                    ld0 logs every reading\n");
+    printf("li#:                log a reading at least every # s with a deadband\n");
+    printf("e#[h,d,w,m,y]:      get energy usage for the past # hour/day/week/month/year\n");
+    printf("eq YYYY MM DD HH MM SS YYYY MM DD HH MM SS:\n");
+    printf("                    get energy query between two timestamps\n");
+    printf("st:                 set power strip's RTC\n");
+    printf("q:                  quit\n");
+    printf("\nstart with -d to run as a daemon, or -f address_list to poll a fleet of power strips\n");
+    printf("\n");
+}
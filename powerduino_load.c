@@ -0,0 +1,290 @@
+// load driver for powerduino_sim, or for real power strips. opens one
+// connection per strip, keeps a window of pipelined commands in flight
+// on each for a fixed time, then reports commands per second and the
+// distribution of response times
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "powerduino_protocol.h"
+#define LOAD_MAX_CONNS 1024
+#define RX_BUF_SIZE 512
+#define BUF_SIZE 32
+#define ADDR_SIZE 64
+#define PORT_SIZE 8
+#define ONE_HOUR_IN_SEC 3600
+#define TAG_COUNT 256
+
+struct load_conn
+{
+    int32_t fd;
+    uint8_t rx_buf[RX_BUF_SIZE];
+    int32_t rx_head, rx_tail;
+    uint8_t next_tag;
+    int32_t in_flight;
+    int32_t mix_index;
+    // send time of each tag in flight, 0 if the tag isn't in use
+    int64_t sent_us[TAG_COUNT];
+};
+
+struct load_conn *conns;
+int32_t conn_count = 1;
+int32_t window = 1;
+int32_t duration_sec = 10;
+int32_t timeout_ms = 2000;
+char *mix = "s";
+int64_t *latencies;
+int64_t latency_count, latency_size;
+uint64_t sent_count, lost_count;
+
+int64_t get_time_us();
+int32_t open_conn(struct load_conn *c, char *host, int32_t port);
+int32_t send_next(struct load_conn *c, int64_t now_us);
+void handle_readable(struct load_conn *c, int64_t now_us);
+void expire_requests(struct load_conn *c, int64_t now_us);
+void add_latency(int64_t us);
+int compare_int64(const void *a, const void *b);
+void print_report(int64_t elapsed_us);
+void print_usage();
+
+int32_t main(int32_t argc, char *argv[])
+{
+    int32_t opt, port = atoi(WIFLY_PORT);
+    char host[ADDR_SIZE] = "127.0.0.1";
+    while((opt = getopt(argc, argv, "h:p:c:w:t:m:r:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h': strncpy(host, optarg, ADDR_SIZE - 1); break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': conn_count = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 't': duration_sec = atoi(optarg); break;
+            case 'm': mix = optarg; break;
+            case 'r': timeout_ms = atoi(optarg); break;
+            default: print_usage(); exit(1);
+        }
+    }
+    if(conn_count < 1 || conn_count > LOAD_MAX_CONNS || window < 1 || window >= TAG_COUNT || strspn(mix, "stme") != strlen(mix) || mix[0] == 0)
+    {
+        print_usage();
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int32_t epfd = epoll_create1(0);
+    conns = calloc(conn_count, sizeof(struct load_conn));
+    for(int32_t i = 0; i < conn_count; i++)
+    {
+        if(open_conn(&conns[i], host, port + i) == -1)
+        {
+            fprintf(stderr, "can not connect to %s:%d\n", host, port + i);
+            exit(1);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+    printf("%d connection%s, %d in flight each, mix \"%s\", %ds\n", conn_count, conn_count > 1 ? "s" : "", window, mix, duration_sec);
+
+    int64_t start_us = get_time_us();
+    int64_t end_us = start_us + (int64_t)duration_sec * 1000000;
+    for(int32_t i = 0; i < conn_count; i++)
+        while(conns[i].in_flight < window && send_next(&conns[i], start_us) == 0);
+
+    struct epoll_event events[64];
+    int64_t now_us = start_us;
+    while(now_us < end_us)
+    {
+        int32_t n = epoll_wait(epfd, events, 64, 10);
+        now_us = get_time_us();
+        for(int32_t i = 0; i < n; i++)
+            handle_readable(events[i].data.ptr, now_us);
+        for(int32_t i = 0; i < conn_count; i++)
+        {
+            expire_requests(&conns[i], now_us);
+            // keep the window full
+            while(conns[i].fd != -1 && conns[i].in_flight < window && send_next(&conns[i], now_us) == 0);
+        }
+    }
+    print_report(now_us - start_us);
+    return 0;
+}
+
+void print_usage()
+{
+    fprintf(stderr, "usage: powerduino_load [-h host] [-p port] [-c connections] [-w window]\n");
+    fprintf(stderr, "                       [-t seconds] [-m mix] [-r timeout_ms]\n");
+    fprintf(stderr, "connection i goes to port + i, mix is made of s(tatus), t(oggle),\n");
+    fprintf(stderr, "m(ulti-socket set) and e(nergy query), sent round robin\n");
+}
+
+int64_t get_time_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int32_t open_conn(struct load_conn *c, char *host, int32_t port)
+{
+    struct addrinfo hints, *servinfo;
+    char port_str[PORT_SIZE];
+    int32_t yes = 1;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, PORT_SIZE, "%d", port);
+    c->fd = -1;
+    if(getaddrinfo(host, port_str, &hints, &servinfo) != 0)
+        return -1;
+    c->fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if(c->fd == -1 || connect(c->fd, servinfo->ai_addr, servinfo->ai_addrlen) == -1)
+    {
+        freeaddrinfo(servinfo);
+        return -1;
+    }
+    freeaddrinfo(servinfo);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    return 0;
+}
+
+// send the next command of the mix, returns -1 if it can't be sent
+int32_t send_next(struct load_conn *c, int64_t now_us)
+{
+    uint8_t data[BUF_SIZE];
+    uint8_t frame[FRAME_SIZE(BUF_SIZE)];
+    int32_t len = 0;
+    // skip tags that are still waiting for a response
+    while(c->sent_us[c->next_tag] != 0)
+        c->next_tag++;
+    uint8_t tag = c->next_tag++;
+    switch(mix[c->mix_index++ % strlen(mix)])
+    {
+        case 's':
+        data[0] = MASTER_COMMAND_REQUEST_SOCKET_STATUS;
+        len = 1;
+        break;
+
+        case 't':
+        data[0] = MASTER_COMMAND_TOGGLE_SOCKET;
+        data[1] = rand() % 3;
+        data[2] = rand() % 2;
+        len = 3;
+        break;
+
+        case 'm':
+        data[0] = MASTER_COMMAND_SET_SOCKETS;
+        data[1] = 0x7;
+        data[2] = rand() % 8;
+        len = 3;
+        break;
+
+        case 'e':
+        data[0] = MASTER_COMMAND_ENERGY_QUERY;
+        int32_to_char(time(0) - ONE_HOUR_IN_SEC, data + 1);
+        int32_to_char(time(0), data + 5);
+        len = 9;
+        break;
+    }
+    int32_t frame_len = build_frame(frame, MASTER_COMMAND_TRANSMISSION_START, tag, data, len);
+    if(send(c->fd, frame, frame_len, 0) != frame_len)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->sent_us[tag] = now_us;
+    c->in_flight++;
+    sent_count++;
+    return 0;
+}
+
+void handle_readable(struct load_conn *c, int64_t now_us)
+{
+    uint8_t tag;
+    uint8_t *data;
+    if(c->rx_head > 0)
+    {
+        memmove(c->rx_buf, c->rx_buf + c->rx_head, c->rx_tail - c->rx_head);
+        c->rx_tail -= c->rx_head;
+        c->rx_head = 0;
+    }
+    if(c->rx_tail == RX_BUF_SIZE)
+        c->rx_tail = 0;
+    ssize_t count = recv(c->fd, c->rx_buf + c->rx_tail, RX_BUF_SIZE - c->rx_tail, MSG_DONTWAIT);
+    if(count <= 0)
+    {
+        if(count == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            fprintf(stderr, "connection closed\n");
+            close(c->fd);
+            c->fd = -1;
+        }
+        return;
+    }
+    c->rx_tail += count;
+    while(parse_frame(c->rx_buf, &c->rx_head, c->rx_tail, SLAVE_COMMAND_ACK, &tag, &data) != -1)
+    {
+        // responses that already timed out are ignored
+        if(c->sent_us[tag] == 0)
+            continue;
+        add_latency(now_us - c->sent_us[tag]);
+        c->sent_us[tag] = 0;
+        c->in_flight--;
+    }
+}
+
+// requests without a response after timeout_ms count as lost
+void expire_requests(struct load_conn *c, int64_t now_us)
+{
+    for(int32_t i = 0; i < TAG_COUNT && c->in_flight > 0; i++)
+        if(c->sent_us[i] != 0 && now_us - c->sent_us[i] > (int64_t)timeout_ms * 1000)
+        {
+            c->sent_us[i] = 0;
+            c->in_flight--;
+            lost_count++;
+        }
+}
+
+void add_latency(int64_t us)
+{
+    if(latency_count == latency_size)
+    {
+        latency_size = latency_size ? latency_size * 2 : 4096;
+        latencies = realloc(latencies, latency_size * sizeof(int64_t));
+    }
+    latencies[latency_count++] = us;
+}
+
+int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void print_report(int64_t elapsed_us)
+{
+    printf("sent %llu, answered %lld, lost %llu in %.2fs\n", (unsigned long long)sent_count,
+        (long long)latency_count, (unsigned long long)lost_count, (double)elapsed_us / 1000000);
+    if(latency_count == 0)
+        return;
+    qsort(latencies, latency_count, sizeof(int64_t), compare_int64);
+    printf("%.1f commands/s\n", (double)latency_count * 1000000 / elapsed_us);
+    printf("latency ms: min %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+        (double)latencies[0] / 1000,
+        (double)latencies[latency_count / 2] / 1000,
+        (double)latencies[latency_count * 90 / 100] / 1000,
+        (double)latencies[latency_count * 99 / 100] / 1000,
+        (double)latencies[latency_count - 1] / 1000);
+}
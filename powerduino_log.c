@@ -0,0 +1,159 @@
+// converts day log files copied off the SD card, or out of the PC
+// client's log mirror, to the packed block format of LOG_VERSION. any
+// version is read, a block at a time, so files of any size stream
+// through. with -p the entries are printed instead
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "powerduino_protocol.h"
+#define PATH_SIZE 256
+
+int32_t print_only = 0;
+
+int32_t convert_log(const char *path);
+int32_t read_log_block(FILE *fp, const struct log_layout *layout, uint32_t index, uint8_t *buf, struct log_cursor *cursor);
+void print_entry(const struct log_entry *e);
+void print_usage();
+
+int32_t main(int32_t argc, char *argv[])
+{
+    int32_t opt, failed = 0;
+    while((opt = getopt(argc, argv, "p")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p': print_only = 1; break;
+            default: print_usage(); exit(1);
+        }
+    }
+    if(optind == argc)
+    {
+        print_usage();
+        exit(1);
+    }
+    for(int32_t i = optind; i < argc; i++)
+        if(convert_log(argv[i]) == -1)
+            failed = 1;
+    return failed;
+}
+
+void print_usage()
+{
+    fprintf(stderr, "usage: powerduino_log [-p] day_log...\n");
+    fprintf(stderr, "rewrites each day log file in the packed block format, torn blocks\n");
+    fprintf(stderr, "are left out. -p prints the entries and leaves the files alone\n");
+}
+
+// read path and write it to path.new block by block, then put it in
+// place of path. returns -1 if it fails
+int32_t convert_log(const char *path)
+{
+    char new_path[PATH_SIZE];
+    uint8_t in_block[LOG_BLOCK_SIZE];
+    uint8_t out_block[LOG_BLOCK_SIZE];
+    struct log_layout layout;
+    struct log_cursor cursor;
+    struct log_tail tail;
+    const struct log_entry *entry;
+    FILE *out = NULL;
+    int32_t torn = 0;
+    uint32_t out_size = 0;
+    FILE *in = fopen(path, "rb");
+    if(in == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    int32_t len = fread(in_block, 1, LOG_HEADER_SIZE, in);
+    fseek(in, 0, SEEK_END);
+    log_get_layout(&layout, in_block, len, ftell(in));
+    if(!print_only)
+    {
+        snprintf(new_path, PATH_SIZE, "%s.new", path);
+        out = fopen(new_path, "wb");
+        if(out == NULL)
+        {
+            perror(new_path);
+            fclose(in);
+            return -1;
+        }
+    }
+    log_recover_tail(&tail, out_block, 0, 0);
+    uint32_t count = log_block_count(&layout);
+    for(uint32_t b = 0; b < count; b++)
+    {
+        if(read_log_block(in, &layout, b, in_block, &cursor) < 0)
+        {
+            torn++;
+            continue;
+        }
+        while((entry = log_next_entry(&cursor)) != NULL)
+        {
+            if(print_only)
+            {
+                print_entry(entry);
+                continue;
+            }
+            // entries keep the interval they were logged with
+            uint8_t interval = cursor.interval_sec > LOG_PERIOD_SEC ? cursor.interval_sec / LOG_PERIOD_SEC : 0;
+            if(log_tail_append(&tail, out_block, entry, interval) == -1)
+            {
+                log_seal_block(out_block, tail.index, tail.count, tail.interval);
+                out_size += fwrite(out_block, 1, LOG_BLOCK_SIZE, out);
+                log_tail_next(&tail, out_block);
+                log_tail_append(&tail, out_block, entry, interval);
+            }
+        }
+    }
+    fclose(in);
+    if(torn > 0)
+        fprintf(stderr, "%s: %d torn blocks left out\n", path, torn);
+    if(print_only)
+        return 0;
+    if(tail.count > 0)
+    {
+        log_seal_block(out_block, tail.index, tail.count, tail.interval);
+        out_size += fwrite(out_block, 1, LOG_BLOCK_SIZE, out);
+    }
+    if(fclose(out) != 0 || out_size != (tail.index + (tail.count > 0)) * LOG_BLOCK_SIZE)
+    {
+        perror(new_path);
+        unlink(new_path);
+        return -1;
+    }
+    if(rename(new_path, path) == -1)
+    {
+        perror(path);
+        unlink(new_path);
+        return -1;
+    }
+    printf("%s: %u bytes, was %u\n", path, out_size, layout.file_size);
+    return 0;
+}
+
+// like the firmware's read_log_block()
+int32_t read_log_block(FILE *fp, const struct log_layout *layout, uint32_t index, uint8_t *buf, struct log_cursor *cursor)
+{
+    if(fseek(fp, log_block_offset(layout, index), SEEK_SET) != 0)
+        return -1;
+    int32_t len = fread(buf, 1, log_block_length(layout), fp);
+    if(len <= 0)
+        return -1;
+    return log_block_entries(layout, index, buf, len, cursor);
+}
+
+// time, then current in mA, real power in W of each socket, and the
+// mains voltage
+void print_entry(const struct log_entry *e)
+{
+    char time_str[32];
+    time_t t = e->time;
+    strftime(time_str, sizeof time_str, "%Y-%m-%d %H:%M:%S", gmtime(&t));
+    printf("%s", time_str);
+    for(int32_t i = 0; i < 4; i++)
+        printf(" %5u %6.1f", e->current[i], (double)e->power[i] / 10);
+    printf(" %5.1f\n", (double)e->voltage / 10);
+}
@@ -0,0 +1,368 @@
+// current and power metering that doesn't depend on Arduino, shared by the
+// firmware and powerduino_sim. samples come in as blocks of interleaved
+// raw ADC readings, one per scan slot, from the firmware's DMA ring
+// buffers or from synthetic waveforms on a PC. each current sample has a
+// voltage sample taken at the same moment by the other ADC
+#ifndef POWERDUINO_METERING_H
+#define POWERDUINO_METERING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define METERING_MAX_CHANNELS 4
+#define MAINS_HZ 60
+#define METERING_SAMPLES_PER_CYCLE 64
+// RMS is taken over whole mains cycles so the ripple cancels out
+#define METERING_WINDOW_CYCLES 4
+#define METERING_WINDOW_SAMPLES (METERING_SAMPLES_PER_CYCLE * METERING_WINDOW_CYCLES)
+#define METERING_WINDOW_US (1000000 * METERING_WINDOW_CYCLES / MAINS_HZ)
+// readings handed out are the average of this many windows
+#define METERING_AVERAGE_WINDOWS 16
+// the ADC runs in 16 bit mode, analogReadResolution(13) only shifts
+// analogRead() results. the current sensors read +-25A over its range
+#define METERING_ADC_COUNTS 65536
+#define METERING_FULL_SCALE_MA 50000
+// what the full range of the voltage sense input is in 0.1V, measured
+// at a socket
+#define METERING_FULL_SCALE_DV 5000
+// anything at or below this is sensor noise
+#define METERING_NOISE_FLOOR_MA 60
+// overcurrent trips look at RMS over a sliding half cycle, and trip at
+// once on a sample past TRIP_PEAK_PERCENT of the peak of a sine at the
+// limit
+#define TRIP_HALF_CYCLE (METERING_SAMPLES_PER_CYCLE / 2)
+#define TRIP_PEAK_PERCENT 200
+#define TRIP_NONE 0
+#define TRIP_RMS 1
+#define TRIP_PEAK 2
+
+// sums over the current window of one channel. samples are centered on
+// 0 first so the products fit the 16 bit multiply-accumulates
+struct metering_channel
+{
+	int32_t sum_i, sum_v;
+	int64_t sqsum_i, sqsum_v, sum_vi;
+};
+
+struct metering
+{
+	int32_t channels;
+	// samples per scan round, the slots after the metered channels
+	// belong to something else and are skipped
+	int32_t stride;
+	// position in the window, counted in samples per channel
+	int32_t sample_count;
+	struct metering_channel acc[METERING_MAX_CHANNELS];
+	// subtracted from each channel's reading, for sensors that read high
+	uint16_t offset_mA[METERING_MAX_CHANNELS];
+	// readings of the last complete window: RMS current in mA, real
+	// power in 0.1W and RMS voltage in 0.1V
+	uint16_t window_mA[METERING_MAX_CHANNELS];
+	int32_t window_dW[METERING_MAX_CHANNELS];
+	uint16_t window_dV;
+	uint16_t history_mA[METERING_MAX_CHANNELS][METERING_AVERAGE_WINDOWS];
+	int32_t history_dW[METERING_MAX_CHANNELS][METERING_AVERAGE_WINDOWS];
+	uint16_t history_dV[METERING_AVERAGE_WINDOWS];
+	// sums of the histories, so the averages are O(1)
+	uint32_t history_sum_mA[METERING_MAX_CHANNELS];
+	int32_t history_sum_dW[METERING_MAX_CHANNELS];
+	uint32_t history_sum_dV;
+	int32_t history_index;
+	uint32_t windows;
+};
+
+static inline void metering_init(struct metering *m, int32_t channels, int32_t stride)
+{
+	memset(m, 0, sizeof(struct metering));
+	m->channels = channels;
+	m->stride = stride;
+}
+
+// integer square root, rounded down. no FPU needed, the Teensy 3.1 has
+// to emulate doubles in software
+static inline uint32_t isqrt64(uint64_t v)
+{
+	uint64_t root = 0;
+	uint64_t bit = (uint64_t)1 << 62;
+	while(bit > v)
+		bit >>= 2;
+	while(bit != 0)
+	{
+		if(v >= root + bit)
+		{
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+			root >>= 1;
+		bit >>= 2;
+	}
+	return (uint32_t)root;
+}
+
+#if defined(__ARM_FEATURE_DSP)
+// acc + x.lo * y.lo + x.hi * y.hi, signed 16 bit halves
+static inline int64_t metering_smlald(uint32_t x, uint32_t y, int64_t acc)
+{
+	__asm__("smlald %Q0, %R0, %1, %2" : "+r"(acc) : "r"(x), "r"(y));
+	return acc;
+}
+#endif
+
+// add count samples of one channel, stride apart, to its sums
+static inline void metering_accumulate(struct metering_channel *c, const volatile uint16_t *current, const volatile uint16_t *voltage, int32_t stride, int32_t count)
+{
+	int32_t n = 0;
+#if defined(__ARM_FEATURE_DSP)
+	// two samples at a time in the halves of a word, flipping the top
+	// bit of each half centers them on 0
+	for(; n + 1 < count; n += 2)
+	{
+		uint32_t i2 = (current[n * stride] | (uint32_t)current[(n + 1) * stride] << 16) ^ 0x80008000;
+		uint32_t v2 = (voltage[n * stride] | (uint32_t)voltage[(n + 1) * stride] << 16) ^ 0x80008000;
+		c->sum_i += (int16_t)i2 + ((int32_t)i2 >> 16);
+		c->sum_v += (int16_t)v2 + ((int32_t)v2 >> 16);
+		c->sqsum_i = metering_smlald(i2, i2, c->sqsum_i);
+		c->sqsum_v = metering_smlald(v2, v2, c->sqsum_v);
+		c->sum_vi = metering_smlald(i2, v2, c->sum_vi);
+	}
+#endif
+	for(; n < count; n++)
+	{
+		int32_t i = current[n * stride] - METERING_ADC_COUNTS / 2;
+		int32_t v = voltage[n * stride] - METERING_ADC_COUNTS / 2;
+		c->sum_i += i;
+		c->sum_v += v;
+		c->sqsum_i += i * i;
+		c->sqsum_v += v * v;
+		c->sum_vi += i * v;
+	}
+}
+
+// n^2 times the variance, exact in 64 bits for 16 bit samples and
+// windows of up to 65536 samples
+static inline uint64_t metering_variance_n2(int64_t n, int64_t sqsum, int32_t sum)
+{
+	return n * sqsum - (int64_t)sum * sum;
+}
+
+// end of a window: RMS current and voltage and real power of each
+// channel, with the DC offset of the sensors taken out. real power is
+// the mean of v * i, the current sensor's noise has nothing to do with
+// the voltage and mostly averages out of it
+static inline void metering_finish_window(struct metering *m)
+{
+	int64_t n = m->sample_count;
+	uint32_t dV = 0;
+	for(int32_t ch = 0; ch < m->channels; ch++)
+	{
+		struct metering_channel *c = &m->acc[ch];
+		int32_t mA = (int32_t)((uint64_t)isqrt64(metering_variance_n2(n, c->sqsum_i, c->sum_i)) * METERING_FULL_SCALE_MA / (METERING_ADC_COUNTS * n)) - m->offset_mA[ch];
+		dV += (uint64_t)isqrt64(metering_variance_n2(n, c->sqsum_v, c->sum_v)) * METERING_FULL_SCALE_DV / (METERING_ADC_COUNTS * n);
+		// in counts^2, then mA * 0.1V / 1000 is 0.1W
+		int64_t vi = (n * c->sum_vi - (int64_t)c->sum_i * c->sum_v) / (n * n);
+		int32_t dW = vi * METERING_FULL_SCALE_MA * METERING_FULL_SCALE_DV / ((int64_t)METERING_ADC_COUNTS * METERING_ADC_COUNTS * 1000);
+		m->window_mA[ch] = mA <= METERING_NOISE_FLOOR_MA ? 0 : mA;
+		m->window_dW[ch] = m->window_mA[ch] == 0 ? 0 : dW;
+		m->history_sum_mA[ch] += m->window_mA[ch] - m->history_mA[ch][m->history_index];
+		m->history_mA[ch][m->history_index] = m->window_mA[ch];
+		m->history_sum_dW[ch] += m->window_dW[ch] - m->history_dW[ch][m->history_index];
+		m->history_dW[ch][m->history_index] = m->window_dW[ch];
+		memset(c, 0, sizeof(struct metering_channel));
+	}
+	// every channel sees the same mains voltage
+	m->window_dV = dV / m->channels;
+	m->history_sum_dV += m->window_dV - m->history_dV[m->history_index];
+	m->history_dV[m->history_index] = m->window_dV;
+	m->history_index = (m->history_index + 1) % METERING_AVERAGE_WINDOWS;
+	m->sample_count = 0;
+	m->windows++;
+}
+
+// take count interleaved current samples and the voltage samples taken
+// with them. the first of each belongs to slot 0 and count is a multiple
+// of the stride. returns the number of windows completed
+static inline int32_t metering_feed(struct metering *m, const volatile uint16_t *current, const volatile uint16_t *voltage, int32_t count)
+{
+	int32_t completed = 0;
+	int32_t rounds = count / m->stride;
+	while(rounds > 0)
+	{
+		// up to the end of the window
+		int32_t n = METERING_WINDOW_SAMPLES - m->sample_count;
+		if(n > rounds)
+			n = rounds;
+		for(int32_t ch = 0; ch < m->channels; ch++)
+			metering_accumulate(&m->acc[ch], current + ch, voltage + ch, m->stride, n);
+		current += n * m->stride;
+		voltage += n * m->stride;
+		rounds -= n;
+		m->sample_count += n;
+		if(m->sample_count == METERING_WINDOW_SAMPLES)
+		{
+			metering_finish_window(m);
+			completed++;
+		}
+	}
+	return completed;
+}
+
+// current of a channel in mA, averaged over the last windows
+static inline uint16_t metering_current(const struct metering *m, int32_t ch)
+{
+	return m->history_sum_mA[ch] / METERING_AVERAGE_WINDOWS;
+}
+
+// real power of a channel in 0.1W, averaged over the last windows
+static inline int32_t metering_power(const struct metering *m, int32_t ch)
+{
+	return m->history_sum_dW[ch] / METERING_AVERAGE_WINDOWS;
+}
+
+// RMS mains voltage in 0.1V, averaged over the last windows
+static inline uint16_t metering_voltage(const struct metering *m)
+{
+	return m->history_sum_dV / METERING_AVERAGE_WINDOWS;
+}
+
+// real power over apparent power of a channel in 1/1000, 0 for a
+// channel that draws nothing
+static inline int32_t metering_power_factor(const struct metering *m, int32_t ch)
+{
+	int64_t dVA = (int64_t)metering_voltage(m) * metering_current(m, ch) / 1000;
+	if(dVA == 0)
+		return 0;
+	// both are averaged separately, so it can come out a bit over
+	int32_t pf = metering_power(m, ch) * 1000 / dVA;
+	return pf > 1000 ? 1000 : pf;
+}
+
+// overcurrent detection for one channel
+struct trip_channel
+{
+	// 0 turns it off
+	uint32_t limit_counts;
+	// the sensor's output at 0A, a slow average, in 1/4096 counts
+	int32_t center_q12;
+	// squares of the last half cycle of samples
+	uint32_t squares[TRIP_HALF_CYCLE];
+	uint64_t sqsum;
+	int32_t filled;
+	// the first sample past the peak of a sine at the limit after a
+	// quiet half cycle is where a fault is taken to start
+	uint32_t over_round, onset_round;
+	// latched until trip_clear()
+	uint8_t fault;
+	uint32_t latency_rounds;
+};
+
+// runs on samples as they come in, well ahead of the metering windows.
+// a round is one sample of every slot, trip latency is counted in those
+struct trip_detector
+{
+	int32_t channels;
+	int32_t stride;
+	uint32_t rounds;
+	struct trip_channel ch[METERING_MAX_CHANNELS];
+};
+
+static inline void trip_init(struct trip_detector *t, int32_t channels, int32_t stride)
+{
+	memset(t, 0, sizeof(struct trip_detector));
+	t->channels = channels;
+	t->stride = stride;
+	for(int32_t ch = 0; ch < channels; ch++)
+		t->ch[ch].center_q12 = (METERING_ADC_COUNTS / 2) << 12;
+}
+
+static inline void trip_reset_window(struct trip_channel *c)
+{
+	c->sqsum = 0;
+	c->filled = 0;
+	memset(c->squares, 0, sizeof(c->squares));
+}
+
+// forget the fault and the samples before it, for a socket that was
+// just switched back on
+static inline void trip_clear(struct trip_detector *t, int32_t ch)
+{
+	t->ch[ch].fault = TRIP_NONE;
+	t->ch[ch].latency_rounds = 0;
+	trip_reset_window(&t->ch[ch]);
+}
+
+// 0 turns the channel's trip off
+static inline void trip_set_limit(struct trip_detector *t, int32_t ch, uint32_t limit_mA)
+{
+	uint32_t limit_counts = (uint64_t)limit_mA * METERING_ADC_COUNTS / METERING_FULL_SCALE_MA;
+	if(limit_counts == t->ch[ch].limit_counts)
+		return;
+	t->ch[ch].limit_counts = limit_counts;
+	trip_reset_window(&t->ch[ch]);
+}
+
+// take count interleaved samples like metering_feed(). returns a bit
+// for each channel that tripped on them
+static inline uint8_t trip_feed(struct trip_detector *t, const volatile uint16_t *samples, int32_t count)
+{
+	uint8_t tripped = 0;
+	for(int32_t i = 0; i + t->stride <= count; i += t->stride)
+	{
+		uint32_t round = t->rounds++;
+		for(int32_t ch = 0; ch < t->channels; ch++)
+		{
+			struct trip_channel *c = &t->ch[ch];
+			int32_t x = ((int32_t)samples[i + ch] << 12) - c->center_q12;
+			c->center_q12 += x >> 12;
+			if(c->limit_counts == 0 || c->fault != TRIP_NONE)
+				continue;
+			x >>= 12;
+			uint32_t ax = x < 0 ? -x : x;
+			uint32_t sq = ax * ax;
+			int32_t pos = round % TRIP_HALF_CYCLE;
+			c->sqsum = c->sqsum + sq - c->squares[pos];
+			c->squares[pos] = sq;
+			if(c->filled < TRIP_HALF_CYCLE)
+				c->filled++;
+			// past sqrt(2) * limit
+			if(ax * 100 > c->limit_counts * 141)
+			{
+				if(round - c->over_round > TRIP_HALF_CYCLE)
+					c->onset_round = round;
+				c->over_round = round;
+			}
+			if(ax * 100 > c->limit_counts * 141 / 100 * TRIP_PEAK_PERCENT)
+				c->fault = TRIP_PEAK;
+			else if(c->filled == TRIP_HALF_CYCLE && c->sqsum > (uint64_t)c->limit_counts * c->limit_counts * TRIP_HALF_CYCLE)
+				c->fault = TRIP_RMS;
+			else
+				continue;
+			// a fault that never went past the peak of the limit's sine
+			// started a half cycle ago at the latest
+			if(round - c->over_round > TRIP_HALF_CYCLE)
+				c->onset_round = round - TRIP_HALF_CYCLE;
+			c->latency_rounds = round - c->onset_round;
+			tripped |= 1 << ch;
+		}
+	}
+	return tripped;
+}
+
+// a bit for each channel whose fault is latched. whatever switches
+// their relays has to keep them open until trip_clear()
+static inline uint8_t trip_latched(const struct trip_detector *t)
+{
+	uint8_t latched = 0;
+	for(int32_t ch = 0; ch < t->channels; ch++)
+		if(t->ch[ch].fault != TRIP_NONE)
+			latched |= 1 << ch;
+	return latched;
+}
+
+// rounds come at METERING_SAMPLES_PER_CYCLE per mains cycle
+static inline uint32_t trip_rounds_to_us(uint32_t rounds)
+{
+	return (uint64_t)rounds * 1000000 / (METERING_SAMPLES_PER_CYCLE * MAINS_HZ);
+}
+
+#endif
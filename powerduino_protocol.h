@@ -0,0 +1,761 @@
+// wire protocol between the power strip and the programs that talk to it.
+// shared by the firmware, powerduino_PC, powerduino_sim and powerduino_load
+#ifndef POWERDUINO_PROTOCOL_H
+#define POWERDUINO_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define WIFLY_PORT "2000"
+#define MASTER_COMMAND_TRANSMISSION_START 31
+#define SLAVE_COMMAND_ACK 30
+#define MASTER_COMMAND_TOGGLE_SOCKET 29
+#define MASTER_COMMAND_REQUEST_SOCKET_STATUS 28
+#define MASTER_COMMAND_SET_TIME 27
+#define MASTER_COMMAND_ENERGY_QUERY 26
+#define MASTER_COMMAND_SET_SOCKETS 25
+#define MASTER_COMMAND_SUBSCRIBE 24
+#define MASTER_COMMAND_LOG_READ 23
+#define MASTER_COMMAND_TRIP_STATUS 22
+#define MASTER_COMMAND_SHED_CONFIG 21
+#define MASTER_COMMAND_SHED_STATUS 20
+#define MASTER_COMMAND_BOOT_STATUS 19
+#define MASTER_COMMAND_LOG_CONFIG 18
+#define MASTER_COMMAND_TRIP_CONFIG 17
+// each frame: START or ACK, tag, data, crc16_ccitt() of all that. it goes
+// out COBS encoded between two 0 bytes, so a 0 always marks a frame boundary
+#define MAX_FRAME_DATA_SIZE 255
+// bytes on the wire for a frame with len bytes of data
+#define FRAME_SIZE(len) ((len) + 4 + ((len) + 4) / 254 + 1 + 2)
+// socket status: socket states 1B, current of each socket in mA 4 * 2B,
+// real power of each socket in 0.1W 4 * 2B, mains voltage in 0.1V 2B
+#define SOCKET_STATUS_SIZE 19
+#define ENERGY_RESULT_SIZE 16
+// trip status: for each socket its trip 1B, 0 for none, 1 for RMS over
+// the limit, 2 for a peak way over it, and the time from the fault to
+// the trip in us 2B. then
+// the current limit of each socket in mA 4 * 2B, 0 when the limiter or
+// the socket's trip is off
+#define TRIP_STATUS_SIZE 20
+// trip config: socket index 1B, its current limit in mA 2B, 0 turns its
+// trip off, up to METERING_FULL_SCALE_MA. the reply is a trip status
+#define TRIP_CONFIG_SIZE 3
+// shed config: current budget of the whole strip in mA 2B, 0 for none,
+// hysteresis in mA 2B, socket indices in the order they get shed 4 * 1B.
+// the reply is a shed status with no events.
+// shed status: sequence number of the first event wanted 2B. reply: the
+// config as above 8B, sockets shed now 1B, sequence number of the next
+// event 2B, count 1B, then count events, oldest first: sequence number
+// 2B, time 4B, socket index 1B with SHED_EVENT_RESTORE set if it was
+// switched back on, total current of the strip in mA 2B
+#define SHED_STATUS_HEADER_SIZE 12
+#define SHED_EVENT_SIZE 9
+#define SHED_EVENT_MAX 8
+#define SHED_EVENT_RESTORE 0x80
+#define SHED_STATUS_MAX_SIZE (SHED_STATUS_HEADER_SIZE + SHED_EVENT_MAX * SHED_EVENT_SIZE)
+// boot status: where the sockets got their state from after the last
+// reset 1B, one of BOOT_FROM_*, time from the reset to the sockets being
+// set in us 4B, time from the reset to the SD card being mounted in ms
+// 4B, BOOT_CARD_NOT_MOUNTED until it is
+#define BOOT_STATUS_SIZE 9
+#define BOOT_FROM_NOTHING 0
+#define BOOT_FROM_SNAPSHOT 1
+#define BOOT_FROM_STATE_FILE 2
+#define BOOT_CARD_NOT_MOUNTED 0xffffffff
+// log config: deadband in mA 2B, 0 logs every reading, longest time
+// between two entries in s 2B, from LOG_PERIOD_SEC to
+// LOG_MAX_INTERVAL_SEC. an interval of 0 leaves the config as it is.
+// reply: the config the power strip has now, same layout
+#define LOG_CONFIG_SIZE 4
+// telemetry frames carry the tag of MASTER_COMMAND_SUBSCRIBE. first byte is
+// the sequence number, with TELEMETRY_KEY_FRAME set on key frames. second
+// byte has socket states in the low nibble and a mask of the currents that
+// follow in the high nibble. then one zig-zag varint per current in the
+// mask, the change since the previous frame, or the reading itself in a
+// key frame. key frames carry all four currents
+#define TELEMETRY_KEY_FRAME 0x80
+#define TELEMETRY_SEQ_MASK 0x7f
+#define TELEMETRY_KEY_FRAME_INTERVAL 16
+#define TELEMETRY_MAX_SIZE (2 + 4 * 3)
+// day log files from version 3 on are made of LOG_BLOCK_SIZE blocks,
+// each written whole, and only the last one is ever rewritten, so a power
+// cut can only tear that one. block header: LOG_BLOCK_MAGIC 4B, version
+// 1B, entry size 1B, count 1B, interval 1B, sequence number 4B, which
+// is the index of the block in the file. then count entries, and
+// crc16_ccitt() of the rest of the block in its last 2B. version 3
+// blocks hold version 2 entries. version 4 blocks pack them: a zig-zag
+// varint of the change in time, then one of the change in each current,
+// each power and the voltage, from the entry before in the block. the
+// first entry of a block is packed against all 0s, so it has the block's
+// base time in full, and each block can be read on its own. a file can
+// have blocks of both versions.
+// each entry has the readings of the LOG_PERIOD_SEC up to its time. with
+// a deadband, readings that stay within it of the last entry aren't
+// logged, and that entry's power holds until the next one. the interval
+// is the longest the writer went without an entry, in LOG_PERIOD_SEC, 0
+// for an entry every LOG_PERIOD_SEC. entries further apart than that have
+// no readings between them, the strip was off or wasn't logging.
+// version 2 files start with a header instead: LOG_MAGIC 4B, version 1B,
+// entry size 1B, 2B reserved, and entries follow one after the other.
+// files from before the header are version 1, made of LOG_ENTRY_V1_SIZE
+// entries: time 4B, current of each socket in mA 4 * 2B. version 2
+// entries go on with the real power of each socket in 0.1W 4 * 2B and
+// the mains voltage in 0.1V 2B
+#define LOG_MAGIC "PDLG"
+#define LOG_HEADER_SIZE 8
+#define LOG_BLOCK_MAGIC "PDLB"
+#define LOG_BLOCK_SIZE 512
+#define LOG_BLOCK_HEADER_SIZE 12
+#define LOG_BLOCK_DATA_SIZE (LOG_BLOCK_SIZE - LOG_BLOCK_HEADER_SIZE - 2)
+#define LOG_BLOCK_ENTRIES(entry_size) (LOG_BLOCK_DATA_SIZE / (entry_size))
+#define LOG_FIXED_VERSION 3
+#define LOG_VERSION 4
+#define LOG_PACKED_ENTRY_MAX (5 + 9 * 3)
+#define LOG_PACKED_MAX_COUNT 255
+#define LOG_PERIOD_SEC 10
+#define LOG_MAX_INTERVAL_SEC (255 * LOG_PERIOD_SEC)
+#define LOG_DEFAULT_MAX_INTERVAL_SEC 300
+#define LOG_HOUR_SEC 3600
+#define LOG_DAY_SEC 86400
+// an hour is rolled up this long after it ends, once the first reading
+// of the next hour is in its log
+#define LOG_SETTLE_SEC (2 * LOG_PERIOD_SEC)
+#define LOG_ENTRY_V1_SIZE 12
+#define LOG_ENTRY_SIZE 22
+// version 1 entries don't have the voltage, power is worked out for 120V
+#define LOG_V1_MAINS_DV 1200
+// log read: any time in the day 4B, offset into that day's log file 4B.
+// reply: file size 4B, offset 4B, up to LOG_CHUNK_SIZE bytes of the
+// file from offset, then crc16_ccitt() of everything before it 2B
+#define LOG_CHUNK_SIZE 192
+#define LOG_CHUNK_HEADER_SIZE 8
+#define LOG_CHUNK_MAX_SIZE (LOG_CHUNK_HEADER_SIZE + LOG_CHUNK_SIZE + 2)
+
+// fill the byte array with each byte in an int32_t, little endian
+static inline void int32_to_char(int32_t int32, uint8_t *c)
+{
+	c[0] = int32 & 0xff;
+	c[1] = (int32 & 0xff00) >> 8;
+	c[2] = (int32 & 0xff0000) >> 16;
+	c[3] = (int32 & 0xff000000) >> 24;
+}
+
+// fill the byte array with each byte in an int16_t, little endian
+static inline void int16_to_char(int32_t int16, uint8_t *c)
+{
+	c[0] = int16 & 0xff;
+	c[1] = (int16 & 0xff00) >> 8;
+}
+
+// extract an unsigned 16 bit value from a byte array, little endian
+static inline int32_t char_to_int16(const uint8_t *c)
+{
+	int32_t ret = 0;
+	ret = c[0];
+	ret |= c[1] << 8;
+	return ret;
+}
+
+// extract an int32_t from a byte array, little endian
+static inline int32_t char_to_int32(const uint8_t *c)
+{
+	uint32_t ret = 0;
+	ret = c[0];
+	ret |= (uint32_t)c[1] << 8;
+	ret |= (uint32_t)c[2] << 16;
+	ret |= (uint32_t)c[3] << 24;
+	return (int32_t)ret;
+}
+
+// CRC-16/CCITT-FALSE, start with crc = 0xffff
+static inline uint16_t crc16_ccitt(uint16_t crc, const uint8_t *data, int32_t len)
+{
+	for(int32_t i = 0; i < len; i++)
+	{
+		crc ^= (uint16_t)data[i] << 8;
+		for(int32_t j = 0; j < 8; j++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+// COBS: copy len bytes from in to out so that out has no 0 bytes, out
+// needs room for len + len / 254 + 1 bytes. returns the encoded length
+static inline int32_t cobs_encode(const uint8_t *in, int32_t len, uint8_t *out)
+{
+	int32_t code_pos = 0, pos = 1;
+	uint8_t code = 1;
+	for(int32_t i = 0; i < len; i++)
+	{
+		if(in[i] != 0)
+		{
+			out[pos++] = in[i];
+			code++;
+		}
+		// each code byte tells how far away the next 0 is
+		if(in[i] == 0 || code == 0xff)
+		{
+			out[code_pos] = code;
+			code_pos = pos++;
+			code = 1;
+		}
+	}
+	out[code_pos] = code;
+	return pos;
+}
+
+// undo cobs_encode(), out can be the same as in. returns the decoded
+// length, or -1 if in isn't valid COBS
+static inline int32_t cobs_decode(const uint8_t *in, int32_t len, uint8_t *out)
+{
+	int32_t pos = 0, out_len = 0;
+	while(pos < len)
+	{
+		uint8_t code = in[pos++];
+		if(code == 0 || pos + code - 1 > len)
+			return -1;
+		for(int32_t i = 1; i < code; i++)
+			out[out_len++] = in[pos++];
+		if(code != 0xff && pos < len)
+			out[out_len++] = 0;
+	}
+	return out_len;
+}
+
+// put a frame with len bytes of data into out, type is
+// MASTER_COMMAND_TRANSMISSION_START for commands and SLAVE_COMMAND_ACK
+// for responses. out needs FRAME_SIZE(len) bytes. returns the number
+// of bytes to send
+static inline int32_t build_frame(uint8_t *out, uint8_t type, uint8_t tag, const uint8_t *data, int32_t len)
+{
+	uint8_t raw[MAX_FRAME_DATA_SIZE + 4];
+	raw[0] = type;
+	raw[1] = tag;
+	if(len > 0)
+		memcpy(raw + 2, data, len);
+	int16_to_char(crc16_ccitt(0xffff, raw, len + 2), raw + len + 2);
+	// the leading 0 cuts off whatever noise came before
+	out[0] = 0;
+	int32_t out_len = 1 + cobs_encode(raw, len + 4, out + 1);
+	out[out_len++] = 0;
+	return out_len;
+}
+
+// look for the next complete frame in buf[*head] to buf[tail - 1] and
+// decode it in place. frames that fail the CRC or aren't of type are
+// skipped, the stream is back in sync at the next 0. if one is found,
+// tag and data are pointed at it, *head moves past it and its data
+// length is returned. returns -1 if there isn't a complete frame yet
+static inline int32_t parse_frame(uint8_t *buf, int32_t *head, int32_t tail, uint8_t type, uint8_t *tag, uint8_t **data)
+{
+	while(1)
+	{
+		while(*head < tail && buf[*head] == 0)
+			(*head)++;
+		int32_t end = *head;
+		while(end < tail && buf[end] != 0)
+			end++;
+		if(end == tail)
+			return -1;
+		uint8_t *frame = &buf[*head];
+		int32_t len = cobs_decode(frame, end - *head, frame);
+		*head = end + 1;
+		if(len < 4 || len > MAX_FRAME_DATA_SIZE + 4 || frame[0] != type
+			|| crc16_ccitt(0xffff, frame, len - 2) != char_to_int16(frame + len - 2))
+			continue;
+		*tag = frame[1];
+		*data = frame + 2;
+		return len - 4;
+	}
+}
+
+// one line of a day log file
+struct log_entry
+{
+	int32_t time;
+	uint16_t current[4];
+	uint16_t power[4];
+	uint16_t voltage;
+};
+
+// look at the first len bytes of a version 1 or 2 log file. returns
+// where the first entry starts and sets *entry_size, files without a
+// header are version 1
+static inline int32_t log_parse_header(const uint8_t *buf, int32_t len, int32_t *entry_size)
+{
+	if(len < LOG_HEADER_SIZE || memcmp(buf, LOG_MAGIC, 4) != 0 || buf[5] < LOG_ENTRY_SIZE)
+	{
+		*entry_size = LOG_ENTRY_V1_SIZE;
+		return 0;
+	}
+	// later versions may add to the end of each entry
+	*entry_size = buf[5];
+	return LOG_HEADER_SIZE;
+}
+
+static inline void log_encode_entry(const struct log_entry *e, uint8_t *buf)
+{
+	int32_to_char(e->time, buf);
+	for(int32_t i = 0; i < 4; i++)
+	{
+		int16_to_char(e->current[i], buf + 4 + 2 * i);
+		int16_to_char(e->power[i], buf + 12 + 2 * i);
+	}
+	int16_to_char(e->voltage, buf + 20);
+}
+
+// entry_size as found by log_parse_header()
+static inline void log_decode_entry(const uint8_t *buf, int32_t entry_size, struct log_entry *e)
+{
+	e->time = char_to_int32(buf);
+	for(int32_t i = 0; i < 4; i++)
+	{
+		e->current[i] = char_to_int16(buf + 4 + 2 * i);
+		// mA * 0.1V / 1000 is 0.1W
+		e->power[i] = entry_size == LOG_ENTRY_V1_SIZE ? (uint32_t)e->current[i] * LOG_V1_MAINS_DV / 1000 : (uint32_t)char_to_int16(buf + 12 + 2 * i);
+	}
+	e->voltage = entry_size == LOG_ENTRY_V1_SIZE ? LOG_V1_MAINS_DV : char_to_int16(buf + 20);
+}
+
+// map signed values to unsigned so small negative numbers stay small
+static inline uint32_t zigzag_encode(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// 7 bits per byte, low bits first, top bit set on all but the last
+// byte. returns the number of bytes written to out
+static inline int32_t varint_encode(uint32_t v, uint8_t *out)
+{
+	int32_t len = 0;
+	while(v >= 0x80)
+	{
+		out[len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	out[len++] = v;
+	return len;
+}
+
+// returns the number of bytes used, or -1 if in runs out first
+static inline int32_t varint_decode(const uint8_t *in, int32_t len, uint32_t *v)
+{
+	*v = 0;
+	for(int32_t i = 0; i < len && i < 5; i++)
+	{
+		*v |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+		if(!(in[i] & 0x80))
+			return i + 1;
+	}
+	return -1;
+}
+
+// pack e against the entry before it in the block, prev, NULL for the
+// first one. returns the length
+static inline int32_t log_pack_entry(const struct log_entry *e, const struct log_entry *prev, uint8_t *out)
+{
+	int32_t len = varint_encode(zigzag_encode(e->time - (prev != NULL ? prev->time : 0)), out);
+	for(int32_t i = 0; i < 4; i++)
+		len += varint_encode(zigzag_encode((int32_t)e->current[i] - (prev != NULL ? prev->current[i] : 0)), out + len);
+	for(int32_t i = 0; i < 4; i++)
+		len += varint_encode(zigzag_encode((int32_t)e->power[i] - (prev != NULL ? prev->power[i] : 0)), out + len);
+	len += varint_encode(zigzag_encode((int32_t)e->voltage - (prev != NULL ? prev->voltage : 0)), out + len);
+	return len;
+}
+
+// unpack the entry at in, with len bytes left in the block, into e,
+// which holds the entry before it, all 0s for the first one. returns
+// the length, -1 if it runs past len
+static inline int32_t log_unpack_entry(const uint8_t *in, int32_t len, struct log_entry *e)
+{
+	uint32_t v;
+	int32_t pos = varint_decode(in, len, &v);
+	if(pos < 0)
+		return -1;
+	e->time += zigzag_decode(v);
+	for(int32_t i = 0; i < 9; i++)
+	{
+		int32_t n = varint_decode(in + pos, len - pos, &v);
+		if(n < 0)
+			return -1;
+		pos += n;
+		uint16_t *field = i < 4 ? &e->current[i] : i < 8 ? &e->power[i - 4] : &e->voltage;
+		*field += zigzag_decode(v);
+	}
+	return pos;
+}
+
+// fill in the header and the CRC of a block whose count entries are in
+// place. the rest of the block should be 0
+static inline void log_seal_block(uint8_t *block, uint32_t seq, int32_t count, uint8_t interval)
+{
+	memcpy(block, LOG_BLOCK_MAGIC, 4);
+	block[4] = LOG_VERSION;
+	block[5] = LOG_ENTRY_SIZE;
+	block[6] = count;
+	block[7] = interval;
+	int32_to_char(seq, block + 8);
+	int16_to_char(crc16_ccitt(0xffff, block, LOG_BLOCK_SIZE - 2), block + LOG_BLOCK_SIZE - 2);
+}
+
+// returns how many entries block has and sets *entry_size, or -1 if it's
+// torn, of a version that can't be read, or isn't block seq of its file
+static inline int32_t log_check_block(const uint8_t *block, uint32_t seq, int32_t *entry_size)
+{
+	if(memcmp(block, LOG_BLOCK_MAGIC, 4) != 0 || block[4] < LOG_FIXED_VERSION || block[4] > LOG_VERSION
+		|| block[5] < LOG_ENTRY_SIZE || (block[4] == LOG_FIXED_VERSION && block[6] > LOG_BLOCK_ENTRIES(block[5]))
+		|| (uint32_t)char_to_int32(block + 8) != seq
+		|| crc16_ccitt(0xffff, block, LOG_BLOCK_SIZE - 2) != char_to_int16(block + LOG_BLOCK_SIZE - 2))
+		return -1;
+	*entry_size = block[5];
+	return block[6];
+}
+
+// the block a log is appended to, kept in RAM next to the block itself
+struct log_tail
+{
+	uint32_t index;
+	int32_t count;
+	// bytes of packed entries in the block
+	int32_t used;
+	// longest interval of the entries in the block, see log_filter_interval()
+	uint8_t interval;
+	struct log_entry last;
+};
+
+// start block over as the next one
+static inline void log_tail_next(struct log_tail *t, uint8_t *block)
+{
+	t->index++;
+	t->count = 0;
+	t->used = 0;
+	t->interval = 0;
+	memset(&t->last, 0, sizeof(struct log_entry));
+	memset(block, 0, LOG_BLOCK_SIZE);
+}
+
+// find where appending to a block log of file_size bytes goes on. block
+// has the last block_len bytes of the file, read at the last multiple of
+// LOG_BLOCK_SIZE before its end. returns how many of its entries are
+// kept. a torn last block is started over, as is a block cut short by a
+// power cut while the file grew, and one of an older version is
+// followed by a new one
+static inline int32_t log_recover_tail(struct log_tail *t, uint8_t *block, int32_t block_len, uint32_t file_size)
+{
+	int32_t entry_size, count = -1;
+	t->index = file_size / LOG_BLOCK_SIZE;
+	if(file_size % LOG_BLOCK_SIZE == 0 && t->index > 0)
+	{
+		t->index--;
+		if(block_len == LOG_BLOCK_SIZE)
+			count = log_check_block(block, t->index, &entry_size);
+		if(count >= 0 && block[4] != LOG_VERSION)
+		{
+			t->index++;
+			count = -1;
+		}
+	}
+	t->count = 0;
+	t->used = 0;
+	t->interval = 0;
+	memset(&t->last, 0, sizeof(struct log_entry));
+	if(count < 0)
+	{
+		memset(block, 0, LOG_BLOCK_SIZE);
+		return 0;
+	}
+	t->interval = block[7];
+	// where the entries end, and the last one to pack the next against
+	const uint8_t *pos = block + LOG_BLOCK_HEADER_SIZE;
+	for(; t->count < count; t->count++)
+	{
+		int32_t n = log_unpack_entry(pos, block + LOG_BLOCK_HEADER_SIZE + LOG_BLOCK_DATA_SIZE - pos, &t->last);
+		if(n < 0)
+			break;
+		pos += n;
+	}
+	t->used = pos - (block + LOG_BLOCK_HEADER_SIZE);
+	return t->count;
+}
+
+// add e, logged with interval, to the block. returns -1 if it doesn't
+// fit, the block has to be written out and started over with
+// log_tail_next() first
+static inline int32_t log_tail_append(struct log_tail *t, uint8_t *block, const struct log_entry *e, uint8_t interval)
+{
+	uint8_t packed[LOG_PACKED_ENTRY_MAX];
+	int32_t len = log_pack_entry(e, t->count > 0 ? &t->last : NULL, packed);
+	if(t->count == LOG_PACKED_MAX_COUNT || t->used + len > LOG_BLOCK_DATA_SIZE)
+		return -1;
+	memcpy(block + LOG_BLOCK_HEADER_SIZE + t->used, packed, len);
+	t->used += len;
+	t->count++;
+	t->last = *e;
+	if(interval > t->interval)
+		t->interval = interval;
+	return 0;
+}
+
+// where the entries of a log file are. block logs are read a block at a
+// time, older files a sector's worth of entries at a time, as if those
+// were blocks without a header
+struct log_layout
+{
+	uint8_t blocked;
+	int32_t entry_size;
+	uint32_t data_start;
+	uint32_t file_size;
+};
+
+// head has the first head_len bytes of the file
+static inline void log_get_layout(struct log_layout *l, const uint8_t *head, int32_t head_len, uint32_t file_size)
+{
+	l->file_size = file_size;
+	l->blocked = head_len >= 4 && memcmp(head, LOG_BLOCK_MAGIC, 4) == 0;
+	if(l->blocked)
+	{
+		l->entry_size = LOG_ENTRY_SIZE;
+		l->data_start = 0;
+	}
+	else
+		l->data_start = log_parse_header(head, head_len, &l->entry_size);
+}
+
+// bytes read for each block
+static inline uint32_t log_block_length(const struct log_layout *l)
+{
+	return l->blocked ? LOG_BLOCK_SIZE : LOG_BLOCK_SIZE / l->entry_size * l->entry_size;
+}
+
+static inline uint32_t log_block_offset(const struct log_layout *l, uint32_t index)
+{
+	return l->data_start + index * log_block_length(l);
+}
+
+static inline uint32_t log_block_count(const struct log_layout *l)
+{
+	uint32_t len = log_block_length(l);
+	return l->file_size <= l->data_start ? 0 : (l->file_size - l->data_start + len - 1) / len;
+}
+
+// goes through the entries of a block one at a time, whatever its
+// version, without unpacking the whole block first
+struct log_cursor
+{
+	const uint8_t *pos;
+	const uint8_t *end;
+	int32_t left;
+	int32_t entry_size;
+	uint8_t packed;
+	// the block's interval, in s
+	int32_t interval_sec;
+	struct log_entry entry;
+};
+
+// len bytes of block index were read into buf. returns how many entries
+// it has and sets c up to go through them, -1 if the block is torn
+static inline int32_t log_block_entries(const struct log_layout *l, uint32_t index, const uint8_t *buf, int32_t len, struct log_cursor *c)
+{
+	memset(c, 0, sizeof(struct log_cursor));
+	c->entry_size = l->entry_size;
+	c->interval_sec = LOG_PERIOD_SEC;
+	c->pos = buf;
+	if(!l->blocked)
+	{
+		c->left = len / l->entry_size;
+		c->end = buf + c->left * l->entry_size;
+		return c->left;
+	}
+	int32_t count = len == LOG_BLOCK_SIZE ? log_check_block(buf, index, &c->entry_size) : -1;
+	if(count < 0)
+		return -1;
+	c->packed = buf[4] != LOG_FIXED_VERSION;
+	if(buf[7] > 0)
+		c->interval_sec = buf[7] * LOG_PERIOD_SEC;
+	c->pos = buf + LOG_BLOCK_HEADER_SIZE;
+	c->end = buf + LOG_BLOCK_HEADER_SIZE + LOG_BLOCK_DATA_SIZE;
+	c->left = count;
+	return count;
+}
+
+// the next entry of the block, NULL after the last one
+static inline const struct log_entry *log_next_entry(struct log_cursor *c)
+{
+	if(c->left <= 0)
+		return NULL;
+	if(c->packed)
+	{
+		int32_t n = log_unpack_entry(c->pos, c->end - c->pos, &c->entry);
+		if(n < 0)
+		{
+			c->left = 0;
+			return NULL;
+		}
+		c->pos += n;
+	}
+	else
+	{
+		log_decode_entry(c->pos, c->entry_size, &c->entry);
+		c->pos += c->entry_size;
+	}
+	c->left--;
+	return &c->entry;
+}
+
+// seconds of from up to to that fall in start up to end
+static inline int32_t log_overlap(int32_t from, int32_t to, int32_t start, int32_t end)
+{
+	if(from < start)
+		from = start;
+	if(to > end)
+		to = end;
+	return to > from ? to - from : 0;
+}
+
+// add the Joules each socket used from start up to end, in the time up
+// to entry e, to energy[4]. prev is the entry before it, NULL if there
+// is none within the interval of e's block, then e counts for nothing.
+// prev's power holds until LOG_PERIOD_SEC before e, and e's after that.
+// 0.1W over 10s is one Joule
+static inline void log_entry_energy(const struct log_entry *prev, const struct log_entry *e, int32_t start, int32_t end, uint64_t energy[4])
+{
+	if(prev == NULL || e->time <= prev->time)
+		return;
+	int32_t split = e->time - LOG_PERIOD_SEC > prev->time ? e->time - LOG_PERIOD_SEC : prev->time;
+	int32_t held = log_overlap(prev->time, split, start, end);
+	int32_t own = log_overlap(split, e->time, start, end);
+	for(int32_t i = 0; i < 4; i++)
+		energy[i] += ((uint64_t)prev->power[i] * held + (uint64_t)e->power[i] * own) / 10;
+}
+
+// decides which readings go to the log. with a deadband, a reading only
+// goes in if a current moved more than deadband_mA from the last entry,
+// if the next reading would be max_interval_sec after it, or if it's the
+// first reading of its hour or the last of its day, so each hour's
+// rollup and each day's log are whole
+struct log_filter
+{
+	// 0 logs every reading
+	uint16_t deadband_mA;
+	uint16_t max_interval_sec;
+	uint8_t have_last;
+	struct log_entry last;
+};
+
+static inline void log_filter_init(struct log_filter *f)
+{
+	memset(f, 0, sizeof(struct log_filter));
+	f->max_interval_sec = LOG_DEFAULT_MAX_INTERVAL_SEC;
+}
+
+// returns -1 and changes nothing unless max_interval_sec is in range
+static inline int32_t log_filter_configure(struct log_filter *f, uint16_t deadband_mA, uint16_t max_interval_sec)
+{
+	if(max_interval_sec < LOG_PERIOD_SEC || max_interval_sec > LOG_MAX_INTERVAL_SEC)
+		return -1;
+	f->deadband_mA = deadband_mA;
+	f->max_interval_sec = max_interval_sec;
+	return 0;
+}
+
+// the interval of the entries it lets through, for log_tail_append()
+static inline uint8_t log_filter_interval(const struct log_filter *f)
+{
+	return f->deadband_mA == 0 ? 0 : (f->max_interval_sec + LOG_PERIOD_SEC - 1) / LOG_PERIOD_SEC;
+}
+
+// start over, the next reading goes in whatever it is
+static inline void log_filter_reset(struct log_filter *f)
+{
+	f->have_last = 0;
+}
+
+// returns 1 if reading e should be logged, and takes it as the last entry
+static inline int32_t log_filter_pass(struct log_filter *f, const struct log_entry *e)
+{
+	int32_t pass = f->deadband_mA == 0 || !f->have_last || e->time < f->last.time
+		|| e->time - f->last.time + LOG_PERIOD_SEC >= f->max_interval_sec
+		|| e->time / LOG_HOUR_SEC != f->last.time / LOG_HOUR_SEC
+		|| (e->time + LOG_PERIOD_SEC) / LOG_DAY_SEC != e->time / LOG_DAY_SEC;
+	for(int32_t i = 0; i < 4 && !pass; i++)
+		pass = e->current[i] > f->last.current[i] + f->deadband_mA || e->current[i] + f->deadband_mA < f->last.current[i];
+	if(pass)
+	{
+		f->last = *e;
+		f->have_last = 1;
+	}
+	return pass;
+}
+
+// build telemetry frame number seq into buf. last holds the currents
+// sent in the previous frame and is updated. returns the data length
+static inline int32_t encode_telemetry(uint8_t *buf, uint8_t seq, uint8_t sockets, const uint16_t current[4], uint16_t last[4])
+{
+	int32_t key_frame = seq % TELEMETRY_KEY_FRAME_INTERVAL == 0;
+	int32_t len = 2;
+	uint8_t mask = 0;
+	for(int32_t i = 0; i < 4; i++)
+	{
+		if(!key_frame && current[i] == last[i])
+			continue;
+		len += varint_encode(zigzag_encode(key_frame ? current[i] : current[i] - last[i]), buf + len);
+		last[i] = current[i];
+		mask |= 1 << i;
+	}
+	buf[0] = (key_frame ? TELEMETRY_KEY_FRAME : 0) | (seq & TELEMETRY_SEQ_MASK);
+	buf[1] = (mask << 4) | (sockets & 0xf);
+	return len;
+}
+
+// what the receiving end knows from the telemetry frames so far
+struct telemetry_state
+{
+	int32_t synced;
+	uint8_t seq;
+	uint8_t sockets;
+	int32_t current[4];
+};
+
+// apply a telemetry frame to t. after a missing or broken frame the
+// deltas are useless until the next key frame, returns -1 for those
+static inline int32_t decode_telemetry(struct telemetry_state *t, const uint8_t *data, int32_t len)
+{
+	if(len < 2)
+	{
+		t->synced = 0;
+		return -1;
+	}
+	uint8_t seq = data[0] & TELEMETRY_SEQ_MASK;
+	int32_t key_frame = data[0] & TELEMETRY_KEY_FRAME;
+	int32_t pos = 2;
+	if(!key_frame && (!t->synced || seq != ((t->seq + 1) & TELEMETRY_SEQ_MASK)))
+	{
+		t->synced = 0;
+		return -1;
+	}
+	for(int32_t i = 0; i < 4; i++)
+	{
+		uint32_t v;
+		if(!(data[1] & (0x10 << i)))
+			continue;
+		int32_t n = varint_decode(data + pos, len - pos, &v);
+		if(n == -1)
+		{
+			t->synced = 0;
+			return -1;
+		}
+		pos += n;
+		t->current[i] = (key_frame ? 0 : t->current[i]) + zigzag_decode(v);
+	}
+	t->sockets = data[1] & 0xf;
+	t->seq = seq;
+	t->synced = 1;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,170 @@
+// strip-wide current budget that doesn't depend on Arduino, shared by the
+// firmware and powerduino_sim. when the sockets together draw more than
+// the budget, sockets are shed in priority order until the rest fits.
+// once the load drops enough they come back one at a time, the last one
+// shed first, each only if what it drew before fits under the budget with
+// room to spare
+#ifndef POWERDUINO_SHEDDING_H
+#define POWERDUINO_SHEDDING_H
+
+#include <stdint.h>
+#include <string.h>
+#include "powerduino_protocol.h"
+
+#define SHED_SOCKETS 4
+#define SHED_DEFAULT_HYSTERESIS_MA 500
+// time between two restores, so inrush currents don't add up
+#define SHED_RESTORE_STAGGER_MS 2000
+// events kept for MASTER_COMMAND_SHED_STATUS
+#define SHED_EVENT_QUEUE 16
+
+struct shed_event
+{
+	uint16_t seq;
+	uint32_t time;
+	// socket index, with SHED_EVENT_RESTORE set for a restore
+	uint8_t socket;
+	// total current of the strip that led to it
+	uint16_t total_mA;
+};
+
+struct load_shedder
+{
+	// 0 turns shedding off, and brings shed sockets back
+	uint16_t budget_mA;
+	// a restore has to leave this much of the budget free
+	uint16_t hysteresis_mA;
+	// socket indices in the order they get shed
+	uint8_t priority[SHED_SOCKETS];
+	uint8_t shed_mask;
+	// what each shed socket drew right before it was shed
+	uint16_t shed_mA[SHED_SOCKETS];
+	uint32_t last_change_ms;
+	uint16_t next_seq;
+	struct shed_event events[SHED_EVENT_QUEUE];
+};
+
+// the budget starts off, socket 4 goes first and socket 1 last
+static inline void shed_init(struct load_shedder *s)
+{
+	memset(s, 0, sizeof(struct load_shedder));
+	s->hysteresis_mA = SHED_DEFAULT_HYSTERESIS_MA;
+	for(int32_t i = 0; i < SHED_SOCKETS; i++)
+		s->priority[i] = SHED_SOCKETS - 1 - i;
+}
+
+// returns -1 and changes nothing unless priority has every socket once
+static inline int32_t shed_configure(struct load_shedder *s, uint16_t budget_mA, uint16_t hysteresis_mA, const uint8_t priority[SHED_SOCKETS])
+{
+	uint8_t seen = 0;
+	for(int32_t i = 0; i < SHED_SOCKETS; i++)
+	{
+		if(priority[i] >= SHED_SOCKETS)
+			return -1;
+		seen |= 1 << priority[i];
+	}
+	if(seen != (1 << SHED_SOCKETS) - 1)
+		return -1;
+	s->budget_mA = budget_mA;
+	s->hysteresis_mA = hysteresis_mA;
+	memcpy(s->priority, priority, SHED_SOCKETS);
+	return 0;
+}
+
+// a socket switched by hand is no longer the shedder's to restore
+static inline void shed_forget(struct load_shedder *s, int32_t socket)
+{
+	s->shed_mask &= ~(1 << socket);
+}
+
+static inline void shed_log(struct load_shedder *s, uint32_t time, uint8_t socket, uint16_t total_mA)
+{
+	struct shed_event *e = &s->events[s->next_seq % SHED_EVENT_QUEUE];
+	e->seq = s->next_seq++;
+	e->time = time;
+	e->socket = socket;
+	e->total_mA = total_mA;
+}
+
+// run once per new current reading. on_mask has the sockets that are on.
+// returns the sockets to switch off now, and sets *restore_mask to the
+// one to switch back on, if any
+static inline uint8_t shed_update(struct load_shedder *s, const uint16_t current[SHED_SOCKETS], uint8_t on_mask, uint32_t now_ms, uint32_t time, uint8_t *restore_mask)
+{
+	uint8_t off_mask = 0;
+	uint32_t total = 0;
+	*restore_mask = 0;
+	// switched back on by something else
+	s->shed_mask &= ~on_mask;
+	for(int32_t i = 0; i < SHED_SOCKETS; i++)
+		if(on_mask & (1 << i))
+			total += current[i];
+	if(s->budget_mA != 0 && total > s->budget_mA)
+	{
+		uint32_t left = total;
+		for(int32_t p = 0; p < SHED_SOCKETS && left > s->budget_mA; p++)
+		{
+			int32_t i = s->priority[p];
+			// a socket that draws nothing doesn't help
+			if(!(on_mask & (1 << i)) || current[i] == 0)
+				continue;
+			off_mask |= 1 << i;
+			s->shed_mask |= 1 << i;
+			s->shed_mA[i] = current[i];
+			left -= current[i];
+			shed_log(s, time, i, total > 0xffff ? 0xffff : total);
+		}
+		s->last_change_ms = now_ms;
+		return off_mask;
+	}
+	if(s->shed_mask == 0 || now_ms - s->last_change_ms < SHED_RESTORE_STAGGER_MS)
+		return 0;
+	for(int32_t p = SHED_SOCKETS - 1; p >= 0; p--)
+	{
+		int32_t i = s->priority[p];
+		if(!(s->shed_mask & (1 << i)))
+			continue;
+		if(s->budget_mA == 0 || total + s->shed_mA[i] + s->hysteresis_mA <= s->budget_mA)
+		{
+			*restore_mask = 1 << i;
+			s->shed_mask &= ~(1 << i);
+			s->last_change_ms = now_ms;
+			shed_log(s, time, i | SHED_EVENT_RESTORE, total > 0xffff ? 0xffff : total);
+		}
+		// the last one shed has to come back before the others
+		break;
+	}
+	return 0;
+}
+
+// reply to MASTER_COMMAND_SHED_STATUS with up to SHED_EVENT_MAX events
+// from from_seq on, so asking again from the one after the last gets the
+// next page. events no longer kept are skipped. returns the length
+static inline int32_t shed_encode_status(const struct load_shedder *s, uint16_t from_seq, uint8_t *buf)
+{
+	uint16_t kept = s->next_seq < SHED_EVENT_QUEUE ? s->next_seq : SHED_EVENT_QUEUE;
+	// from_seq is older than the oldest kept, or not a sequence number
+	// given out yet
+	uint16_t start = (uint16_t)(s->next_seq - from_seq) > kept ? (uint16_t)(s->next_seq - kept) : from_seq;
+	uint16_t count = (uint16_t)(s->next_seq - start);
+	if(count > SHED_EVENT_MAX)
+		count = SHED_EVENT_MAX;
+	int16_to_char(s->budget_mA, buf);
+	int16_to_char(s->hysteresis_mA, buf + 2);
+	memcpy(buf + 4, s->priority, SHED_SOCKETS);
+	buf[8] = s->shed_mask;
+	int16_to_char(s->next_seq, buf + 9);
+	buf[11] = count;
+	uint8_t *p = buf + SHED_STATUS_HEADER_SIZE;
+	for(uint16_t seq = start; seq != (uint16_t)(start + count); seq++, p += SHED_EVENT_SIZE)
+	{
+		const struct shed_event *e = &s->events[seq % SHED_EVENT_QUEUE];
+		int16_to_char(e->seq, p);
+		int32_to_char(e->time, p + 2);
+		p[6] = e->socket;
+		int16_to_char(e->total_mA, p + 7);
+	}
+	return p - buf;
+}
+
+#endif
@@ -0,0 +1,1119 @@
+// stands in for one or more power strips so powerduino_PC and protocol
+// changes can be tried out without hardware. each strip listens on its
+// own port like a WiFly module, carries out commands the way the
+// firmware's loop() does, serves synthetic current readings and keeps
+// day log files in the same format as append_current_log().
+// the 9600 baud serial link is modeled with a per-byte delay, and
+// replies can be given random extra delay or dropped altogether.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "powerduino_protocol.h"
+#include "powerduino_metering.h"
+#include "powerduino_shedding.h"
+#define SIM_MAX_STRIPS 1024
+#define RX_BUF_SIZE 512
+#define TX_QUEUE_SIZE 64
+#define BUF_SIZE 32
+#define BYTE_US_9600 1042
+#define LOOP_US 200
+#define SD_US_PER_ENTRY 60
+// a sector read for a seek or a block read in calc_energy()
+#define SD_US_PER_SECTOR 500
+#define SD_SECTOR_SIZE 512
+#define ENERGY_LOG_PERIOD_SEC LOG_PERIOD_SEC
+#define ONE_DAY_IN_SEC 86400
+#define ONE_HOUR_IN_SEC 3600
+#define ROLLUP_HOUR 0
+#define ROLLUP_DAY 1
+#define ROLLUP_MONTH 2
+#define ROLLUP_RECORD_SIZE 16
+#define MAINS_VOLTAGE_RMS 120
+#define WIFLY_GREETING "*HELLO*"
+#define PATH_SIZE 256
+// 2001-01-01, the simulated clock check_rollups() starts at
+#define CHECK_START_UTC 978307200
+// room left in a path for a strip's directory and a file name in it
+#define LOG_ROOT_SIZE (PATH_SIZE - 32)
+#define LOG_DIR_SIZE (PATH_SIZE - 16)
+#define TELEMETRY_MIN_INTERVAL_MS 100
+
+// a frame waiting for its last byte to make it through the serial link
+struct pending_reply
+{
+    int64_t due_us;
+    int32_t len;
+    uint8_t data[FRAME_SIZE(MAX_FRAME_DATA_SIZE)];
+};
+
+struct sim_strip
+{
+    int32_t index;
+    int32_t listen_fd;
+    // a WiFly module serves one connection at a time
+    int32_t conn_fd;
+    uint8_t rx_buf[RX_BUF_SIZE];
+    int32_t rx_head, rx_tail;
+    struct pending_reply tx[TX_QUEUE_SIZE];
+    int32_t tx_head, tx_count;
+    // when the serial link in each direction is free again,
+    // and when the firmware is done with the queued commands
+    int64_t rx_link_free_us;
+    int64_t tx_link_free_us;
+    int64_t busy_until_us;
+    uint8_t socket_state;
+    int64_t clock_offset;
+    // hour update_rollups() last ran in
+    time_t rollup_hour;
+    time_t next_log;
+    char log_dir[LOG_DIR_SIZE];
+    // MASTER_COMMAND_SUBSCRIBE, an interval of 0 means not subscribed
+    int64_t telemetry_us;
+    int64_t next_telemetry_us;
+    uint8_t telemetry_tag;
+    uint8_t telemetry_seq;
+    uint16_t telemetry_last[4];
+    // live readings come out of the firmware's metering, fed with
+    // synthetic sensor waveforms up to metered_us
+    struct metering meter;
+    int64_t metered_us;
+    // the firmware's current limiter, fed the same waveforms
+    struct trip_detector trip;
+    uint16_t trip_limit_mA[4];
+    struct load_shedder shedder;
+    // which readings go to the log, like the firmware's
+    struct log_filter log_filter;
+    uint64_t commands;
+    uint64_t lost;
+};
+
+// epoll data for listening sockets has this bit set
+#define LISTEN_FLAG (1ULL << 32)
+
+struct sim_strip *strips;
+int32_t strip_count = 1;
+int32_t byte_us = BYTE_US_9600;
+int32_t jitter_ms = 0;
+double loss_percent = 0;
+double noise_percent = 0;
+int32_t history_days = 2;
+char log_root[LOG_ROOT_SIZE] = "sim_logs";
+int32_t verbose = 0;
+// limit every socket of each strip starts out with, 0 leaves the
+// current limiter off
+int32_t trip_limit_mA = 0;
+// current budget each strip starts out with, 0 for none
+int32_t shed_budget_mA = 0;
+// log deadband each strip starts out with, 0 logs every reading
+int32_t log_deadband_mA = 0;
+// hours check_rollups() replays, 0 runs the strips instead
+int32_t check_hours = 0;
+
+int64_t get_time_us();
+time_t strip_time(struct sim_strip *s);
+uint16_t sim_current(struct sim_strip *s, int32_t socket, time_t t);
+double sim_phase(struct sim_strip *s, int32_t socket);
+void sim_sensor_window(struct sim_strip *s, uint16_t *current, uint16_t *voltage);
+void sim_readings(struct sim_strip *s, uint16_t current[4], uint16_t power[4], uint16_t *voltage);
+void get_filename(time_t t, char buf[10]);
+void get_log_path(struct sim_strip *s, time_t t, char *path);
+void history_entry(struct sim_strip *s, time_t t, struct log_entry *entry);
+void append_log(struct sim_strip *s, const struct log_entry *entry);
+void make_history(struct sim_strip *s);
+int32_t check_rollups(struct sim_strip *s, int32_t hours);
+int32_t calc_energy(struct sim_strip *s, time_t start_utc, time_t end_utc, uint32_t result[4]);
+int32_t sum_log(struct sim_strip *s, time_t start_utc, time_t end_utc, uint64_t energy[4]);
+void get_rollup_path(struct sim_strip *s, int32_t level, time_t t, char *path);
+int32_t rollup_index(int32_t level, time_t t);
+int32_t read_rollup(struct sim_strip *s, int32_t level, time_t t, uint64_t energy[4]);
+int32_t add_rollup(struct sim_strip *s, int32_t level, time_t t, uint64_t energy[4]);
+void update_rollups(struct sim_strip *s);
+time_t get_start_of_month(time_t t);
+time_t get_next_month(time_t t);
+int32_t read_log_block(FILE *fp, const struct log_layout *layout, uint32_t index, uint8_t *buf, struct log_cursor *cursor);
+uint32_t find_log_block(FILE *fp, const struct log_layout *layout, time_t t, int32_t *seeks);
+void handle_accept(struct sim_strip *s, int32_t epfd);
+void handle_readable(struct sim_strip *s, int32_t epfd);
+void close_conn(struct sim_strip *s, int32_t epfd);
+void do_master_command(struct sim_strip *s, uint8_t tag, uint8_t *data, int64_t arrival_us);
+void queue_reply(struct sim_strip *s, uint8_t start, uint8_t tag, uint8_t *data, int32_t len, int64_t ready_us);
+void flush_replies(struct sim_strip *s, int32_t epfd, int64_t now_us);
+void send_telemetry(struct sim_strip *s, int64_t now_us);
+int32_t read_log_chunk(struct sim_strip *s, time_t day_utc, uint32_t offset, uint8_t *chunk);
+int32_t chance(double percent);
+void print_usage();
+
+int32_t main(int32_t argc, char *argv[])
+{
+    int32_t opt, port = atoi(WIFLY_PORT);
+    uint32_t seed = time(NULL);
+    while((opt = getopt(argc, argv, "p:N:b:j:x:e:n:d:s:L:B:D:R:v")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p': port = atoi(optarg); break;
+            case 'N': strip_count = atoi(optarg); break;
+            case 'b': byte_us = atoi(optarg); break;
+            case 'j': jitter_ms = atoi(optarg); break;
+            case 'x': loss_percent = atof(optarg); break;
+            case 'e': noise_percent = atof(optarg); break;
+            case 'n': history_days = atoi(optarg); break;
+            case 'd': strncpy(log_root, optarg, LOG_ROOT_SIZE - 1); break;
+            case 's': seed = atoi(optarg); break;
+            case 'L': trip_limit_mA = atoi(optarg); break;
+            case 'B': shed_budget_mA = atoi(optarg); break;
+            case 'D': log_deadband_mA = atoi(optarg); break;
+            case 'R': check_hours = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default: print_usage(); exit(1);
+        }
+    }
+    if(strip_count < 1 || strip_count > SIM_MAX_STRIPS || trip_limit_mA < 0 || trip_limit_mA > METERING_FULL_SCALE_MA
+        || shed_budget_mA < 0 || shed_budget_mA > 0xffff || log_deadband_mA < 0 || log_deadband_mA > 0xffff || check_hours < 0)
+    {
+        print_usage();
+        exit(1);
+    }
+    srand(seed);
+    signal(SIGPIPE, SIG_IGN);
+    mkdir(log_root, 0755);
+
+    int32_t epfd = epoll_create1(0);
+    strips = calloc(strip_count, sizeof(struct sim_strip));
+    for(int32_t i = 0; i < strip_count; i++)
+    {
+        struct sim_strip *s = &strips[i];
+        struct sockaddr_in addr;
+        int32_t yes = 1;
+        s->index = i;
+        s->conn_fd = -1;
+        // socket 4 can't be switched over the link, it starts out on
+        s->socket_state = 0xf;
+        metering_init(&s->meter, 4, 4);
+        trip_init(&s->trip, 4, 4);
+        for(int32_t j = 0; j < 4; j++)
+        {
+            s->trip_limit_mA[j] = trip_limit_mA;
+            trip_set_limit(&s->trip, j, trip_limit_mA);
+        }
+        shed_init(&s->shedder);
+        s->shedder.budget_mA = shed_budget_mA;
+        log_filter_init(&s->log_filter);
+        s->log_filter.deadband_mA = log_deadband_mA;
+        s->next_log = strip_time(s) + ENERGY_LOG_PERIOD_SEC - strip_time(s) % ENERGY_LOG_PERIOD_SEC;
+        snprintf(s->log_dir, LOG_DIR_SIZE, "%s/%d", log_root, port + i);
+        mkdir(s->log_dir, 0755);
+        if(check_hours > 0)
+            exit(check_rollups(s, check_hours) == 0 ? 0 : 1);
+        make_history(s);
+
+        s->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port + i);
+        if(bind(s->listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(s->listen_fd, 4) == -1)
+        {
+            perror("bind");
+            exit(1);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = LISTEN_FLAG | i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s->listen_fd, &ev);
+    }
+    printf("simulating %d power strip%s on port %d", strip_count, strip_count > 1 ? "s" : "", port);
+    if(strip_count > 1)
+        printf("-%d", port + strip_count - 1);
+    printf(", %dus per byte, %dms jitter, %.1f%% loss, %.1f%% noise\n", byte_us, jitter_ms, loss_percent, noise_percent);
+    fflush(stdout);
+
+    struct epoll_event events[64];
+    while(1)
+    {
+        // sleep until the next reply is due or a log entry needs writing
+        int64_t now_us = get_time_us();
+        int64_t wake_us = now_us + 1000000;
+        for(int32_t i = 0; i < strip_count; i++)
+            if(strips[i].tx_count > 0 && strips[i].tx[strips[i].tx_head].due_us < wake_us)
+                wake_us = strips[i].tx[strips[i].tx_head].due_us;
+        for(int32_t i = 0; i < strip_count; i++)
+            if(strips[i].telemetry_us > 0 && strips[i].next_telemetry_us < wake_us)
+                wake_us = strips[i].next_telemetry_us;
+        int32_t timeout_ms = wake_us > now_us ? (wake_us - now_us + 999) / 1000 : 0;
+        int32_t n = epoll_wait(epfd, events, 64, timeout_ms);
+        for(int32_t i = 0; i < n; i++)
+        {
+            uint64_t data = events[i].data.u64;
+            struct sim_strip *s = &strips[data & 0xffffffff];
+            if(data & LISTEN_FLAG)
+                handle_accept(s, epfd);
+            else
+                handle_readable(s, epfd);
+        }
+        now_us = get_time_us();
+        for(int32_t i = 0; i < strip_count; i++)
+        {
+            struct sim_strip *s = &strips[i];
+            if(s->telemetry_us > 0 && now_us >= s->next_telemetry_us)
+                send_telemetry(s, now_us);
+            flush_replies(s, epfd, now_us);
+            // same as current_log_timer in the firmware
+            time_t t = strip_time(s);
+            if(t >= s->next_log)
+            {
+                struct log_entry entry;
+                entry.time = t;
+                sim_readings(s, entry.current, entry.power, &entry.voltage);
+                append_log(s, &entry);
+                s->next_log = t + ENERGY_LOG_PERIOD_SEC - t % ENERGY_LOG_PERIOD_SEC;
+            }
+            update_rollups(s);
+        }
+    }
+    return 0;
+}
+
+void print_usage()
+{
+    fprintf(stderr, "usage: powerduino_sim [-p port] [-N strips] [-b us_per_byte] [-j jitter_ms]\n");
+    fprintf(stderr, "                      [-x loss_percent] [-e noise_percent] [-n history_days] [-d log_dir]\n");
+    fprintf(stderr, "                      [-s seed] [-L limit_mA] [-B budget_mA] [-D deadband_mA] [-v]\n");
+    fprintf(stderr, "strip i listens on port + i, -b 0 turns off the serial link delay\n");
+    fprintf(stderr, "-L turns on the current limiter, sockets over limit_mA trip off\n");
+    fprintf(stderr, "-B sheds sockets while the strip draws more than budget_mA\n");
+    fprintf(stderr, "-D only logs readings once a current moves more than deadband_mA, or\n");
+    fprintf(stderr, "   after %ds\n", LOG_DEFAULT_MAX_INTERVAL_SEC);
+    fprintf(stderr, "-R replays hours of readings into the first strip's logs and rollups on a\n");
+    fprintf(stderr, "   simulated clock, checks each rollup against the log and exits\n");
+}
+
+int64_t get_time_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the strip's RTC, it can be set by MASTER_COMMAND_SET_TIME
+time_t strip_time(struct sim_strip *s)
+{
+    return time(0) + s->clock_offset;
+}
+
+int32_t chance(double percent)
+{
+    return percent > 0 && rand() < percent / 100 * RAND_MAX;
+}
+
+// synthetic current of a socket in mA, a steady load per socket that
+// drifts slowly, plus a bit of noise
+uint16_t sim_current(struct sim_strip *s, int32_t socket, time_t t)
+{
+    double base = 150 + 350 * ((s->index * 3 + socket) % 7);
+    double current = base * (1 + 0.2 * sin((double)t / 900 + socket + s->index)) + rand() % 41 - 20;
+    return current < 60 ? 0 : (uint16_t)current;
+}
+
+// how far the current of a socket lags the voltage, from a resistive
+// load up to a motor
+double sim_phase(struct sim_strip *s, int32_t socket)
+{
+    return M_PI / 8 * ((s->index + socket) % 4);
+}
+
+// what the current sensors and the voltage sense pin of a strip put out
+// over one metering window, with the current of each socket that is on
+// out of phase with the voltage and some noise on every sample. slot i of
+// each round is sampled a bit after slot i - 1, current and voltage of a
+// slot at the same moment like the firmware's two ADCs
+void sim_sensor_window(struct sim_strip *s, uint16_t *current, uint16_t *voltage)
+{
+    time_t t = strip_time(s);
+    double amplitude[4];
+    double voltage_amplitude = MAINS_VOLTAGE_RMS * 10 * sqrt(2) * METERING_ADC_COUNTS / METERING_FULL_SCALE_DV;
+    for(int32_t i = 0; i < 4; i++)
+        amplitude[i] = s->socket_state & (1 << i) ? sim_current(s, i, t) * sqrt(2) * METERING_ADC_COUNTS / METERING_FULL_SCALE_MA : 0;
+    for(int32_t n = 0; n < METERING_WINDOW_SAMPLES; n++)
+        for(int32_t i = 0; i < 4; i++)
+        {
+            double phase = 2 * M_PI * (n * 4 + i) / (METERING_SAMPLES_PER_CYCLE * 4);
+            current[n * 4 + i] = METERING_ADC_COUNTS / 2 + amplitude[i] * sin(phase - sim_phase(s, i)) + rand() % 41 - 20;
+            voltage[n * 4 + i] = METERING_ADC_COUNTS / 2 + voltage_amplitude * sin(phase) + rand() % 41 - 20;
+        }
+}
+
+// live readings like the firmware's current_array_global,
+// power_array_global and voltage_global. the windows that went by since
+// the last reading are run through the metering first, like
+// c_reader.update() does on the strip, and through the current limiter
+// and the shedder. a socket that trips or is shed is off from the next
+// window on
+void sim_readings(struct sim_strip *s, uint16_t current[4], uint16_t power[4], uint16_t *voltage)
+{
+    uint16_t current_samples[4 * METERING_WINDOW_SAMPLES];
+    uint16_t voltage_samples[4 * METERING_WINDOW_SAMPLES];
+    int64_t now_us = get_time_us();
+    int64_t windows = (now_us - s->metered_us) / METERING_WINDOW_US;
+    // older windows wouldn't make it into the average anyway
+    if(windows > METERING_AVERAGE_WINDOWS)
+    {
+        windows = METERING_AVERAGE_WINDOWS;
+        s->metered_us = now_us - windows * METERING_WINDOW_US;
+    }
+    for(int32_t i = 0; i < windows; i++)
+    {
+        sim_sensor_window(s, current_samples, voltage_samples);
+        metering_feed(&s->meter, current_samples, voltage_samples, 4 * METERING_WINDOW_SAMPLES);
+        uint8_t tripped = trip_feed(&s->trip, current_samples, 4 * METERING_WINDOW_SAMPLES);
+        if(tripped && verbose)
+            printf("strip %d: sockets 0x%x tripped\n", s->index, tripped);
+        s->socket_state &= ~tripped;
+        // shed_load() in the firmware, on each window's own readings
+        uint8_t restore_mask;
+        int64_t window_end_us = s->metered_us + (i + 1) * METERING_WINDOW_US;
+        uint8_t off_mask = shed_update(&s->shedder, s->meter.window_mA, s->socket_state, window_end_us / 1000, strip_time(s), &restore_mask);
+        if((off_mask | restore_mask) && verbose)
+            printf("strip %d: sockets 0x%x shed, 0x%x restored\n", s->index, off_mask, restore_mask);
+        // a tripped socket stays off until it's switched on again
+        s->socket_state = ((s->socket_state & ~off_mask) | restore_mask) & ~trip_latched(&s->trip);
+    }
+    s->metered_us += windows * METERING_WINDOW_US;
+    for(int32_t i = 0; i < 4 && current != NULL; i++)
+    {
+        int32_t p = metering_power(&s->meter, i);
+        current[i] = metering_current(&s->meter, i);
+        power[i] = p < 0 ? 0 : p;
+    }
+    if(voltage != NULL)
+        *voltage = metering_voltage(&s->meter);
+}
+
+// same file name as the firmware's get_filename()
+void get_filename(time_t t, char buf[10])
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    memset(buf, 0, 10);
+    strftime(buf, 10, "%Y%m%d", &tm);
+}
+
+void get_log_path(struct sim_strip *s, time_t t, char *path)
+{
+    char file_name[10];
+    get_filename(t, file_name);
+    snprintf(path, PATH_SIZE, "%s/%s", s->log_dir, file_name);
+}
+
+// the readings history is made of, straight from the synthetic
+// currents with all sockets on
+void history_entry(struct sim_strip *s, time_t t, struct log_entry *entry)
+{
+    entry->time = t;
+    for(int32_t i = 0; i < 4; i++)
+    {
+        entry->current[i] = sim_current(s, i, t);
+        entry->power[i] = entry->current[i] * MAINS_VOLTAGE_RMS * cos(sim_phase(s, i)) / 100;
+    }
+    entry->voltage = MAINS_VOLTAGE_RMS * 10;
+}
+
+// same format as the firmware's log_writer, files the sim writes are
+// always block logs. the last block is read back and written again
+// whole, like the firmware does when it flushes
+void append_log(struct sim_strip *s, const struct log_entry *entry)
+{
+    char path[PATH_SIZE];
+    uint8_t block[LOG_BLOCK_SIZE];
+    int32_t len = 0;
+    struct log_tail tail;
+    if(!log_filter_pass(&s->log_filter, entry))
+        return;
+    get_log_path(s, entry->time, path);
+    FILE *fp = fopen(path, "r+b");
+    if(fp == NULL)
+        fp = fopen(path, "w+b");
+    if(fp == NULL)
+        return;
+    fseek(fp, 0, SEEK_END);
+    uint32_t file_size = ftell(fp);
+    if(file_size >= LOG_BLOCK_SIZE && fseek(fp, (file_size / LOG_BLOCK_SIZE - 1) * LOG_BLOCK_SIZE, SEEK_SET) == 0)
+        len = fread(block, 1, LOG_BLOCK_SIZE, fp);
+    log_recover_tail(&tail, block, len, file_size);
+    uint8_t interval = log_filter_interval(&s->log_filter);
+    // a full block is on disk already
+    if(log_tail_append(&tail, block, entry, interval) == -1)
+    {
+        log_tail_next(&tail, block);
+        log_tail_append(&tail, block, entry, interval);
+    }
+    log_seal_block(block, tail.index, tail.count, tail.interval);
+    fseek(fp, (int64_t)tail.index * LOG_BLOCK_SIZE, SEEK_SET);
+    fwrite(block, 1, LOG_BLOCK_SIZE, fp);
+    fclose(fp);
+}
+
+// write log files for the past history_days days, with all sockets on.
+// days that already have a file are left alone
+void make_history(struct sim_strip *s)
+{
+    char path[PATH_SIZE];
+    time_t now = strip_time(s);
+    time_t t = now - now % ENERGY_LOG_PERIOD_SEC - (time_t)history_days * ONE_DAY_IN_SEC;
+    t -= t % ONE_DAY_IN_SEC;
+    while(t < now)
+    {
+        get_log_path(s, t, path);
+        if(access(path, F_OK) == 0)
+        {
+            t += ONE_DAY_IN_SEC - t % ONE_DAY_IN_SEC;
+            continue;
+        }
+        FILE *fp = fopen(path, "wb");
+        if(fp == NULL)
+            return;
+        uint8_t block[LOG_BLOCK_SIZE];
+        struct log_tail tail;
+        log_recover_tail(&tail, block, 0, 0);
+        time_t end_of_day = t - t % ONE_DAY_IN_SEC + ONE_DAY_IN_SEC;
+        for(; t < end_of_day && t < now; t += ENERGY_LOG_PERIOD_SEC)
+        {
+            struct log_entry entry;
+            history_entry(s, t, &entry);
+            if(!log_filter_pass(&s->log_filter, &entry))
+                continue;
+            uint8_t interval = log_filter_interval(&s->log_filter);
+            if(log_tail_append(&tail, block, &entry, interval) == -1)
+            {
+                log_seal_block(block, tail.index, tail.count, tail.interval);
+                fwrite(block, 1, LOG_BLOCK_SIZE, fp);
+                log_tail_next(&tail, block);
+                log_tail_append(&tail, block, &entry, interval);
+            }
+        }
+        if(tail.count > 0)
+        {
+            log_seal_block(block, tail.index, tail.count, tail.interval);
+            fwrite(block, 1, LOG_BLOCK_SIZE, fp);
+        }
+        fclose(fp);
+    }
+}
+
+// same algorithm as calc_energy() in the firmware, result is in Joules.
+// returns how many sectors were read or written, which is what the
+// firmware spends its time on
+int32_t calc_energy(struct sim_strip *s, time_t start_utc, time_t end_utc, uint32_t result[4])
+{
+    int32_t sectors = 0;
+    uint64_t energy[4] = {0, 0, 0, 0};
+    time_t settled = strip_time(s) - LOG_SETTLE_SEC;
+    time_t done = settled - settled % ONE_HOUR_IN_SEC;
+    for(time_t t = start_utc; t < end_utc;)
+    {
+        time_t next = get_next_month(t);
+        if(t == get_start_of_month(t) && next <= end_utc && next <= done)
+        {
+            sectors += add_rollup(s, ROLLUP_MONTH, t, energy);
+            t = next;
+            continue;
+        }
+        next = t + ONE_DAY_IN_SEC;
+        if(t % ONE_DAY_IN_SEC == 0 && next <= end_utc && next <= done)
+        {
+            sectors += add_rollup(s, ROLLUP_DAY, t, energy);
+            t = next;
+            continue;
+        }
+        next = t - t % ONE_HOUR_IN_SEC + ONE_HOUR_IN_SEC;
+        if(t % ONE_HOUR_IN_SEC == 0 && next <= end_utc && next <= done)
+            sectors += add_rollup(s, ROLLUP_HOUR, t, energy);
+        else
+            sectors += sum_log(s, t, next < end_utc ? next : end_utc, energy);
+        t = next;
+    }
+    for(int32_t j = 0; j < 4; j++)
+        result[j] = energy[j];
+    return sectors;
+}
+
+// like the firmware's sum_log(), returns the sectors read
+int32_t sum_log(struct sim_strip *s, time_t start_utc, time_t end_utc, uint64_t energy[4])
+{
+    uint8_t block[LOG_BLOCK_SIZE];
+    struct log_cursor cursor;
+    char path[PATH_SIZE];
+    int32_t sectors = 0;
+    const struct log_entry *entry;
+    struct log_layout layout;
+    get_log_path(s, start_utc, path);
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL)
+        return 0;
+    int32_t len = fread(block, 1, LOG_HEADER_SIZE, fp);
+    fseek(fp, 0, SEEK_END);
+    log_get_layout(&layout, block, len, ftell(fp));
+    uint32_t count = log_block_count(&layout);
+    uint32_t first = find_log_block(fp, &layout, start_utc, &sectors);
+    struct log_entry prev = {0};
+    int32_t have_prev = 0;
+    int32_t done = 0;
+    for(uint32_t b = first > 0 ? first - 1 : 0; b < count && !done; b++)
+    {
+        sectors++;
+        if(read_log_block(fp, &layout, b, block, &cursor) <= 0)
+        {
+            have_prev = 0;
+            continue;
+        }
+        while(!done && (entry = log_next_entry(&cursor)) != NULL)
+        {
+            int32_t steady = have_prev && entry->time >= prev.time && entry->time - prev.time <= cursor.interval_sec;
+            if(entry->time >= start_utc)
+                log_entry_energy(steady ? &prev : NULL, entry, start_utc, end_utc, energy);
+            done = entry->time >= end_utc;
+            prev = *entry;
+            have_prev = 1;
+        }
+    }
+    fclose(fp);
+    return sectors;
+}
+
+// same files as the firmware's rollups, next to the day logs
+void get_rollup_path(struct sim_strip *s, int32_t level, time_t t, char *path)
+{
+    struct tm tm;
+    char file_name[16];
+    gmtime_r(&t, &tm);
+    strftime(file_name, sizeof file_name, level == ROLLUP_HOUR ? "%Y%m%d.HR" : level == ROLLUP_DAY ? "%Y%m.DAY" : "%Y.MON", &tm);
+    snprintf(path, PATH_SIZE, "%s/%s", s->log_dir, file_name);
+}
+
+// where the record for t is in its rollup file
+int32_t rollup_index(int32_t level, time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return level == ROLLUP_HOUR ? tm.tm_hour : level == ROLLUP_DAY ? tm.tm_mday - 1 : tm.tm_mon;
+}
+
+// add the rollup record for t to energy, returns -1 if it hasn't been
+// written yet
+int32_t read_rollup(struct sim_strip *s, int32_t level, time_t t, uint64_t energy[4])
+{
+    char path[PATH_SIZE];
+    uint8_t record[ROLLUP_RECORD_SIZE];
+    get_rollup_path(s, level, t, path);
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL)
+        return -1;
+    int32_t found = fseek(fp, rollup_index(level, t) * ROLLUP_RECORD_SIZE, SEEK_SET) == 0
+        && fread(record, 1, ROLLUP_RECORD_SIZE, fp) == ROLLUP_RECORD_SIZE && char_to_int32(record) != -1;
+    fclose(fp);
+    if(!found)
+        return -1;
+    for(int32_t i = 0; i < 4; i++)
+        energy[i] += (uint32_t)char_to_int32(record + 4 * i);
+    return 0;
+}
+
+// like the firmware's add_rollup(), returns the sectors read or written
+int32_t add_rollup(struct sim_strip *s, int32_t level, time_t t, uint64_t energy[4])
+{
+    char path[PATH_SIZE];
+    uint8_t record[ROLLUP_RECORD_SIZE];
+    int32_t sectors = 1;
+    int32_t records = level == ROLLUP_HOUR ? 24 : level == ROLLUP_DAY ? 31 : 12;
+    get_log_path(s, t, path);
+    if(level == ROLLUP_HOUR && access(path, F_OK) != 0)
+        return 0;
+    if(read_rollup(s, level, t, energy) == 0)
+        return sectors;
+    uint64_t sum[4] = {0, 0, 0, 0};
+    if(level == ROLLUP_HOUR)
+        sectors += sum_log(s, t, t + ONE_HOUR_IN_SEC, sum);
+    else if(level == ROLLUP_DAY)
+        for(int32_t h = 0; h < 24; h++)
+            sectors += add_rollup(s, ROLLUP_HOUR, t + h * ONE_HOUR_IN_SEC, sum);
+    else
+        for(time_t d = t; d < get_next_month(t); d += ONE_DAY_IN_SEC)
+            sectors += add_rollup(s, ROLLUP_DAY, d, sum);
+    for(int32_t i = 0; i < 4; i++)
+    {
+        int32_to_char(sum[i] < 0xfffffffe ? sum[i] : 0xfffffffe, record + 4 * i);
+        energy[i] += sum[i];
+    }
+    get_rollup_path(s, level, t, path);
+    FILE *fp = fopen(path, "r+b");
+    if(fp == NULL)
+    {
+        uint8_t blank[ROLLUP_RECORD_SIZE];
+        memset(blank, 0xff, ROLLUP_RECORD_SIZE);
+        fp = fopen(path, "w+b");
+        if(fp == NULL)
+            return sectors;
+        for(int32_t i = 0; i < records; i++)
+            fwrite(blank, 1, ROLLUP_RECORD_SIZE, fp);
+    }
+    fseek(fp, rollup_index(level, t) * ROLLUP_RECORD_SIZE, SEEK_SET);
+    fwrite(record, 1, ROLLUP_RECORD_SIZE, fp);
+    fclose(fp);
+    return sectors + 1;
+}
+
+// like the firmware's update_rollups()
+void update_rollups(struct sim_strip *s)
+{
+    time_t settled = strip_time(s) - LOG_SETTLE_SEC;
+    time_t this_hour = settled - settled % ONE_HOUR_IN_SEC;
+    if(this_hour == s->rollup_hour)
+        return;
+    s->rollup_hour = this_hour;
+    uint64_t energy[4] = {0, 0, 0, 0};
+    time_t last_hour = this_hour - ONE_HOUR_IN_SEC;
+    add_rollup(s, ROLLUP_HOUR, last_hour, energy);
+    if(this_hour % ONE_DAY_IN_SEC == 0)
+        add_rollup(s, ROLLUP_DAY, last_hour - last_hour % ONE_DAY_IN_SEC, energy);
+    if(this_hour == get_start_of_month(this_hour))
+        add_rollup(s, ROLLUP_MONTH, get_start_of_month(last_hour), energy);
+}
+
+// feed hours of readings through the log filter and update_rollups()
+// as the strip would, on a clock starting at CHECK_START_UTC, then check
+// every hour's rollup against a fresh sum of its log and every day's
+// against its hours. returns how many rollups are wrong
+int32_t check_rollups(struct sim_strip *s, int32_t hours)
+{
+    struct log_entry entry;
+    time_t end = CHECK_START_UTC + (time_t)hours * ONE_HOUR_IN_SEC;
+    // an hour later so the last one is rolled up too. readings are a
+    // few seconds into their period, and the rollups run every second,
+    // like the main loop
+    for(time_t t = CHECK_START_UTC; t < end + ONE_HOUR_IN_SEC; t++)
+    {
+        s->clock_offset = t - time(0);
+        if(t % ENERGY_LOG_PERIOD_SEC == 3)
+        {
+            history_entry(s, t, &entry);
+            append_log(s, &entry);
+        }
+        update_rollups(s);
+    }
+    int32_t wrong = 0;
+    uint64_t total[4] = {0, 0, 0, 0};
+    uint64_t rolled[4] = {0, 0, 0, 0};
+    for(time_t h = CHECK_START_UTC; h < end; h += ONE_HOUR_IN_SEC)
+    {
+        uint64_t logged[4] = {0, 0, 0, 0};
+        uint64_t hour[4] = {0, 0, 0, 0};
+        sum_log(s, h, h + ONE_HOUR_IN_SEC, logged);
+        int32_t missing = read_rollup(s, ROLLUP_HOUR, h, hour) == -1;
+        if(missing || memcmp(logged, hour, sizeof logged) != 0)
+        {
+            wrong++;
+            if(verbose)
+                fprintf(stderr, "hour %ld: rollup %llu J, log %llu J on socket 1%s\n", (long)h,
+                    (unsigned long long)hour[0], (unsigned long long)logged[0], missing ? ", missing" : "");
+        }
+        for(int32_t i = 0; i < 4; i++)
+        {
+            total[i] += logged[i];
+            rolled[i] += hour[i];
+        }
+    }
+    for(time_t d = CHECK_START_UTC; d + ONE_DAY_IN_SEC <= end; d += ONE_DAY_IN_SEC)
+    {
+        uint64_t day[4] = {0, 0, 0, 0};
+        uint64_t hours_sum[4] = {0, 0, 0, 0};
+        for(time_t h = d; h < d + ONE_DAY_IN_SEC; h += ONE_HOUR_IN_SEC)
+            read_rollup(s, ROLLUP_HOUR, h, hours_sum);
+        if(read_rollup(s, ROLLUP_DAY, d, day) == -1 || memcmp(day, hours_sum, sizeof day) != 0)
+            wrong++;
+    }
+    printf("%d hours, deadband %d mA: log %llu J, rollups %llu J, %d rollups wrong\n", hours, log_deadband_mA,
+        (unsigned long long)(total[0] + total[1] + total[2] + total[3]),
+        (unsigned long long)(rolled[0] + rolled[1] + rolled[2] + rolled[3]), wrong);
+    return wrong;
+}
+
+time_t get_start_of_month(time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return t - t % ONE_DAY_IN_SEC - (time_t)(tm.tm_mday - 1) * ONE_DAY_IN_SEC;
+}
+
+time_t get_next_month(time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
+    tm.tm_mday = 1;
+    tm.tm_mon++;
+    return timegm(&tm);
+}
+
+// like the firmware's read_log_block(), returns -1 past the end of the
+// file or for a torn block
+int32_t read_log_block(FILE *fp, const struct log_layout *layout, uint32_t index, uint8_t *buf, struct log_cursor *cursor)
+{
+    if(fseek(fp, log_block_offset(layout, index), SEEK_SET) != 0)
+        return -1;
+    int32_t len = fread(buf, 1, log_block_length(layout), fp);
+    if(len <= 0)
+        return -1;
+    return log_block_entries(layout, index, buf, len, cursor);
+}
+
+// like the firmware's find_log_block(), counts each probe in seeks
+uint32_t find_log_block(FILE *fp, const struct log_layout *layout, time_t t, int32_t *seeks)
+{
+    uint8_t buf[LOG_BLOCK_SIZE];
+    struct log_cursor cursor;
+    uint32_t low = 0, high = log_block_count(layout);
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        const struct log_entry *first = NULL;
+        (*seeks)++;
+        if(read_log_block(fp, layout, mid, buf, &cursor) > 0)
+            first = log_next_entry(&cursor);
+        if(first == NULL || first->time >= t)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return low;
+}
+
+void handle_accept(struct sim_strip *s, int32_t epfd)
+{
+    int32_t fd = accept(s->listen_fd, NULL, NULL);
+    if(fd == -1)
+        return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if(s->conn_fd != -1)
+    {
+        close(fd);
+        return;
+    }
+    int32_t yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = s->index;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    s->conn_fd = fd;
+    s->rx_head = s->rx_tail = 0;
+    s->tx_head = s->tx_count = 0;
+    if(verbose)
+        printf("strip %d: connected\n", s->index);
+    // the WiFly module greets every new connection
+    int64_t now_us = get_time_us();
+    s->tx_link_free_us = now_us;
+    queue_reply(s, 0, 0, (uint8_t *)WIFLY_GREETING, strlen(WIFLY_GREETING), now_us);
+}
+
+void close_conn(struct sim_strip *s, int32_t epfd)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->conn_fd, NULL);
+    close(s->conn_fd);
+    s->conn_fd = -1;
+    if(verbose)
+        printf("strip %d: disconnected, %llu commands, %llu lost\n", s->index,
+            (unsigned long long)s->commands, (unsigned long long)s->lost);
+}
+
+void handle_readable(struct sim_strip *s, int32_t epfd)
+{
+    if(s->conn_fd == -1)
+        return;
+    if(s->rx_head > 0)
+    {
+        memmove(s->rx_buf, s->rx_buf + s->rx_head, s->rx_tail - s->rx_head);
+        s->rx_tail -= s->rx_head;
+        s->rx_head = 0;
+    }
+    if(s->rx_tail == RX_BUF_SIZE)
+        s->rx_tail = 0;
+    ssize_t count = recv(s->conn_fd, s->rx_buf + s->rx_tail, RX_BUF_SIZE - s->rx_tail, 0);
+    if(count == 0 || (count == -1 && errno != EAGAIN && errno != EINTR))
+    {
+        close_conn(s, epfd);
+        return;
+    }
+    if(count == -1)
+        return;
+    // line noise, one byte of what came in gets garbled
+    if(chance(noise_percent))
+        s->rx_buf[s->rx_tail + rand() % count] ^= 1 << (rand() % 8);
+    s->rx_tail += count;
+
+    int64_t now_us = get_time_us();
+    uint8_t tag;
+    uint8_t *data;
+    int32_t len;
+    while((len = parse_frame(s->rx_buf, &s->rx_head, s->rx_tail, MASTER_COMMAND_TRANSMISSION_START, &tag, &data)) != -1)
+    {
+        // the whole frame has to make it through the serial link first
+        int64_t arrival_us = (s->rx_link_free_us > now_us ? s->rx_link_free_us : now_us) + (int64_t)FRAME_SIZE(len) * byte_us;
+        s->rx_link_free_us = arrival_us;
+        // like get_serial_commands(), commands that don't fit are thrown away
+        if(len == 0 || len > BUF_SIZE || chance(loss_percent))
+        {
+            s->lost++;
+            continue;
+        }
+        do_master_command(s, tag, data, arrival_us);
+    }
+}
+
+// carry out a command like loop() does and queue the response
+void do_master_command(struct sim_strip *s, uint8_t tag, uint8_t *data, int64_t arrival_us)
+{
+    uint8_t send_buf[MAX_FRAME_DATA_SIZE];
+    int32_t send_len = 0;
+    int64_t start_us = arrival_us > s->busy_until_us ? arrival_us : s->busy_until_us;
+    int64_t work_us = LOOP_US;
+    memset(send_buf, 0, MAX_FRAME_DATA_SIZE);
+    s->commands++;
+    switch(data[0])
+    {
+        case MASTER_COMMAND_TOGGLE_SOCKET:
+        if(data[1] < 3)
+        {
+            // switching a tripped socket back on resets its trip
+            if(data[2])
+                trip_clear(&s->trip, data[1]);
+            shed_forget(&s->shedder, data[1]);
+            s->socket_state = data[2] ? s->socket_state | (1 << data[1]) : s->socket_state & ~(1 << data[1]);
+        }
+        break;
+
+        case MASTER_COMMAND_REQUEST_SOCKET_STATUS:
+        {
+            uint16_t current[4], power[4], voltage;
+            sim_readings(s, current, power, &voltage);
+            send_buf[0] = s->socket_state;
+            for(int32_t i = 0; i < 4; i++)
+            {
+                int16_to_char(current[i], &send_buf[1 + 2 * i]);
+                int16_to_char(power[i], &send_buf[9 + 2 * i]);
+            }
+            int16_to_char(voltage, &send_buf[17]);
+            send_len = SOCKET_STATUS_SIZE;
+        }
+        break;
+
+        case MASTER_COMMAND_SET_TIME:
+        s->clock_offset = (int64_t)char_to_int32(data + 1) - time(0);
+        break;
+
+        case MASTER_COMMAND_ENERGY_QUERY:
+        {
+            uint32_t result[4];
+            work_us += (int64_t)calc_energy(s, char_to_int32(data + 1), char_to_int32(data + 5), result) * SD_US_PER_SECTOR;
+            for(int32_t i = 0; i < 4; i++)
+                int32_to_char(result[i], &send_buf[4 * i]);
+            send_len = ENERGY_RESULT_SIZE;
+        }
+        break;
+
+        case MASTER_COMMAND_SET_SOCKETS:
+        for(int32_t i = 0; i < 3; i++)
+        {
+            if(data[1] & data[2] & (1 << i))
+                trip_clear(&s->trip, i);
+            if(data[1] & (1 << i))
+                shed_forget(&s->shedder, i);
+        }
+        s->socket_state = (s->socket_state & ~(data[1] & 0x7)) | (data[1] & data[2] & 0x7);
+        send_buf[0] = s->socket_state;
+        send_len = 1;
+        break;
+
+        case MASTER_COMMAND_SUBSCRIBE:
+        {
+            int32_t interval_ms = char_to_int16(data + 1);
+            if(interval_ms > 0 && interval_ms < TELEMETRY_MIN_INTERVAL_MS)
+                interval_ms = TELEMETRY_MIN_INTERVAL_MS;
+            s->telemetry_us = (int64_t)interval_ms * 1000;
+            s->next_telemetry_us = start_us + s->telemetry_us;
+            s->telemetry_tag = tag;
+            s->telemetry_seq = 0;
+        }
+        break;
+
+        case MASTER_COMMAND_LOG_READ:
+        send_len = read_log_chunk(s, char_to_int32(data + 1), char_to_int32(data + 5), send_buf);
+        work_us += (int64_t)(send_len / LOG_ENTRY_SIZE) * SD_US_PER_ENTRY;
+        break;
+
+        case MASTER_COMMAND_TRIP_CONFIG:
+        if(data[1] < 4 && char_to_int16(data + 2) <= METERING_FULL_SCALE_MA)
+        {
+            // windows up to now were metered with the old limit
+            sim_readings(s, NULL, NULL, NULL);
+            s->trip_limit_mA[data[1]] = char_to_int16(data + 2);
+            trip_set_limit(&s->trip, data[1], s->trip_limit_mA[data[1]]);
+        }
+        // the reply is a trip status
+        // fall through
+        case MASTER_COMMAND_TRIP_STATUS:
+        // trips are found as the windows are metered
+        sim_readings(s, NULL, NULL, NULL);
+        for(int32_t i = 0; i < 4; i++)
+        {
+            uint32_t latency_us = trip_rounds_to_us(s->trip.ch[i].latency_rounds);
+            send_buf[3 * i] = s->trip.ch[i].fault;
+            int16_to_char(latency_us > 0xffff ? 0xffff : latency_us, &send_buf[3 * i + 1]);
+        }
+        for(int32_t i = 0; i < 4; i++)
+            int16_to_char(s->trip_limit_mA[i], &send_buf[12 + 2 * i]);
+        send_len = TRIP_STATUS_SIZE;
+        break;
+
+        case MASTER_COMMAND_SHED_CONFIG:
+        shed_configure(&s->shedder, char_to_int16(data + 1), char_to_int16(data + 3), data + 5);
+        send_len = shed_encode_status(&s->shedder, s->shedder.next_seq, send_buf);
+        break;
+
+        case MASTER_COMMAND_SHED_STATUS:
+        // the shedder runs as the windows are metered
+        sim_readings(s, NULL, NULL, NULL);
+        send_len = shed_encode_status(&s->shedder, char_to_int16(data + 1), send_buf);
+        break;
+
+        case MASTER_COMMAND_LOG_CONFIG:
+        if(char_to_int16(data + 3) != 0)
+            log_filter_configure(&s->log_filter, char_to_int16(data + 1), char_to_int16(data + 3));
+        int16_to_char(s->log_filter.deadband_mA, &send_buf[0]);
+        int16_to_char(s->log_filter.max_interval_sec, &send_buf[2]);
+        send_len = LOG_CONFIG_SIZE;
+        break;
+
+        case MASTER_COMMAND_BOOT_STATUS:
+        // the simulated strip starts with every socket on and a card in
+        send_buf[0] = BOOT_FROM_NOTHING;
+        int32_to_char(0, &send_buf[1]);
+        int32_to_char(0, &send_buf[5]);
+        send_len = BOOT_STATUS_SIZE;
+        break;
+
+        default:
+        // the firmware doesn't answer commands it doesn't know
+        return;
+    }
+    s->busy_until_us = start_us + work_us;
+    if(chance(loss_percent))
+    {
+        s->lost++;
+        return;
+    }
+    int64_t ready_us = s->busy_until_us;
+    if(jitter_ms > 0)
+        ready_us += rand() % (jitter_ms * 1000);
+    queue_reply(s, SLAVE_COMMAND_ACK, tag, send_buf, send_len, ready_us);
+}
+
+// same reply as the firmware's send_log_chunk(), returns its length
+int32_t read_log_chunk(struct sim_strip *s, time_t day_utc, uint32_t offset, uint8_t *chunk)
+{
+    char path[PATH_SIZE];
+    uint32_t file_size = 0;
+    int32_t len = 0;
+    get_log_path(s, day_utc, path);
+    FILE *log_file = fopen(path, "rb");
+    if(log_file != NULL)
+    {
+        fseek(log_file, 0, SEEK_END);
+        file_size = ftell(log_file);
+        if(offset < file_size && fseek(log_file, offset, SEEK_SET) == 0)
+            len = fread(chunk + LOG_CHUNK_HEADER_SIZE, 1, file_size - offset < LOG_CHUNK_SIZE ? file_size - offset : LOG_CHUNK_SIZE, log_file);
+        fclose(log_file);
+    }
+    int32_to_char(file_size, chunk);
+    int32_to_char(offset, chunk + 4);
+    len += LOG_CHUNK_HEADER_SIZE;
+    int16_to_char(crc16_ccitt(0xffff, chunk, len), chunk + len);
+    return len + 2;
+}
+
+// push a telemetry frame like the firmware's telemetry_stream, it can
+// be lost like any reply
+void send_telemetry(struct sim_strip *s, int64_t now_us)
+{
+    uint8_t send_buf[TELEMETRY_MAX_SIZE];
+    uint16_t current[4], power[4];
+    s->next_telemetry_us += s->telemetry_us;
+    if(s->next_telemetry_us < now_us)
+        s->next_telemetry_us = now_us + s->telemetry_us;
+    sim_readings(s, current, power, NULL);
+    int32_t len = encode_telemetry(send_buf, s->telemetry_seq++, s->socket_state, current, s->telemetry_last);
+    // nobody is listening, but the firmware doesn't know that
+    if(s->conn_fd == -1)
+        return;
+    if(chance(loss_percent))
+    {
+        s->lost++;
+        return;
+    }
+    queue_reply(s, SLAVE_COMMAND_ACK, s->telemetry_tag, send_buf, len, now_us);
+}
+
+// queue a frame to go out once it has been through the serial link,
+// start of 0 queues raw bytes without a header
+void queue_reply(struct sim_strip *s, uint8_t start, uint8_t tag, uint8_t *data, int32_t len, int64_t ready_us)
+{
+    if(s->tx_count == TX_QUEUE_SIZE)
+    {
+        s->lost++;
+        return;
+    }
+    struct pending_reply *r = &s->tx[(s->tx_head + s->tx_count) % TX_QUEUE_SIZE];
+    if(start == 0)
+    {
+        memcpy(r->data, data, len);
+        r->len = len;
+    }
+    else
+        r->len = build_frame(r->data, start, tag, data, len);
+    if(chance(noise_percent))
+        r->data[rand() % r->len] ^= 1 << (rand() % 8);
+    // bytes go out one after another at the baud rate
+    r->due_us = (ready_us > s->tx_link_free_us ? ready_us : s->tx_link_free_us) + (int64_t)r->len * byte_us;
+    s->tx_link_free_us = r->due_us;
+    s->tx_count++;
+}
+
+// send every reply that's done going through the serial link
+void flush_replies(struct sim_strip *s, int32_t epfd, int64_t now_us)
+{
+    while(s->conn_fd != -1 && s->tx_count > 0 && s->tx[s->tx_head].due_us <= now_us)
+    {
+        struct pending_reply *r = &s->tx[s->tx_head];
+        if(send(s->conn_fd, r->data, r->len, 0) != r->len)
+        {
+            close_conn(s, epfd);
+            return;
+        }
+        s->tx_head = (s->tx_head + 1) % TX_QUEUE_SIZE;
+        s->tx_count--;
+    }
+}
@@ -1,8 +1,13 @@
 #include <LiquidCrystal.h>
 #include <Time.h>
 #include <SD.h>
+#include <EEPROM.h>
 #include <stdint.h>
 #include <math.h>
+#include <DMAChannel.h>
+#include "powerduino_protocol.h"
+#include "powerduino_metering.h"
+#include "powerduino_shedding.h"
 #define PCB_LCD_RS 28
 #define PCB_LCD_EN 29
 #define PCB_LCD_D4 30
@@ -28,31 +33,67 @@
 #define PCB_CURRENT_SENSE_PIN_2 A11
 #define PCB_CURRENT_SENSE_PIN_3 26
 #define PCB_VOLTAGE_SENSE_PIN A14
+// ADC0 inputs of the voltage sense pin and PCB_EXT_PIN_5
+#define PCB_VOLTAGE_SENSE_ADC0 23
+#define PCB_EXT_PIN_5_ADC0 13
 #define SOCKET_ON HIGH
 #define SOCKET_OFF LOW
-#define MASTER_COMMAND_TRANSMISSION_START 31
-#define SLAVE_COMMAND_ACK 30
-#define MASTER_COMMAND_TOGGLE_SOCKET 29
-#define MASTER_COMMAND_REQUEST_SOCKET_STATUS 28
-#define MASTER_COMMAND_SET_TIME 27
-#define MASTER_COMMAND_ENERGY_QUERY 26
 #define BUF_SIZE 32
+#define CMD_QUEUE_SIZE 4
+#define TELEMETRY_MIN_INTERVAL_MS 100
 #define CLEAR_SEND_BUF() memset(send_buf, 0, BUF_SIZE)
-#define CLEAR_RECV_BUF() memset(recv_buf, 0, BUF_SIZE)
 #define CLEAR_LCD() lcd.clear()
 #define SET_TO_BEGINNING() lcd.setCursor(0, 0)
 #define SET_TO_BEGINNING_ROW2() lcd.setCursor(0, 1)
 #define SET_TO_BEGINNING_ROW3() lcd.setCursor(0, 2)
 #define SET_TO_BEGINNING_ROW4() lcd.setCursor(0, 3)
 #define SD_SLAVE_SELECT 10
-#define MAINS_VOLTAGE_RMS 120
+// SD.begin() can take a while to give up without a card
+#define CARD_RETRY_MS 5000
 #define ONE_DAY_IN_SEC 86400
+#define ONE_HOUR_IN_SEC 3600
 #define KWH_IN_J 3600000
-#define ENERGY_LOG_PERIOD_SEC 10
+#define ENERGY_LOG_PERIOD_SEC LOG_PERIOD_SEC
+// log entries can sit in RAM this long before they're on the card
+#define LOG_FLUSH_SEC 300
+#define LOG_SECTOR_SIZE 512
+#define ROLLUP_HOUR 0
+#define ROLLUP_DAY 1
+#define ROLLUP_MONTH 2
+#define ROLLUP_RECORD_SIZE 16
+#define ENERGY_RING_MINUTES 1440
+// energy_ring buckets count in this many Joules
+#define ENERGY_RING_UNIT_J 10
+#define STATE_FILE_NAME "STATE"
+// sockets, settings, the shedder, the log config and the trip limits,
+// see save_state()
+#define STATE_DATA_SIZE 27
+// slots from before the trip limits
+#define STATE_LOG_DATA_SIZE 19
+// and before the log config
+#define STATE_SHED_DATA_SIZE 15
+// magic, sequence number, state, crc16_ccitt() of all that
+#define STATE_SLOT_SIZE (1 + 4 + STATE_DATA_SIZE + 2)
+#define STATE_SLOT_MAGIC 0xa5
+// changes within this long of the first one go out in a single write
+#define STATE_COALESCE_MS 1000
+// where the copy of the newest slot goes, see state_journal
+#define STATE_SNAPSHOT_ADDR 0
 #define UI_BUF_SIZE 25
 #define ZERO_CROSS_THRESHOLD 200
 #define MENU_PAGE_NUM 4
 #define CUSTOM_FUNC_SIZE 3
+#define CURRENT_CHANNELS 4
+// every socket's limit until it's set with MASTER_COMMAND_TRIP_CONFIG
+#define CURRENT_LIMIT_MA 5000
+// how often the sample ring is checked for overcurrent
+#define TRIP_CHECK_US 1000
+
+// current sense pin of each socket, and its input on ADC1. pin 26
+// is on the "a" side of the mux
+constexpr uint8_t current_sense_pin[] = {PCB_CURRENT_SENSE_PIN_0, PCB_CURRENT_SENSE_PIN_1, PCB_CURRENT_SENSE_PIN_2, PCB_CURRENT_SENSE_PIN_3};
+constexpr uint8_t current_sense_adc1[] = {0, 3, 21, 5};
+static_assert(sizeof(current_sense_adc1) == sizeof(current_sense_pin), "every current sense pin needs an ADC1 input");
 
 // button class, supports both click and hold
 class button
@@ -124,84 +165,283 @@ public:
 	}
 };
 
-// please see the software overview for a detailed
-// description of algorithm used here
+// samples the current sensors and the mains voltage in the background:
+// the PDB triggers ADC1 and ADC0 together, METERING_SAMPLES_PER_CYCLE
+// times per mains cycle for each scan slot. ADC1 goes through the current
+// sensors while ADC0 reads the voltage at the same moment. the last slot
+// of each round is spare on ADC1 and lets ADC0 read the light sensor,
+// analogRead() can't be used on either ADC while the PDB drives them.
+// for each ADC one DMA channel moves results into a ring of two metering
+// windows and a second one, chained to it, points the ADC at the next
+// input. loop() feeds each half of the rings to the metering once the
+// DMA is done with it.
+// the sensors are interleaved, one per slot, and the PDB runs faster
+// with each one added, so a window always covers the same mains cycles
+template<size_t Channels>
 class current_reader
 {
 private:
-	uint8_t current_sensor_pin[4];
-	int16_t sample_array[3][83];
-	uint16_t output_buf[3][10];
-	uint8_t size, buffer_index;
+	static_assert(Channels <= METERING_MAX_CHANNELS && Channels <= sizeof(current_sense_adc1), "more current channels than sensors");
+	static const uint8_t aux_slot = Channels;
+	static const uint8_t slots = Channels + 1;
+	static const uint16_t half_size = slots * METERING_WINDOW_SAMPLES;
+	uint16_t current_ring[2 * half_size];
+	uint16_t voltage_ring[2 * half_size];
+	// SC1A for the conversion after each result, so rotated by one
+	uint32_t current_scan[slots];
+	uint32_t voltage_scan[slots];
+	uint8_t adc_channel[Channels];
+	DMAChannel dma_current;
+	DMAChannel dma_current_scan;
+	DMAChannel dma_voltage;
+	DMAChannel dma_voltage_scan;
+	struct metering meter;
+	// runs on the current ring at TRIP_CHECK_US, a round at a time
+	struct trip_detector trip;
+	uint16_t trip_round;
+	// time from the start of each fault to its trip, in us
+	uint16_t trip_latency_us[Channels];
+	// halves of the ring filled by the DMA, and fed to the metering
+	volatile uint32_t blocks_done;
+	uint32_t blocks_read;
+	uint32_t overruns;
+
+	// index of the newest sample in voltage_ring
+	uint16_t newest_voltage_index()
+	{
+		uint16_t written = (const volatile uint16_t *)dma_voltage.destinationAddress() - voltage_ring;
+		return (written + 2 * half_size - 1) % (2 * half_size);
+	}
+
+	// ring index of the round the DMA is filling now
+	uint16_t current_round()
+	{
+		uint16_t written = (const volatile uint16_t *)dma_current.destinationAddress() - current_ring;
+		return written / slots % (2 * half_size / slots);
+	}
+public:
+	current_reader()
+	{
+		for(size_t i = 0; i < Channels; i++)
+			adc_channel[i] = current_sense_adc1[i];
+		for(int i = 0; i < slots; i++)
+		{
+			uint8_t next = (i + 1) % slots;
+			// ADC1 just repeats a sensor in the spare slot
+			current_scan[i] = ADC_SC1_ADCH(adc_channel[next == aux_slot ? 0 : next]);
+			voltage_scan[i] = ADC_SC1_ADCH(next == aux_slot ? PCB_EXT_PIN_5_ADC0 : PCB_VOLTAGE_SENSE_ADC0);
+		}
+		metering_init(&meter, Channels, slots);
+		// the first sensor reads 60mA high
+		meter.offset_mA[0] = 60;
+		trip_init(&trip, Channels, slots);
+		trip_round = 0;
+		memset(trip_latency_us, 0, sizeof(trip_latency_us));
+		blocks_done = 0;
+		blocks_read = 0;
+		overruns = 0;
+	}
 
-	void read_current_internal()
+	void begin(void (*isr)())
 	{
-		int32_t sqsum[3] = {0,0,0};
-		int32_t sum[3] = {0,0,0};
-		int16_t avg[3] = {0,0,0};
+		memset(current_ring, 0, sizeof(current_ring));
+		memset(voltage_ring, 0, sizeof(voltage_ring));
+		dma_current.source((volatile uint16_t &)ADC1_RA);
+		dma_current.destinationBuffer(current_ring, sizeof(current_ring));
+		dma_current.interruptAtHalf();
+		dma_current.interruptAtCompletion();
+		dma_current.triggerAtHardwareEvent(DMAMUX_SOURCE_ADC1);
+		dma_current.attachInterrupt(isr);
+		dma_current_scan.sourceCircular(current_scan, sizeof(current_scan));
+		dma_current_scan.destination(ADC1_SC1A);
+		dma_current_scan.triggerAtTransfersOf(dma_current);
+		// both ADCs finish at the same time, so the current ring's
+		// interrupt covers the voltage ring too
+		dma_voltage.source((volatile uint16_t &)ADC0_RA);
+		dma_voltage.destinationBuffer(voltage_ring, sizeof(voltage_ring));
+		dma_voltage.triggerAtHardwareEvent(DMAMUX_SOURCE_ADC0);
+		dma_voltage_scan.sourceCircular(voltage_scan, sizeof(voltage_scan));
+		dma_voltage_scan.destination(ADC0_SC1A);
+		dma_voltage_scan.triggerAtTransfersOf(dma_voltage);
+		dma_current_scan.enable();
+		dma_current.enable();
+		dma_voltage_scan.enable();
+		dma_voltage.enable();
+		// all inputs are on the "a" side of the muxes
+		ADC0_CFG2 &= ~ADC_CFG2_MUXSEL;
+		ADC1_CFG2 &= ~ADC_CFG2_MUXSEL;
+		ADC0_SC2 |= ADC_SC2_ADTRG | ADC_SC2_DMAEN;
+		ADC1_SC2 |= ADC_SC2_ADTRG | ADC_SC2_DMAEN;
+		ADC0_SC1A = ADC_SC1_ADCH(PCB_VOLTAGE_SENSE_ADC0);
+		ADC1_SC1A = ADC_SC1_ADCH(adc_channel[0]);
+		SIM_SCGC6 |= SIM_SCGC6_PDB;
+		PDB0_MOD = F_BUS / (METERING_SAMPLES_PER_CYCLE * MAINS_HZ * slots) - 1;
+		PDB0_IDLY = 0;
+		// pre-trigger 0 of both channels, no delay, so the conversions
+		// start together
+		PDB0_CH0C1 = 0x0101;
+		PDB0_CH1C1 = 0x0101;
+		PDB0_SC = PDB_SC_TRGSEL(15) | PDB_SC_PDBEN | PDB_SC_CONT | PDB_SC_LDOK;
+		PDB0_SC |= PDB_SC_SWTRIG;
+	}
 
-		buffer_index = ++buffer_index % 10;
+	void end()
+	{
+		PDB0_SC = 0;
+		ADC0_SC2 &= ~(ADC_SC2_ADTRG | ADC_SC2_DMAEN);
+		ADC1_SC2 &= ~(ADC_SC2_ADTRG | ADC_SC2_DMAEN);
+		dma_current.disable();
+		dma_current_scan.disable();
+		dma_voltage.disable();
+		dma_voltage_scan.disable();
+	}
 
-		for(int i = 0; i < size; i++)
+	// called from the DMA interrupt at half and full ring
+	void block_done()
+	{
+		dma_current.clearInterrupt();
+		blocks_done++;
+	}
+
+	// feed the halves that filled up since the last call to the metering.
+	// if loop() was held up for more than a window, the older halves are
+	// already overwritten and only the newest one is used
+	void update()
+	{
+		uint32_t done = blocks_done;
+		if(done - blocks_read > 1)
 		{
-			for(int j = 0; j < 3; j++)
-			{
-				sample_array[j][i] = analogRead(current_sensor_pin[j]);
-				sum[j] += sample_array[j][i];
-			}
-			delayMicroseconds(200);
+			overruns += done - blocks_read - 1;
+			blocks_read = done - 1;
 		}
+		for(; blocks_read != done; blocks_read++)
+		{
+			uint16_t offset = (blocks_read % 2) * half_size;
+			metering_feed(&meter, current_ring + offset, voltage_ring + offset, half_size);
+		}
+	}
 
-		for(int j = 0; j < 3; j++)
+	// sockets without a sensor read 0
+	void read_current(volatile uint16_t current_array[4])
+	{
+		for(size_t j = 0; j < 4; j++)
+			current_array[j] = j < Channels ? metering_current(&meter, j) : 0;
+	}
+
+	// real power of each socket in 0.1W, a socket can't give power back
+	// so noise below 0 reads 0
+	void read_power(volatile uint16_t power_array[4])
+	{
+		for(size_t j = 0; j < 4; j++)
 		{
-			avg[j] = sum[j] / size;
-			for(int i = 0; i < size; i++)
-			{
-				sample_array[j][i] -= avg[j];
-				sqsum[j] += sample_array[j][i] * sample_array[j][i];
-			}
+			int32_t power = j < Channels ? metering_power(&meter, j) : 0;
+			power_array[j] = power < 0 ? 0 : power > 0xffff ? 0xffff : power;
 		}
+	}
+
+	// RMS current of each socket over the last window alone, in mA
+	void read_window_current(uint16_t current_array[4])
+	{
+		for(size_t j = 0; j < 4; j++)
+			current_array[j] = j < Channels ? meter.window_mA[j] : 0;
+	}
+
+	// windows finished so far, a new one comes every METERING_WINDOW_US
+	uint32_t get_windows()
+	{
+		return meter.windows;
+	}
 
-		for(int j = 0; j < 3; j++)
+	// RMS mains voltage in 0.1V
+	uint16_t read_voltage()
+	{
+		return metering_voltage(&meter);
+	}
+
+	// newest sample of the voltage sense pin, scaled like analogRead()
+	uint16_t voltage_sample()
+	{
+		uint16_t i = newest_voltage_index();
+		if(i % slots == aux_slot)
+			i--;
+		return voltage_ring[i] >> 3;
+	}
+
+	// newest sample of the light sensor on PCB_EXT_PIN_5, scaled like
+	// analogRead()
+	uint16_t aux_sample()
+	{
+		uint16_t i = newest_voltage_index();
+		if(i % slots < aux_slot)
+			i = (i / slots * slots + 2 * half_size - 1) % (2 * half_size);
+		return voltage_ring[i / slots * slots + aux_slot] >> 3;
+	}
+
+	uint32_t get_overruns()
+	{
+		return overruns;
+	}
+
+	// run the trip detector over every round completed since the last
+	// call, from the trip timer's interrupt. returns a bit for each
+	// socket that tripped. the latency counts the rounds that were
+	// waiting behind the tripping one, the check period is in there
+	uint8_t check_trips()
+	{
+		const uint16_t ring_rounds = 2 * half_size / slots;
+		uint16_t end = current_round();
+		uint16_t waiting = (end + ring_rounds - trip_round) % ring_rounds;
+		uint8_t tripped = 0;
+		for(; trip_round != end; trip_round = (trip_round + 1) % ring_rounds)
 		{
-			double current = ((((double)4096 + sqrt((double)sqsum[j] / size)) / 8192) * 50 - 25);
-			if(j == 0)
-                current - 0.06 < 0 ? current = 0 : current -= 0.06;
-            current <= 0.06 ? output_buf[j][buffer_index] = 0 : output_buf[j][buffer_index] = current * 1000;
+			waiting--;
+			uint8_t now_tripped = trip_feed(&trip, current_ring + trip_round * slots, slots);
+			for(size_t i = 0; i < Channels; i++)
+				if(now_tripped & (1 << i))
+				{
+					uint32_t latency = trip_rounds_to_us(trip.ch[i].latency_rounds + waiting + 1);
+					trip_latency_us[i] = latency > 0xffff ? 0xffff : latency;
+				}
+			tripped |= now_tripped;
 		}
+		return tripped;
 	}
 
-	uint16_t calc_avg(uint16_t *list, uint16_t count)
+	// arm a socket's trip at limit_mA, 0 disarms
+	void set_trip_limit(uint8_t socket_index, uint32_t limit_mA)
 	{
-		int32_t sum = 0;
-		for(int i = 0; i < count; i++)
-			sum += list[i];
-		return sum / count;
+		if(socket_index >= Channels)
+			return;
+		noInterrupts();
+		trip_set_limit(&trip, socket_index, limit_mA);
+		interrupts();
 	}
-public:
-	current_reader(uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4)
+
+	void clear_trip(uint8_t socket_index)
 	{
-		current_sensor_pin[0] = c1;
-		current_sensor_pin[1] = c2;
-		current_sensor_pin[2] = c3;
-		current_sensor_pin[3] = c4;
-		size = 83;
-		buffer_index = 0;
-		for(int i = 0; i < size; i++)
-			for(int j = 0; j < 3; j++)
-				sample_array[j][i] = 0;
+		if(socket_index >= Channels)
+			return;
+		noInterrupts();
+		trip_clear(&trip, socket_index);
+		trip_latency_us[socket_index] = 0;
+		interrupts();
+	}
 
-		for(int i = 0; i < 10; i++)
-			for(int j = 0; j < 3; j++)
-				output_buf[j][i] = 0;
+	// TRIP_NONE, TRIP_RMS or TRIP_PEAK
+	uint8_t get_trip(uint8_t socket_index)
+	{
+		return socket_index < Channels ? trip.ch[socket_index].fault : TRIP_NONE;
 	}
 
-	void read_current(uint16_t current_array[4])
+	// a bit for each socket whose trip is latched
+	uint8_t get_trips()
 	{
-		read_current_internal();
-		for(int j = 0; j < 3; j++)
-			current_array[j] = calc_avg(output_buf[j], 10);
-		current_array[3]= 0;
+		return trip_latched(&trip);
+	}
+
+	uint16_t get_trip_latency_us(uint8_t socket_index)
+	{
+		return socket_index < Channels ? trip_latency_us[socket_index] : 0;
 	}
 };
 
@@ -230,6 +470,11 @@ public:
 		enabled = state % 2;
 	}
 
+	void set_period(uint16_t period)
+	{
+		alert_period = period;
+	}
+
 	void toggle()
 	{
 		enabled = ++enabled % 2;
@@ -267,6 +512,505 @@ public:
 	}
 };
 
+// keeps the day's log file open and appends to it through a RAM buffer.
+// new files are made of LOG_BLOCK_SIZE blocks of packed entries, see
+// log_pack_entry(). the one being filled is kept in RAM and written whole, at its place in the file, when it's full
+// or the log is flushed. earlier blocks are never written again, so a
+// power cut can only tear the last one, and opening the file only has to
+// check that one to find where to go on. files from before the blocks
+// get their entries appended as they are, a sector at a time.
+// the file is flushed, which writes its new size into the directory, only
+// every flush_interval seconds, and a power cut loses at most that much
+// of the log. opening and closing the file for each entry read and
+// rewrote the directory, the FAT and the last sector every time
+class log_writer
+{
+private:
+	File log_file;
+	char file_name[10];
+	int32_t entry_size;
+	uint8_t blocked;
+	// bytes of the file that have been written to the card. for older
+	// files the buffer holds the ones after them, for block logs the
+	// block being filled
+	uint32_t file_size;
+	uint8_t buf[LOG_SECTOR_SIZE];
+	uint16_t buf_len;
+	struct log_tail tail;
+	// entries in buf that aren't on the card
+	uint8_t block_dirty;
+	uint16_t flush_interval;
+	time_t last_flush;
+	uint8_t is_open;
+	// written to since the last flush
+	uint8_t dirty;
+
+	void write_buf()
+	{
+		if(blocked)
+		{
+			write_block();
+			return;
+		}
+		if(buf_len == 0)
+			return;
+		log_file.write(buf, buf_len);
+		file_size += buf_len;
+		buf_len = 0;
+		dirty = 1;
+	}
+
+	void write_block()
+	{
+		if(!block_dirty)
+			return;
+		log_seal_block(buf, tail.index, tail.count, tail.interval);
+		log_file.seek(tail.index * LOG_BLOCK_SIZE);
+		log_file.write(buf, LOG_BLOCK_SIZE);
+		if(file_size < (tail.index + 1) * LOG_BLOCK_SIZE)
+			file_size = (tail.index + 1) * LOG_BLOCK_SIZE;
+		block_dirty = 0;
+		dirty = 1;
+	}
+
+	// add len bytes to the end of a file from before the blocks
+	void put(const uint8_t *data, uint16_t len)
+	{
+		while(len > 0)
+		{
+			uint16_t room = LOG_SECTOR_SIZE - file_size % LOG_SECTOR_SIZE - buf_len;
+			uint16_t n = len < room ? len : room;
+			memcpy(buf + buf_len, data, n);
+			buf_len += n;
+			data += n;
+			len -= n;
+			if(n == room)
+				write_buf();
+		}
+	}
+
+	// find where the block log goes on, with a single read of its last
+	// block whatever the size of the file. a torn block is replaced by
+	// what's left of it right away, so the file reads right
+	void recover_tail()
+	{
+		int32_t len = 0;
+		if(file_size >= LOG_BLOCK_SIZE && log_file.seek((file_size / LOG_BLOCK_SIZE - 1) * LOG_BLOCK_SIZE))
+			len = log_file.read(buf, LOG_BLOCK_SIZE);
+		log_recover_tail(&tail, buf, len, file_size);
+		entry_size = LOG_ENTRY_SIZE;
+		block_dirty = 0;
+		if(tail.count == 0 && tail.index * LOG_BLOCK_SIZE < file_size)
+		{
+			block_dirty = 1;
+			write_block();
+			log_file.flush();
+			dirty = 0;
+		}
+	}
+
+	// switch to the file of another day. a new file is a block log, one
+	// from before them keeps getting entries of its own version
+	int8_t open_file(const char *name, time_t time)
+	{
+		close();
+		log_file = SD.open(name, FILE_WRITE);
+		if(log_file == NULL)
+			return -1;
+		strcpy(file_name, name);
+		is_open = 1;
+		last_flush = time;
+		file_size = log_file.size();
+		uint8_t header[LOG_HEADER_SIZE];
+		int32_t len = 0;
+		if(file_size > 0 && log_file.seek(0))
+			len = log_file.read(header, LOG_HEADER_SIZE);
+		blocked = file_size == 0 || (len >= 4 && memcmp(header, LOG_BLOCK_MAGIC, 4) == 0);
+		if(blocked)
+			recover_tail();
+		else
+		{
+			log_parse_header(header, len, &entry_size);
+			log_file.seek(file_size);
+		}
+		return 0;
+	}
+public:
+	log_writer(uint16_t interval)
+	{
+		flush_interval = interval;
+		buf_len = 0;
+		is_open = 0;
+		dirty = 0;
+		blocked = 0;
+		block_dirty = 0;
+	}
+
+	// open the log file name after a restart, and repair it if the
+	// restart tore its last block
+	int8_t recover(const char *name)
+	{
+		if(is_open && strcmp(name, file_name) == 0)
+			return 0;
+		return open_file(name, now());
+	}
+
+	// append a reading to the log file name, which is the file of
+	// time's day, if filter lets it through. files from before the
+	// blocks get every reading, they can't tell steady readings from
+	// none. returns -1 if the file can't be opened
+	int8_t append(const char *name, const struct log_entry *entry, struct log_filter *filter)
+	{
+		if(!is_open || strcmp(name, file_name) != 0)
+		{
+			if(open_file(name, entry->time) == -1)
+				return -1;
+			log_filter_reset(filter);
+		}
+		if(blocked)
+		{
+			if(!log_filter_pass(filter, entry))
+				return 0;
+			uint8_t interval = log_filter_interval(filter);
+			if(log_tail_append(&tail, buf, entry, interval) == -1)
+			{
+				write_block();
+				log_tail_next(&tail, buf);
+				log_tail_append(&tail, buf, entry, interval);
+			}
+			block_dirty = 1;
+		}
+		else
+		{
+			uint8_t entry_buf[LOG_ENTRY_SIZE];
+			log_encode_entry(entry, entry_buf);
+			// version 1 entries are the start of a version 2 one, later
+			// versions are padded out with 0s
+			put(entry_buf, entry_size < LOG_ENTRY_SIZE ? entry_size : LOG_ENTRY_SIZE);
+			memset(entry_buf, 0, LOG_ENTRY_SIZE);
+			for(int32_t left = entry_size - LOG_ENTRY_SIZE; left > 0; left -= LOG_ENTRY_SIZE)
+				put(entry_buf, left < LOG_ENTRY_SIZE ? left : LOG_ENTRY_SIZE);
+		}
+		if(entry->time - last_flush >= flush_interval)
+			flush();
+		return 0;
+	}
+
+	// get everything onto the card, before the log is read
+	void flush()
+	{
+		if(!is_open)
+			return;
+		write_buf();
+		if(dirty)
+			log_file.flush();
+		dirty = 0;
+		last_flush = now();
+	}
+
+	void close()
+	{
+		if(!is_open)
+			return;
+		write_buf();
+		log_file.close();
+		is_open = 0;
+		dirty = 0;
+	}
+};
+
+// energy of each socket in each minute of the last day, so the
+// "Energy Today" page is a sum kept up to date instead of a scan of the
+// logs. it's fed every reading, each one counting for the
+// ENERGY_LOG_PERIOD_SEC before it, and when it's seeded from the log the
+// readings a deadband left out are put back, see add_entry_to_ring().
+// the minute going on is kept exact, finished ones in ENERGY_RING_UNIT_J
+// to save RAM
+class energy_ring
+{
+private:
+	uint16_t bucket[ENERGY_RING_MINUTES][4];
+	// sum of the buckets, in ENERGY_RING_UNIT_J
+	uint32_t total[4];
+	// Joules of the minute going on
+	uint32_t partial[4];
+	// the minute going on, in minutes since 1970
+	uint32_t minute;
+	time_t last_timestamp;
+
+	void reset(uint32_t m)
+	{
+		memset(bucket, 0, sizeof(bucket));
+		memset(total, 0, sizeof(total));
+		memset(partial, 0, sizeof(partial));
+		minute = m;
+	}
+
+	// finish the minutes up to m, dropping the ones more than a day
+	// older than m
+	void advance(uint32_t m)
+	{
+		// a clock set back or a day without readings
+		if(m < minute || m - minute >= ENERGY_RING_MINUTES)
+		{
+			reset(m);
+			return;
+		}
+		for(; minute < m; minute++)
+		{
+			uint16_t *finished = bucket[minute % ENERGY_RING_MINUTES];
+			uint16_t *oldest = bucket[(minute + 1) % ENERGY_RING_MINUTES];
+			for(int i = 0; i < 4; i++)
+			{
+				uint32_t units = (partial[i] + ENERGY_RING_UNIT_J / 2) / ENERGY_RING_UNIT_J;
+				finished[i] = units > 0xffff ? 0xffff : units;
+				total[i] += finished[i];
+				partial[i] = 0;
+				total[i] -= oldest[i];
+				oldest[i] = 0;
+			}
+		}
+	}
+public:
+	energy_ring()
+	{
+		clear();
+	}
+
+	void clear()
+	{
+		reset(0);
+		last_timestamp = 0;
+	}
+
+	// a reading of the real power of each socket in 0.1W, in time order
+	void add(time_t time, const volatile uint16_t power[4])
+	{
+		advance(time / 60);
+		if(time >= last_timestamp && time - last_timestamp <= ENERGY_LOG_PERIOD_SEC)
+			for(int i = 0; i < 4; i++)
+				partial[i] += (uint32_t)power[i] * ENERGY_LOG_PERIOD_SEC / 10;
+		last_timestamp = time;
+	}
+
+	// Joules used by each socket in the day up to time, O(1)
+	void get(time_t time, uint32_t result[4])
+	{
+		advance(time / 60);
+		for(int i = 0; i < 4; i++)
+			result[i] = total[i] * ENERGY_RING_UNIT_J + partial[i];
+	}
+};
+
+// the STATE file holds two slots, one sector apart so a write torn by a
+// power cut can only take out the slot it went to. they're written in
+// turn, and the valid one with the higher sequence number wins. a copy of
+// the newest slot goes to EEPROM, so the sockets can be set right after
+// a reset without waiting for the card. nothing is written when the state
+// is the same as what's stored, or before it's been left alone for
+// STATE_COALESCE_MS
+class state_journal
+{
+private:
+	// what the newest slot on the card and the snapshot hold
+	uint8_t saved[STATE_DATA_SIZE];
+	uint8_t snapshot[STATE_DATA_SIZE];
+	uint8_t pending[STATE_DATA_SIZE];
+	uint32_t seq;
+	uint32_t changed_ms;
+	uint8_t dirty;
+	uint8_t card_mounted;
+
+	void encode_slot(uint8_t *buf, uint32_t slot_seq)
+	{
+		buf[0] = STATE_SLOT_MAGIC;
+		int32_to_char(slot_seq, buf + 1);
+		memcpy(buf + 5, pending, STATE_DATA_SIZE);
+		int16_to_char(crc16_ccitt(0xffff, buf, STATE_SLOT_SIZE - 2), buf + STATE_SLOT_SIZE - 2);
+	}
+
+	// len bytes of a slot are in buf. returns how many bytes of state it
+	// has and fills data and seq, -1 if it's not valid. slots from
+	// before the log config or the trip limits are shorter, the rest of
+	// data is left 0
+	int32_t decode_slot(const uint8_t *buf, int32_t len, uint8_t *data, uint32_t *slot_seq)
+	{
+		const uint8_t sizes[3] = {STATE_DATA_SIZE, STATE_LOG_DATA_SIZE, STATE_SHED_DATA_SIZE};
+		for(int i = 0; i < 3; i++)
+		{
+			int32_t slot_size = 1 + 4 + sizes[i] + 2;
+			if(len < slot_size || buf[0] != STATE_SLOT_MAGIC || crc16_ccitt(0xffff, buf, slot_size - 2) != char_to_int16(buf + slot_size - 2))
+				continue;
+			*slot_seq = char_to_int32(buf + 1);
+			memset(data, 0, STATE_DATA_SIZE);
+			memcpy(data, buf + 5, sizes[i]);
+			return sizes[i];
+		}
+		return -1;
+	}
+
+	int32_t read_slot(File *state_file, uint8_t slot, uint8_t *data, uint32_t *slot_seq)
+	{
+		uint8_t buf[STATE_SLOT_SIZE];
+		if(!state_file->seek(slot * LOG_SECTOR_SIZE))
+			return -1;
+		return decode_slot(buf, state_file->read(buf, STATE_SLOT_SIZE), data, slot_seq);
+	}
+
+	uint8_t needs_write()
+	{
+		return memcmp(pending, snapshot, STATE_DATA_SIZE) != 0
+			|| (card_mounted && memcmp(pending, saved, STATE_DATA_SIZE) != 0);
+	}
+
+	// EEPROM.update() skips bytes that are the same, so this only wears
+	// the ones that changed
+	void write_snapshot()
+	{
+		uint8_t buf[STATE_SLOT_SIZE];
+		encode_slot(buf, seq);
+		for(int i = 0; i < STATE_SLOT_SIZE; i++)
+			EEPROM.update(STATE_SNAPSHOT_ADDR + i, buf[i]);
+		memcpy(snapshot, pending, STATE_DATA_SIZE);
+	}
+
+	int8_t write_slot()
+	{
+		File state_file = SD.open(STATE_FILE_NAME, FILE_WRITE);
+		if(state_file == NULL)
+			return -1;
+		uint8_t buf[STATE_SLOT_SIZE];
+		uint32_t offset = ((seq + 1) & 1) * LOG_SECTOR_SIZE;
+		// slot 1 of a new file, or one from before the journal, has to
+		// be padded up to
+		uint32_t file_size = state_file.size();
+		if(file_size < offset)
+		{
+			memset(buf, 0xff, STATE_SLOT_SIZE);
+			state_file.seek(file_size);
+			for(; file_size < offset; file_size += STATE_SLOT_SIZE)
+				state_file.write(buf, offset - file_size < STATE_SLOT_SIZE ? offset - file_size : STATE_SLOT_SIZE);
+		}
+		encode_slot(buf, seq + 1);
+		state_file.seek(offset);
+		size_t written = state_file.write(buf, STATE_SLOT_SIZE);
+		state_file.close();
+		if(written != STATE_SLOT_SIZE)
+			return -1;
+		seq++;
+		memcpy(saved, pending, STATE_DATA_SIZE);
+		return 0;
+	}
+
+public:
+	state_journal()
+	{
+		memset(saved, 0, STATE_DATA_SIZE);
+		memset(snapshot, 0, STATE_DATA_SIZE);
+		memset(pending, 0, STATE_DATA_SIZE);
+		seq = 0;
+		changed_ms = 0;
+		dirty = 0;
+		card_mounted = 0;
+	}
+
+	// the state as it was last stored, from EEPROM. returns how many
+	// bytes of it there are, -1 if there's no valid snapshot, a new
+	// Teensy or one from before it
+	int32_t restore_snapshot(uint8_t data[STATE_DATA_SIZE])
+	{
+		uint8_t buf[STATE_SLOT_SIZE];
+		for(int i = 0; i < STATE_SLOT_SIZE; i++)
+			buf[i] = EEPROM.read(STATE_SNAPSHOT_ADDR + i);
+		uint32_t snapshot_seq;
+		int32_t len = decode_slot(buf, STATE_SLOT_SIZE, snapshot, &snapshot_seq);
+		if(len == -1)
+			return -1;
+		memcpy(data, snapshot, STATE_DATA_SIZE);
+		memcpy(pending, snapshot, STATE_DATA_SIZE);
+		return len;
+	}
+
+	// once the card is in: fills data with the newest valid state in the
+	// STATE file and returns how many bytes of it there are, -1 if
+	// there's none. a file from before the journal is taken as it is,
+	// its slot 0 gets overwritten by the second write. from here on the
+	// state goes to the card too, and if it's not what the card has, it's
+	// written out after STATE_COALESCE_MS
+	int32_t mount(uint8_t data[STATE_DATA_SIZE], uint32_t now_ms)
+	{
+		int32_t len = -1;
+		card_mounted = 1;
+		File state_file;
+		if(SD.exists(STATE_FILE_NAME) && (state_file = SD.open(STATE_FILE_NAME, FILE_READ)) != NULL)
+		{
+			uint8_t slot_data[STATE_DATA_SIZE];
+			uint32_t slot_seq;
+			for(uint8_t slot = 0; slot < 2; slot++)
+			{
+				int32_t slot_len = read_slot(&state_file, slot, slot_data, &slot_seq);
+				if(slot_len == -1)
+					continue;
+				// the sequence number can wrap around
+				if(len == -1 || (int32_t)(slot_seq - seq) > 0)
+				{
+					memcpy(data, slot_data, STATE_DATA_SIZE);
+					seq = slot_seq;
+					len = slot_len;
+				}
+			}
+			if(len == -1 && state_file.size() <= STATE_DATA_SIZE)
+			{
+				state_file.seek(0);
+				len = state_file.read(data, STATE_DATA_SIZE);
+				if(len <= 0)
+					len = -1;
+			}
+			state_file.close();
+		}
+		if(len > 0)
+			memcpy(saved, data, len);
+		if(needs_write() && !dirty)
+		{
+			dirty = 1;
+			changed_ms = now_ms;
+		}
+		return len;
+	}
+
+	// cheap, only remembers the state. changing it back before it's
+	// written cancels the write
+	void set(const uint8_t data[STATE_DATA_SIZE], uint32_t now_ms)
+	{
+		memcpy(pending, data, STATE_DATA_SIZE);
+		if(!needs_write())
+			dirty = 0;
+		else if(!dirty)
+		{
+			dirty = 1;
+			changed_ms = now_ms;
+		}
+	}
+
+	// writes the state once it's settled, to EEPROM and, once it's
+	// mounted, the card. returns -1 if the card couldn't be written, it's
+	// tried again STATE_COALESCE_MS later
+	int8_t update(uint32_t now_ms)
+	{
+		if(!dirty || now_ms - changed_ms < STATE_COALESCE_MS)
+			return 0;
+		if(memcmp(pending, snapshot, STATE_DATA_SIZE) != 0)
+			write_snapshot();
+		if(card_mounted && memcmp(pending, saved, STATE_DATA_SIZE) != 0 && write_slot() != 0)
+		{
+			changed_ms = now_ms;
+			return -1;
+		}
+		dirty = 0;
+		return 0;
+	}
+};
+
 // object that holds the value for a setting
 class setting
 {
@@ -368,15 +1112,17 @@ class zero_cross_detector
 {
 private:
 	time_t last_update;
-	uint8_t pin, enabled;
+	current_reader<CURRENT_CHANNELS> *reader;
+	uint8_t enabled;
 	uint16_t last_reading;
 	uint16_t zero_cross_threshold;
 public:
-	zero_cross_detector(uint8_t voltage_sense_pin, uint16_t threshold)
+	// the voltage sense pin is read from reader's samples
+	zero_cross_detector(current_reader<CURRENT_CHANNELS> *voltage_reader, uint16_t threshold)
 	{
 		last_update = micros();
 		last_reading = ZERO_CROSS_THRESHOLD + 1;
-		pin = voltage_sense_pin;
+		reader = voltage_reader;
 		zero_cross_threshold = threshold;
 		enabled = 1;
 	}
@@ -411,7 +1157,7 @@ public:
 			return 0;
 
 		last_update = micros();
-		this_reading = analogRead(pin);
+		this_reading = reader->voltage_sample();
 		if(last_reading <= zero_cross_threshold && this_reading > zero_cross_threshold)
 			ret = 1;
 		else if(last_reading >= zero_cross_threshold && this_reading < zero_cross_threshold)
@@ -422,64 +1168,195 @@ public:
 	}
 };
 
+// a command received from PC, tag is echoed back in the
+// response so PC can match responses to commands
+struct master_command
+{
+	uint8_t tag;
+	uint8_t len;
+	uint8_t data[BUF_SIZE];
+};
+
+// FIFO of commands waiting to be executed, lets PC send
+// new commands before the previous ones are answered
+class command_queue
+{
+private:
+	master_command queue[CMD_QUEUE_SIZE];
+	uint8_t head, count;
+public:
+	command_queue()
+	{
+		head = 0;
+		count = 0;
+	}
+
+	bool is_empty()
+	{
+		return count == 0;
+	}
+
+	bool is_full()
+	{
+		return count == CMD_QUEUE_SIZE;
+	}
+
+	// the slot the next incoming command is read into
+	master_command* back()
+	{
+		return &queue[(head + count) % CMD_QUEUE_SIZE];
+	}
+
+	void push()
+	{
+		if(!is_full())
+			count++;
+	}
+
+	master_command* front()
+	{
+		return &queue[head];
+	}
+
+	void pop()
+	{
+		if(is_empty())
+			return;
+		head = (head + 1) % CMD_QUEUE_SIZE;
+		count--;
+	}
+};
+
+// streams socket status to PC at a fixed interval after MASTER_COMMAND_SUBSCRIBE,
+// see powerduino_protocol.h for the frame format
+class telemetry_stream
+{
+private:
+	timer frame_timer;
+	uint8_t tag, seq;
+	uint16_t last_current[4];
+public:
+	telemetry_stream() : frame_timer(false, TELEMETRY_MIN_INTERVAL_MS)
+	{
+		frame_timer.set_state(0);
+		tag = 0;
+		seq = 0;
+		memset(last_current, 0, sizeof(last_current));
+	}
+
+	// start streaming with command_tag on every frame, interval of 0 stops it
+	void subscribe(uint8_t command_tag, uint16_t interval_ms)
+	{
+		tag = command_tag;
+		seq = 0;
+		frame_timer.set_period(interval_ms < TELEMETRY_MIN_INTERVAL_MS ? TELEMETRY_MIN_INTERVAL_MS : interval_ms);
+		frame_timer.set_state(interval_ms != 0);
+	}
+
+	uint8_t get_tag()
+	{
+		return tag;
+	}
+
+	// build the next frame into buf if it's due, returns its length or 0
+	uint8_t update(uint8_t socket_status, volatile uint16_t *current, uint8_t *buf)
+	{
+		if(!frame_timer.has_expired())
+			return 0;
+		uint16_t reading[4];
+		for(int i = 0; i < 4; i++)
+			reading[i] = current[i];
+		return encode_telemetry(buf, seq++, socket_status, reading, last_current);
+	}
+};
+
 void toggle_socket(uint8_t socket_index, uint8_t socket_state, zero_cross_detector *zcd, uint8_t save_state_to_sd);
 
 uint8_t send_buf[BUF_SIZE];
-uint8_t recv_buf[BUF_SIZE];
+command_queue cmd_queue;
+telemetry_stream telemetry;
 button button_1(PCB_BUTTON_1, 1);
 button button_2(PCB_BUTTON_2, 1);
 button button_3(PCB_BUTTON_3, 1);
 button button_4(PCB_BUTTON_4, 1);
-current_reader c_reader(PCB_CURRENT_SENSE_PIN_0, PCB_CURRENT_SENSE_PIN_1, PCB_CURRENT_SENSE_PIN_2, PCB_CURRENT_SENSE_PIN_3);
+current_reader<CURRENT_CHANNELS> c_reader;
+IntervalTimer trip_timer;
+// sockets tripped by the trip timer, for loop() to pick up
+volatile uint8_t new_trips;
+// each socket's current limit while the limiter is on, 0 for none
+uint16_t trip_limit_mA[4] = {CURRENT_LIMIT_MA, CURRENT_LIMIT_MA, CURRENT_LIMIT_MA, CURRENT_LIMIT_MA};
+struct load_shedder shedder;
+// metering window the shedder last ran on
+uint32_t shed_window;
 timer current_log_timer(true, ENERGY_LOG_PERIOD_SEC);
-timer energy_update_timer(false, 3000);
+log_writer sd_log(LOG_FLUSH_SEC);
+// which readings current_log_timer takes get logged
+struct log_filter log_filter;
+energy_ring energy_today;
+state_journal sd_state;
+uint8_t card_mounted;
+// how the sockets got their state after the last reset, for
+// MASTER_COMMAND_BOOT_STATUS
+uint8_t boot_source = BOOT_FROM_NOTHING;
+uint32_t relays_restored_us;
+uint32_t card_mounted_ms = BOOT_CARD_NOT_MOUNTED;
 timer UI_update_timer(false, 300);
 LiquidCrystal lcd(PCB_LCD_RS, PCB_LCD_EN, PCB_LCD_D4, PCB_LCD_D5, PCB_LCD_D6, PCB_LCD_D7);
 setting setting_current_limiter(2);
 custom_function_holder custom_func[CUSTOM_FUNC_SIZE];
-zero_cross_detector zd(PCB_VOLTAGE_SENSE_PIN, ZERO_CROSS_THRESHOLD);
-IntervalTimer current_read_timer;
+zero_cross_detector zd(&c_reader, ZERO_CROSS_THRESHOLD);
 volatile uint16_t current_array_global[4];
+// real power in 0.1W and mains voltage in 0.1V
+volatile uint16_t power_array_global[4];
+uint16_t voltage_global;
 
-// timer interrupt handler, read current and store them in
-// a global current array
-void ISR_read_current()
+// DMA interrupt handler, half of the sample ring is ready
+void ISR_sample_block()
 {
-	c_reader.read_current((uint16_t*)current_array_global);
+	c_reader.block_done();
+}
+
+// trip timer interrupt handler, opens the relay of any socket that
+// went over the current limit. the ones tripped before are opened
+// again, in case something switched them on since without clearing it
+void ISR_check_trips()
+{
+	new_trips |= c_reader.check_trips();
+	uint8_t latched = c_reader.get_trips();
+	for(int i = 0; i < 4; i++)
+		if(latched & (1 << i))
+			digitalWrite(get_socket_pin(i), SOCKET_OFF);
 }
 
 void setup()
 {
-	Serial3.begin(9600);
-	Serial.begin(9600);
-	lcd.begin(20, 4);
-	setSyncProvider(getTeensy3Time);
-	analogReadResolution(13);
+	// the sockets come first, everything else can wait
 	pinMode(PCB_RELAY_PIN_0, OUTPUT);
 	pinMode(PCB_RELAY_PIN_1, OUTPUT);
 	pinMode(PCB_RELAY_PIN_2, OUTPUT);
 	pinMode(PCB_RELAY_PIN_3, OUTPUT);
+	shed_init(&shedder);
+	log_filter_init(&log_filter);
+	restore_relays();
+	Serial3.begin(9600);
+	Serial.begin(9600);
+	lcd.begin(20, 4);
+	setSyncProvider(getTeensy3Time);
+	analogReadResolution(13);
 	pinMode(PCB_EXT_PIN_0, INPUT);
 	pinMode(PCB_EXT_PIN_1, INPUT);
 	pinMode(PCB_EXT_PIN_2, INPUT);
 	pinMode(PCB_EXT_PIN_3, INPUT);
 	pinMode(PCB_EXT_PIN_4, INPUT);
 	pinMode(PCB_EXT_PIN_5, INPUT);
-	while(!SD.begin(SD_SLAVE_SELECT))
-	{
-		SET_TO_BEGINNING();
-		lcd.print("insert SD card");
-	}
-	if(recover_state() == -1)
-		for(int i; i < 3; i++)
-			digitalWrite(get_socket_pin(i), SOCKET_OFF);
-	CLEAR_RECV_BUF();
 	CLEAR_SEND_BUF();
 	custom_func[0].attach_custom_function(demo_auto_lamp, "auto_lamp");
 	custom_func[1].attach_custom_function(demo_light_dimmer, "light_dimmer");
 	custom_func[2].attach_custom_function(demo_ext_ctrl, "ext_control");
-	// the timer interrupt fires every 0.3 seconds to update current reading
-	current_read_timer.begin(ISR_read_current, 300000);
+	// current and voltage are sampled by DMA from here on, after
+	// analogReadResolution() has set up the ADCs
+	c_reader.begin(ISR_sample_block);
+	trip_timer.begin(ISR_check_trips, TRIP_CHECK_US);
 	CLEAR_LCD();
 	SET_TO_BEGINNING();
 }
@@ -490,14 +1367,16 @@ void demo_light_dimmer()
 	int8_t dimming_delay = 50;
 	// turn on zero crossing detector
 	zd.set_state(1);
-	// turn off interrupts since precise timing is required
-	current_read_timer.end();
+	// turn off interrupts since precise timing is required. the DMA
+	// keeps sampling, c_reader.update() skips what got overwritten.
+	// the trip timer is stopped too, so the loop checks the trips itself
 	noInterrupts();
 	CLEAR_LCD();
 	print_brightness(dimming_delay);
 
 	while(1)
 	{
+		ISR_check_trips();
 		// increase brightness when pressing button 1
 		if(button_1.unique_Press())
 		{
@@ -505,7 +1384,8 @@ void demo_light_dimmer()
 				dimming_delay -= 10;
 			print_brightness(dimming_delay);
 			// wait for the next zero crossing
-			while(!zd.is_zero_cross());
+			while(!zd.is_zero_cross())
+				ISR_check_trips();
 		}
 
 		// decrease brightness when pressing button 2
@@ -514,14 +1394,14 @@ void demo_light_dimmer()
 			if(dimming_delay + 10 < 100)
 				dimming_delay += 10;
 			print_brightness(dimming_delay);
-			while(!zd.is_zero_cross());
+			while(!zd.is_zero_cross())
+				ISR_check_trips();
 		}
 
 		// exit when pressing button 4
 		if(button_4.unique_Press())
 		{
-			// restart timer interrupt and other interrupts
-			current_read_timer.begin(ISR_read_current, 300000);
+			// restart interrupts
 			interrupts();
 			custom_func[1].disable();
 			return;
@@ -532,13 +1412,14 @@ void demo_light_dimmer()
 			// if at full brightness, just turn it on
 			if(dimming_delay == 0)
 			{
-				digitalWrite(PCB_RELAY_PIN_2, SOCKET_ON);
+				write_socket(2, SOCKET_ON);
 				continue;
 			}
 			delayMicroseconds(dimming_delay * 80);
-			digitalWrite(PCB_RELAY_PIN_2, SOCKET_ON);
+			ISR_check_trips();
+			write_socket(2, SOCKET_ON);
 			delayMicroseconds(200);
-			digitalWrite(PCB_RELAY_PIN_2, SOCKET_OFF);
+			write_socket(2, SOCKET_OFF);
 		}
 	}
 }
@@ -556,39 +1437,102 @@ void print_brightness(int8_t dimming_delay)
 // 3 external pins
 void demo_ext_ctrl()
 {
-	digitalWrite(PCB_RELAY_PIN_0, digitalRead(PCB_EXT_PIN_0));
-	digitalWrite(PCB_RELAY_PIN_1, digitalRead(PCB_EXT_PIN_1));
-	digitalWrite(PCB_RELAY_PIN_2, digitalRead(PCB_EXT_PIN_2));
+	write_socket(0, digitalRead(PCB_EXT_PIN_0));
+	write_socket(1, digitalRead(PCB_EXT_PIN_1));
+	write_socket(2, digitalRead(PCB_EXT_PIN_2));
 }
 
 void loop()
 {
-	// execute command from PC if available
+	// pick up the current samples collected since the last loop
+	c_reader.update();
+	c_reader.read_current(current_array_global);
+	c_reader.read_power(power_array_global);
+	voltage_global = c_reader.read_voltage();
+	shed_load();
+
+	// execute one queued command from PC if available
 	if(get_serial_commands())
 	{
-		uint8_t master_command = recv_buf[0];
-		switch(master_command)
+		master_command *cmd = cmd_queue.front();
+		uint8_t *data = cmd->data;
+		switch(data[0])
 		{
 			case MASTER_COMMAND_TOGGLE_SOCKET:
-			toggle_socket(recv_buf[1], recv_buf[2], &zd, 1);
-			send_default_ACK();
+			toggle_socket(data[1], data[2], &zd, 1);
+			send_default_ACK(cmd->tag);
 			break;
 				
 			case MASTER_COMMAND_REQUEST_SOCKET_STATUS:
-			send_socket_status();
+			send_socket_status(cmd->tag);
 			break;
 
 			case MASTER_COMMAND_SET_TIME:
-			Teensy3Clock.set(char_to_int32(recv_buf+1));
+			Teensy3Clock.set(char_to_int32(data + 1));
 			setTime(Teensy3Clock.get());
-			send_default_ACK();
+			send_default_ACK(cmd->tag);
 			break;
 				
 			case MASTER_COMMAND_ENERGY_QUERY:
-			send_energy(char_to_int32(recv_buf + 1), char_to_int32(recv_buf + 5));
+			send_energy(cmd->tag, char_to_int32(data + 1), char_to_int32(data + 5));
+			break;
+
+			case MASTER_COMMAND_SET_SOCKETS:
+			set_sockets(data[1], data[2], &zd, 1);
+			send_buf[0] = get_socket_status();
+			send_reply(cmd->tag, send_buf, 1);
+			break;
+
+			case MASTER_COMMAND_SUBSCRIBE:
+			// ACK goes out before the first frame
+			send_default_ACK(cmd->tag);
+			telemetry.subscribe(cmd->tag, char_to_int16(data + 1));
+			break;
+
+			case MASTER_COMMAND_LOG_READ:
+			send_log_chunk(cmd->tag, char_to_int32(data + 1), char_to_int32(data + 5));
+			break;
+
+			case MASTER_COMMAND_TRIP_STATUS:
+			send_trip_status(cmd->tag);
+			break;
+
+			case MASTER_COMMAND_TRIP_CONFIG:
+			if(data[1] < 4 && char_to_int16(data + 2) <= METERING_FULL_SCALE_MA)
+			{
+				trip_limit_mA[data[1]] = char_to_int16(data + 2);
+				save_state();
+			}
+			send_trip_status(cmd->tag);
+			break;
+
+			case MASTER_COMMAND_SHED_CONFIG:
+			if(shed_configure(&shedder, char_to_int16(data + 1), char_to_int16(data + 3), data + 5) == 0)
+				save_state();
+			send_shed_status(cmd->tag, shedder.next_seq);
+			break;
+
+			case MASTER_COMMAND_SHED_STATUS:
+			send_shed_status(cmd->tag, char_to_int16(data + 1));
+			break;
+
+			case MASTER_COMMAND_BOOT_STATUS:
+			send_boot_status(cmd->tag);
+			break;
+
+			case MASTER_COMMAND_LOG_CONFIG:
+			if(char_to_int16(data + 3) != 0 && log_filter_configure(&log_filter, char_to_int16(data + 1), char_to_int16(data + 3)) == 0)
+				save_state();
+			send_log_config(cmd->tag);
 			break;
 		}
+		cmd_queue.pop();
 	}
+
+	// stream socket status to PC if it has subscribed
+	uint8_t telemetry_len = telemetry.update(get_socket_status(), current_array_global, send_buf);
+	if(telemetry_len > 0)
+		send_reply(telemetry.get_tag(), send_buf, telemetry_len);
 	
 	print_UI();
 
@@ -596,29 +1540,71 @@ void loop()
 	for(int i = 0; i < CUSTOM_FUNC_SIZE; i++)
 		custom_func[i].do_custom_function();
 
-	// execute current limiter, if they're enabled
-	if(setting_current_limiter.get_val())
-		limit_current(5000);
+	// arm or disarm the current limiter, sockets that tripped get saved
+	limit_current(setting_current_limiter.get_val());
 
 	// store current reading to SD card for energy logging
 	if(current_log_timer.has_expired())
-		append_current_log(getTeensy3Time(), (uint16_t*)current_array_global);
+		append_current_log(getTeensy3Time(), (uint16_t*)current_array_global, (uint16_t*)power_array_global, voltage_global);
+	mount_card();
+	if(card_mounted)
+		update_rollups();
+	store_state();
+}
+
+// every socket trips on its own when it goes over its trip_limit_mA,
+// within a half cycle or a few samples for a short, see trip_feed().
+// the relays are opened from ISR_check_trips(), this saves the new
+// state. a socket stays tripped until it's switched on again. armed 0
+// disarms them all
+void limit_current(uint8_t armed)
+{
+	for(int i = 0; i < 4; i++)
+		c_reader.set_trip_limit(i, armed ? trip_limit_mA[i] : 0);
+	if(new_trips)
+	{
+		noInterrupts();
+		new_trips = 0;
+		interrupts();
+		save_state();
+	}
 }
 
-// unfinished :(
-void limit_current(int limit_mA)
+// keeps the whole strip under shedder's budget. it runs on every new
+// metering window so it reacts within one, current_array_global averages
+// METERING_AVERAGE_WINDOWS of them and would be far too slow. sockets
+// come back one at a time, at a zero crossing like toggle_socket()
+void shed_load()
 {
-	;
+	if(c_reader.get_windows() == shed_window)
+		return;
+	shed_window = c_reader.get_windows();
+	uint16_t current[4];
+	uint8_t restore_mask;
+	c_reader.read_window_current(current);
+	uint8_t off_mask = shed_update(&shedder, current, get_socket_status(), millis(), now(), &restore_mask);
+	for(int i = 0; i < 4; i++)
+	{
+		if(off_mask & (1 << i))
+			digitalWrite(get_socket_pin(i), SOCKET_OFF);
+		if(restore_mask & (1 << i))
+		{
+			if(zd.is_enabled() && i != 1)
+				while(!zd.is_zero_cross());
+			write_socket(i, SOCKET_ON);
+		}
+	}
 }
 
 // read a light sensor on PCB_EXT_PIN_5, turn
-// socket 1 on if dark, on otherwise.
+// socket 1 on if dark, on otherwise. c_reader
+// samples it, ADC0 is busy with the voltage
 void demo_auto_lamp()
 {
-	if(analogRead(PCB_EXT_PIN_5) > 1000)
-		digitalWrite(PCB_RELAY_PIN_0, SOCKET_OFF);
+	if(c_reader.aux_sample() > 1000)
+		write_socket(0, SOCKET_OFF);
 	else
-		digitalWrite(PCB_RELAY_PIN_0, SOCKET_ON);
+		write_socket(0, SOCKET_ON);
 }
 
 void print_UI()
@@ -647,7 +1633,7 @@ void print_UI()
 				char message[UI_BUF_SIZE];
 				for(int i = 0; i < 3; i++)
 				{
-					make_message(message, i, digitalRead(get_socket_pin(i)), (double)current_array_global[i] / 1000);
+					make_message(message, i, digitalRead(get_socket_pin(i)), (double)current_array_global[i] / 1000, (double)power_array_global[i] / 10);
 					lcd.setCursor(0, i+1);
 					lcd.print(message);
 				}
@@ -656,17 +1642,21 @@ void print_UI()
 			
 		case 1:
 			SET_TO_BEGINNING();
-			lcd.print("Energy Today:");
+			lcd.print("Today:");
 			print_time();
-			if(energy_update_timer.has_expired())
+			if(UI_update_timer.has_expired())
 			{
 				uint32_t result[4];
 				char message[21];
-				calc_energy(now() - ONE_DAY_IN_SEC, now(), result);
-				sprintf(message, "1:%.2fkWh 2:%.2fkWh", (double)result[0] / KWH_IN_J, (double)result[1] / KWH_IN_J);
+				energy_today.get(now(), result);
+				// the total goes on the title row, a socket takes half a row
+				snprintf(message, sizeof(message), " %.2fkWh  ", (double)(result[0]+result[1]+result[2]+result[3]) / KWH_IN_J);
+				lcd.setCursor(6, 0);
+				lcd.print(message);
+				snprintf(message, sizeof(message), "1:%.2fkWh 2:%.2fkWh", (double)result[0] / KWH_IN_J, (double)result[1] / KWH_IN_J);
 				SET_TO_BEGINNING_ROW2();
 				lcd.print(message);
-				sprintf(message, "3:%.2fkWh T:%.2fkWh", (double)result[2] / KWH_IN_J, (double)(result[0]+result[1]+result[2]) / KWH_IN_J);
+				snprintf(message, sizeof(message), "3:%.2fkWh 4:%.2fkWh", (double)result[2] / KWH_IN_J, (double)result[3] / KWH_IN_J);
 				SET_TO_BEGINNING_ROW3();
 				lcd.print(message);
 			}
@@ -697,16 +1687,26 @@ void print_UI()
 		case 3:
 			SET_TO_BEGINNING();
 			lcd.print("Settings:");
+			lcd.setCursor(13, 0);
+			lcd.print(card_mounted ? "       " : "no card");
 			// save settings to SD card
-			save_state();
 			if(button_1.unique_Press())
+			{
 				current_log_timer.toggle();
+				save_state();
+			}
 			
 			if(button_2.unique_Press())
+			{
 				zd.toggle();
+				save_state();
+			}
 
 			if(button_3.unique_Press())
+			{
 				setting_current_limiter.toggle();
+				save_state();
+			}
 			
 			SET_TO_BEGINNING_ROW2();
 			lcd.print("Log energy: ");
@@ -758,7 +1758,7 @@ void print_time()
 	lcd.print("  ");
 }
 
-void make_message(char* message, uint8_t socket_index, uint8_t socket_status, double socket_current)
+void make_message(char* message, uint8_t socket_index, uint8_t socket_status, double socket_current, double power)
 {
 	memset(message, 0, UI_BUF_SIZE);
 	sprintf(message, "S%d: ", socket_index + 1);
@@ -773,7 +1773,6 @@ void make_message(char* message, uint8_t socket_index, uint8_t socket_status, do
 		sprintf(message + 8, "%.1fA", socket_current);
 	else
 		sprintf(message + 8, "%.2fA", socket_current);
-	double power = socket_current * MAINS_VOLTAGE_RMS;
 	if(power > 100)
 		sprintf(message + 14, "%.0fW", power);
 	else
@@ -786,101 +1785,340 @@ void make_message(char* message, uint8_t socket_index, uint8_t socket_status, do
 
 // send out energy consumption of all sockets
 // over serial in response of PC's command
-void send_energy(time_t start_utc, time_t end_utc)
+void send_energy(uint8_t tag, time_t start_utc, time_t end_utc)
 {
 	CLEAR_SEND_BUF();
 	uint32_t result[4];
 	calc_energy(start_utc, end_utc, result);
-	send_buf[0] = SLAVE_COMMAND_ACK;
-	send_buf[1] = 16; // 16 bytes of data
 	for(int i = 0; i < 4; i++)
-		int32_to_char(result[i], &send_buf[2 + 4 * i]);
-	Serial3.write(send_buf, 18);
+		int32_to_char(result[i], &send_buf[4 * i]);
+	send_reply(tag, send_buf, ENERGY_RESULT_SIZE);
+}
+
+// send up to LOG_CHUNK_SIZE bytes of the log file of the day day_utc is in,
+// starting at offset, so PC can keep a copy of the logs. a day without a
+// log file reads as an empty file
+void send_log_chunk(uint8_t tag, time_t day_utc, uint32_t offset)
+{
+	uint8_t chunk[LOG_CHUNK_MAX_SIZE];
+	uint32_t file_size = 0;
+	int len = 0;
+	char file_name[10];
+	sd_log.flush();
+	get_filename(day_utc, file_name);
+	if(SD.exists(file_name))
+	{
+		File log_file = SD.open(file_name, FILE_READ);
+		if(log_file != NULL)
+		{
+			file_size = log_file.size();
+			if(offset < file_size && log_file.seek(offset))
+				len = log_file.read(chunk + LOG_CHUNK_HEADER_SIZE, min(file_size - offset, (uint32_t)LOG_CHUNK_SIZE));
+			log_file.close();
+		}
+	}
+	if(len < 0)
+		len = 0;
+	int32_to_char(file_size, chunk);
+	int32_to_char(offset, chunk + 4);
+	len += LOG_CHUNK_HEADER_SIZE;
+	int16_to_char(crc16_ccitt(0xffff, chunk, len), chunk + len);
+	send_reply(tag, chunk, len + 2);
 }
 
 // calculates how much energy was used by all sockets, stores the 
-// result in result[4], unit is in Joules
+// result in result[4], unit is in Joules. whole months, days and hours
+// in the range come from the rollup files, only the hours at the edges
+// are read from the logs, so a year takes a few dozen reads
 void calc_energy(time_t start_utc, time_t end_utc, uint32_t result[4])
 {
-	if(start_utc > end_utc)
-		return;
-	
-	time_t start_day = get_start_of_day(start_utc);
-	time_t current_timestamp, last_timestamp;
-	uint16_t current_array[4];
-	// how many days between start and end
-	uint16_t span = ((get_start_of_day(end_utc) - start_day) / ONE_DAY_IN_SEC) + 1;
-	char file_name[10];
-	File log_file;
-	
-	for(int i = 0; i < 4; i++)
-		result[i] = 0;
-	// for each day between start and end
-	for(int i = 0; i < span; i++)
+	uint64_t energy[4] = {0, 0, 0, 0};
+	// rollups only cover hours that are over, and settled
+	time_t settled = now() - LOG_SETTLE_SEC;
+	time_t done = settled - settled % ONE_HOUR_IN_SEC;
+	for(time_t t = start_utc; t < end_utc;)
 	{
-		// look for that day's file, it doesn't exist go to next day
-		get_filename(start_day + i * ONE_DAY_IN_SEC, file_name);
-		if(!SD.exists(file_name))
+		time_t next = get_next_month(t);
+		if(t == get_start_of_month(t) && next <= end_utc && next <= done)
+		{
+			add_rollup(ROLLUP_MONTH, t, energy);
+			t = next;
 			continue;
-		
-		log_file = SD.open(file_name, FILE_READ);
-		if(log_file == NULL)
+		}
+		next = t + ONE_DAY_IN_SEC;
+		if(t % ONE_DAY_IN_SEC == 0 && next <= end_utc && next <= done)
+		{
+			add_rollup(ROLLUP_DAY, t, energy);
+			t = next;
+			continue;
+		}
+		next = t - t % ONE_HOUR_IN_SEC + ONE_HOUR_IN_SEC;
+		if(t % ONE_HOUR_IN_SEC == 0 && next <= end_utc && next <= done)
+			add_rollup(ROLLUP_HOUR, t, energy);
+		else if(sum_log(t, min(next, end_utc), energy) == -1)
 		{
 			CLEAR_LCD();
 			SET_TO_BEGINNING();
 			lcd.print("cannot read log file");
 			delay(1000);
-			return;
+			break;
 		}
-		
-		// after the file is found, go to the first entry after start_utc
-		while(1)
+		t = next;
+	}
+	for(int j = 0; j < 4; j++)
+		result[j] = energy[j];
+}
+
+// what add_entry_energy() adds to
+struct energy_sum
+{
+	time_t start;
+	time_t end;
+	uint64_t *energy;
+};
+
+// add the energy logged from start_utc up to end_utc, both in the same
+// day, to energy[4] in Joules. returns -1 if the log can't be read
+int8_t sum_log(time_t start_utc, time_t end_utc, uint64_t energy[4])
+{
+	struct energy_sum sum = {start_utc, end_utc, energy};
+	return scan_log(start_utc, end_utc, add_entry_energy, &sum);
+}
+
+// each entry counts for the part of the time since the one before it
+// that's in the range, see log_entry_energy(), so ranges add up
+void add_entry_energy(const struct log_entry *entry, const struct log_entry *prev, void *arg)
+{
+	struct energy_sum *sum = (struct energy_sum *)arg;
+	log_entry_energy(prev, entry, sum->start, sum->end, sum->energy);
+}
+
+// call on_entry for each entry logged from start_utc on, both in the
+// same day, up to the first one at end_utc or after, so the time up to
+// every entry is covered. prev is the entry before it, NULL if there's
+// none within the interval of its block. returns -1 if the log can't be
+// read
+int8_t scan_log(time_t start_utc, time_t end_utc, void (*on_entry)(const struct log_entry *, const struct log_entry *, void *), void *arg)
+{
+	char file_name[10];
+	uint8_t block[LOG_BLOCK_SIZE];
+	struct log_cursor cursor;
+	const struct log_entry *entry;
+	struct log_layout layout;
+	sd_log.flush();
+	get_filename(start_utc, file_name);
+	if(!SD.exists(file_name))
+		return 0;
+	File log_file = SD.open(file_name, FILE_READ);
+	if(log_file == NULL)
+		return -1;
+	if(read_log_layout(&log_file, &layout) == -1)
+	{
+		log_file.close();
+		return -1;
+	}
+	// blocks are in time order and so are the entries in them. the block
+	// before the first one that starts in the range is found by bisection,
+	// it has the entry before the range if there is one
+	uint32_t count = log_block_count(&layout);
+	uint32_t first = find_log_block(&log_file, &layout, start_utc);
+	// the first entry of a day has nothing before it to count from
+	struct log_entry prev = {0};
+	uint8_t have_prev = 0;
+	uint8_t done = 0;
+	for(uint32_t b = first > 0 ? first - 1 : 0; b < count && !done; b++)
+	{
+		// a torn block leaves a gap, which counts as no readings
+		if(read_log_block(&log_file, &layout, b, block, &cursor) <= 0)
 		{
-			if(read_current_log_entry(&log_file, &current_timestamp, current_array) == -1)
-				goto next_file;
-			if(current_timestamp >= start_utc)
-				break;
+			have_prev = 0;
+			continue;
 		}
-		// now we're at the start
-		last_timestamp = current_timestamp;
-		while(read_current_log_entry(&log_file, &current_timestamp, current_array) != -1)
+		while(!done && (entry = log_next_entry(&cursor)) != NULL)
 		{
-			if(current_timestamp >= end_utc)
-				goto calc_energy_finish;
-			// sum up the current reading for integration
-			if(current_timestamp - last_timestamp <= ENERGY_LOG_PERIOD_SEC)
-				for(int j = 0; j < 4; j++)
-					result[j] += current_array[j];
-			last_timestamp = current_timestamp;
+			uint8_t steady = have_prev && entry->time >= prev.time && entry->time - prev.time <= cursor.interval_sec;
+			if(entry->time >= start_utc)
+				on_entry(entry, steady ? &prev : NULL, arg);
+			done = entry->time >= end_utc;
+			prev = *entry;
+			have_prev = 1;
 		}
-	next_file:
-		log_file.close();
 	}
-calc_energy_finish:
-	// Energy = power * time = current * 120V * time
-	for(int j = 0; j < 4; j++)
-		result[j] = (uint32_t)(((double)result[j] / 1000) * MAINS_VOLTAGE_RMS * ENERGY_LOG_PERIOD_SEC);
+	log_file.close();
+	return 0;
 }
 
-// read a current log entry from the log file(at its current position)
-// fills up timestamp with the timestamp of that entry, and current_array with
-// the current reading of that entry, returns -1 if eof is reached.
-int8_t read_current_log_entry(File *log_file, time_t *timestamp, uint16_t *current_array)
+// fill energy_today from the logs of the last day, the only time
+// it needs the card
+void seed_energy_today()
 {
-	// copy an entry to read_buf
-	uint8_t read_buf[12];
-	for(int i = 0; i < 12; i++)
+	time_t end = now();
+	for(time_t t = end - ONE_DAY_IN_SEC; t < end;)
 	{
-		if(!log_file->available())
-			return -1;
-		read_buf[i] = log_file->read();
+		time_t next = min(end, t - t % ONE_DAY_IN_SEC + ONE_DAY_IN_SEC);
+		scan_log(t, next, add_entry_to_ring, NULL);
+		t = next;
+	}
+}
+
+// the readings a deadband left out of the log held the power of the
+// entry before them
+void add_entry_to_ring(const struct log_entry *entry, const struct log_entry *prev, void *arg)
+{
+	if(prev != NULL)
+		for(time_t t = prev->time + ENERGY_LOG_PERIOD_SEC; t < entry->time; t += ENERGY_LOG_PERIOD_SEC)
+			energy_today.add(t, prev->power);
+	energy_today.add(entry->time, entry->power);
+}
+
+// rollup files hold the energy of each socket in Joules, 4 * 4B, for
+// each hour of a day in YYYYMMDD.HR, each day of a month in YYYYMM.DAY
+// and each month of a year in YYYY.MON. records that haven't been
+// worked out yet are all 0xff
+void get_rollup_filename(uint8_t level, time_t time, char buf[13])
+{
+	memset(buf, 0, 13);
+	if(level == ROLLUP_HOUR)
+		sprintf(buf, "%d%02d%02d.HR", year(time), month(time), day(time));
+	else if(level == ROLLUP_DAY)
+		sprintf(buf, "%d%02d.DAY", year(time), month(time));
+	else
+		sprintf(buf, "%d.MON", year(time));
+}
+
+// which record of its file time falls in, and how many the file has
+uint8_t get_rollup_index(uint8_t level, time_t time, uint8_t *records)
+{
+	*records = level == ROLLUP_HOUR ? 24 : level == ROLLUP_DAY ? 31 : 12;
+	return level == ROLLUP_HOUR ? hour(time) : level == ROLLUP_DAY ? day(time) - 1 : month(time) - 1;
+}
+
+// add the energy of the hour, day or month starting at time to
+// energy[4]. a record that's missing is worked out from the level
+// below, or from the log for an hour, and written for next time
+void add_rollup(uint8_t level, time_t time, uint64_t energy[4])
+{
+	char file_name[13];
+	uint8_t record[ROLLUP_RECORD_SIZE];
+	uint8_t records;
+	uint8_t index = get_rollup_index(level, time, &records);
+	// a day without a log used nothing, no need for its hours
+	get_filename(time, file_name);
+	if(level == ROLLUP_HOUR && !SD.exists(file_name))
+		return;
+	get_rollup_filename(level, time, file_name);
+	if(SD.exists(file_name))
+	{
+		File rollup_file = SD.open(file_name, FILE_READ);
+		if(rollup_file != NULL)
+		{
+			int len = -1;
+			if(rollup_file.seek(index * ROLLUP_RECORD_SIZE))
+				len = rollup_file.read(record, ROLLUP_RECORD_SIZE);
+			rollup_file.close();
+			if(len == ROLLUP_RECORD_SIZE && char_to_int32(record) != -1)
+			{
+				for(int i = 0; i < 4; i++)
+					energy[i] += (uint32_t)char_to_int32(record + 4 * i);
+				return;
+			}
+		}
 	}
-	*timestamp = char_to_int32(read_buf);
+	uint64_t sum[4] = {0, 0, 0, 0};
+	if(level == ROLLUP_HOUR)
+	{
+		if(sum_log(time, time + ONE_HOUR_IN_SEC, sum) == -1)
+			return;
+	}
+	else if(level == ROLLUP_DAY)
+		for(int h = 0; h < 24; h++)
+			add_rollup(ROLLUP_HOUR, time + h * ONE_HOUR_IN_SEC, sum);
+	else
+		for(time_t t = time; t < get_next_month(time); t += ONE_DAY_IN_SEC)
+			add_rollup(ROLLUP_DAY, t, sum);
 	for(int i = 0; i < 4; i++)
-		current_array[i] = char_to_int16(&read_buf[4 + 2*i]);
+	{
+		int32_to_char(min(sum[i], (uint64_t)0xfffffffe), record + 4 * i);
+		energy[i] += sum[i];
+	}
+	File rollup_file = SD.open(file_name, FILE_WRITE);
+	if(rollup_file == NULL)
+		return;
+	// a new file gets all its records, not worked out yet
+	for(uint32_t size = rollup_file.size(); size < records * ROLLUP_RECORD_SIZE; size++)
+		rollup_file.write((uint8_t)0xff);
+	rollup_file.seek(index * ROLLUP_RECORD_SIZE);
+	rollup_file.write(record, ROLLUP_RECORD_SIZE);
+	rollup_file.close();
+}
+
+// roll up each hour as it ends, and the day and the month it ends
+// with, so queries find them ready. an hour waits LOG_SETTLE_SEC for
+// the first entry of the next one, which holds its last few seconds.
+// also catches up on the hour the strip was turned off or restarted in
+void update_rollups()
+{
+	static time_t rollup_hour = 0;
+	time_t settled = now() - LOG_SETTLE_SEC;
+	time_t this_hour = settled - settled % ONE_HOUR_IN_SEC;
+	if(this_hour == rollup_hour)
+		return;
+	rollup_hour = this_hour;
+	uint64_t energy[4] = {0, 0, 0, 0};
+	time_t last_hour = this_hour - ONE_HOUR_IN_SEC;
+	add_rollup(ROLLUP_HOUR, last_hour, energy);
+	if(this_hour % ONE_DAY_IN_SEC == 0)
+		add_rollup(ROLLUP_DAY, last_hour - last_hour % ONE_DAY_IN_SEC, energy);
+	if(this_hour == get_start_of_month(this_hour))
+		add_rollup(ROLLUP_MONTH, get_start_of_month(last_hour), energy);
+}
+
+// find out how the entries of a log file are laid out, returns -1 if
+// the file can't be read
+int8_t read_log_layout(File *log_file, struct log_layout *layout)
+{
+	uint8_t read_buf[LOG_HEADER_SIZE];
+	int len = log_file->read(read_buf, LOG_HEADER_SIZE);
+	if(len < 0)
+		return -1;
+	log_get_layout(layout, read_buf, len, log_file->size());
 	return 0;
 }
 
+// read block index of a log file into buf, returns how many entries it
+// has and sets cursor up to go through them, -1 if it's torn or past
+// the end
+int32_t read_log_block(File *log_file, const struct log_layout *layout, uint32_t index, uint8_t *buf, struct log_cursor *cursor)
+{
+	if(!log_file->seek(log_block_offset(layout, index)))
+		return -1;
+	int len = log_file->read(buf, log_block_length(layout));
+	if(len <= 0)
+		return -1;
+	return log_block_entries(layout, index, buf, len, cursor);
+}
+
+// how many blocks start before time t. only the last block can be torn,
+// it counts as after t. O(log count) reads
+uint32_t find_log_block(File *log_file, const struct log_layout *layout, time_t t)
+{
+	uint8_t buf[LOG_BLOCK_SIZE];
+	struct log_cursor cursor;
+	uint32_t low = 0, high = log_block_count(layout);
+	while(low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		const struct log_entry *first = NULL;
+		if(read_log_block(log_file, layout, mid, buf, &cursor) > 0)
+			first = log_next_entry(&cursor);
+		if(first == NULL || first->time >= t)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return low;
+}
+
 time_t get_start_of_day(time_t time)
 {
 	TimeElements tm;
@@ -894,36 +2132,53 @@ time_t get_start_of_day(time_t time)
 	return makeTime(tm);
 }
 
+time_t get_start_of_month(time_t time)
+{
+	return get_start_of_day(time) - (day(time) - 1) * ONE_DAY_IN_SEC;
+}
+
+time_t get_next_month(time_t time)
+{
+	TimeElements tm;
+	tm.Second = 0;
+	tm.Minute = 0;
+	tm.Hour = 0;
+	tm.Wday = 0;
+	tm.Day = 1;
+	tm.Month = month(time) % 12 + 1;
+	tm.Year = year(time) - 1970 + (month(time) == 12);
+	return makeTime(tm);
+}
+
 void get_filename(time_t time, char buf[10])
 {
 	memset(buf, 0, 10);
 	sprintf(buf, "%d%02d%02d", year(time), month(time), day(time));
 }
 
-void append_current_log(time_t time, uint16_t current_array[4])
+// each entry: time, current, real power of each socket and the mains
+// voltage, see log_writer
+void append_current_log(time_t time, uint16_t current_array[4], uint16_t power_array[4], uint16_t voltage)
 {
-	// each entry: time_t current1 current2 current3 current4
-	File log_file;
 	char file_name[10];
 	get_filename(time, file_name);
-	log_file = SD.open(file_name, FILE_WRITE);
-	if(log_file == NULL)
+	struct log_entry entry;
+	entry.time = time;
+	for(int i = 0; i < 4; i++)
+	{
+		entry.current[i] = current_array[i];
+		entry.power[i] = power_array[i];
+	}
+	entry.voltage = voltage;
+	energy_today.add(time, power_array);
+	// readings from before the card is in only go to energy_today
+	if(card_mounted && sd_log.append(file_name, &entry, &log_filter) == -1)
 	{
 		CLEAR_LCD();
 		SET_TO_BEGINNING();
 		lcd.print("cannot write log file");
 		delay(100);
-		return;
 	}
-	uint8_t write_buf[12];
-	// first 4 bytes is timestamp
-	int32_to_char(time, &write_buf[0]);
-	// then 2 * 4 bytes of current reading
-	for(int i = 0; i < 4; i++)
-		int16_to_char(current_array[i], &write_buf[4 + 2*i]);
-	// write them into sd card
-	log_file.write(write_buf, 12);
-	log_file.close();
 }
 
 // changes the state of a socket, you can also choose whether or not to save the change to SD card or use
@@ -936,37 +2191,152 @@ void toggle_socket(uint8_t socket_index, uint8_t socket_state, zero_cross_detect
 	// if zero crossing toggles is on, wait until zero crossing
 	if(zcd != NULL && zcd->is_enabled() && socket_state == SOCKET_ON && socket_index != 1)
 		while(!zcd->is_zero_cross());
+	// switching a tripped socket back on resets its trip
+	if(socket_state == SOCKET_ON)
+		c_reader.clear_trip(socket_index);
+	shed_forget(&shedder, socket_index);
 	digitalWrite(socket_pin, socket_state);
 	if(save_state_to_sd)
 		save_state();
 }
 
+// for what switches sockets on its own, like the custom functions and
+// the shedder. a tripped socket stays off, only toggle_socket() and
+// set_sockets() clear its trip. ISR_check_trips() opens it again if it
+// trips between the check and the write
+void write_socket(uint8_t socket_index, uint8_t socket_state)
+{
+	if(socket_state == SOCKET_ON && c_reader.get_trip(socket_index) != TRIP_NONE)
+		socket_state = SOCKET_OFF;
+	digitalWrite(get_socket_pin(socket_index), socket_state);
+}
+
+// sets every socket whose bit is set in socket_mask to the state of the same bit
+// in state_mask in one pass. sockets that need a zero crossing are switched
+// together after a single wait, and the state is saved at most once.
+void set_sockets(uint8_t socket_mask, uint8_t state_mask, zero_cross_detector *zcd, uint8_t save_state_to_sd)
+{
+	uint8_t zero_cross_mask = 0;
+	for(int i = 0; i < 3; i++)
+	{
+		if(!(socket_mask & (1 << i)))
+			continue;
+		uint8_t socket_state = (state_mask >> i) & 1;
+		if(socket_state == SOCKET_ON)
+			c_reader.clear_trip(i);
+		shed_forget(&shedder, i);
+		// same rule as toggle_socket()
+		if(zcd != NULL && zcd->is_enabled() && socket_state == SOCKET_ON && i != 1)
+			zero_cross_mask |= (1 << i);
+		else
+			digitalWrite(get_socket_pin(i), socket_state);
+	}
+	// all sockets are on the same phase, one zero crossing covers them all
+	if(zero_cross_mask)
+	{
+		while(!zcd->is_zero_cross());
+		for(int i = 0; i < 3; i++)
+			if(zero_cross_mask & (1 << i))
+				digitalWrite(get_socket_pin(i), SOCKET_ON);
+	}
+	if(save_state_to_sd && (socket_mask & 0x7))
+		save_state();
+}
+
 // save the state of sockets and setting to SD card so
-// they can be restored upon restarting 
+// they can be restored upon restarting. shed sockets are saved
+// as on, the shedder decides again after a restart. this only hands
+// the state to sd_state, store_state() writes it once it's settled
 void save_state()
 {
-	File state_file = SD.open("STATE", FILE_WRITE);
-	if(state_file == NULL)
-	{
-		CLEAR_LCD();
-		SET_TO_BEGINNING();
-		lcd.print("cannot write state file");
-		delay(1000);
+	uint8_t data[STATE_DATA_SIZE];
+	for(int i = 0; i < 4; i++)
+		data[i] = digitalRead(get_socket_pin(i)) | ((shedder.shed_mask >> i) & 1);
+	data[4] = zd.is_enabled();
+	data[5] = current_log_timer.is_enabled();
+	data[6] = setting_current_limiter.get_val();
+	// shedder config, same layout as MASTER_COMMAND_SHED_CONFIG
+	int16_to_char(shedder.budget_mA, data + 7);
+	int16_to_char(shedder.hysteresis_mA, data + 9);
+	memcpy(data + 11, shedder.priority, SHED_SOCKETS);
+	// and MASTER_COMMAND_LOG_CONFIG
+	int16_to_char(log_filter.deadband_mA, data + 15);
+	int16_to_char(log_filter.max_interval_sec, data + 17);
+	// and MASTER_COMMAND_TRIP_CONFIG
+	for(int i = 0; i < 4; i++)
+		int16_to_char(trip_limit_mA[i], data + 19 + 2 * i);
+	sd_state.set(data, millis());
+}
+
+void store_state()
+{
+	if(sd_state.update(millis()) == 0)
 		return;
+	CLEAR_LCD();
+	SET_TO_BEGINNING();
+	lcd.print("cannot write state file");
+	delay(1000);
+}
+
+// set the sockets and settings from the EEPROM snapshot, right after
+// the reset. sockets stay off without one, until the card is in
+void restore_relays()
+{
+	uint8_t data[STATE_DATA_SIZE];
+	int32_t len = sd_state.restore_snapshot(data);
+	if(len > 0)
+	{
+		apply_state(data, len);
+		boot_source = BOOT_FROM_SNAPSHOT;
 	}
-	state_file.seek(0);
-	for(int i = 0; i < 4; i++)
-		state_file.write((int8_t)digitalRead(get_socket_pin(i)));
-	state_file.write(zd.is_enabled());
-	state_file.write(current_log_timer.is_enabled());
-	state_file.write((int8_t)setting_current_limiter.get_val());
-	state_file.close();
+	else
+		for(int i = 0; i < 4; i++)
+			digitalWrite(get_socket_pin(i), SOCKET_OFF);
+	relays_restored_us = micros();
+}
+
+// the card is mounted from loop(), so the sockets don't wait on it.
+// what needs it is caught up once it's in
+void mount_card()
+{
+	static uint8_t tried = 0;
+	static uint32_t last_try_ms;
+	if(card_mounted || (tried && millis() - last_try_ms < CARD_RETRY_MS))
+		return;
+	tried = 1;
+	last_try_ms = millis();
+	if(!SD.begin(SD_SLAVE_SELECT))
+		return;
+	card_mounted = 1;
+	card_mounted_ms = millis();
+	recover_state();
+	// a power cut can have torn the end of today's log
+	char file_name[10];
+	get_filename(now(), file_name);
+	if(SD.exists(file_name))
+		sd_log.recover(file_name);
+	// what was added before is in no log, but start over rather
+	// than put older readings after it
+	energy_today.clear();
+	seed_energy_today();
+	Serial.print("sockets set after ");
+	Serial.print(relays_restored_us);
+	Serial.print("us, card mounted after ");
+	Serial.print(card_mounted_ms);
+	Serial.println("ms");
 }
 
-// read the state file and restore socket states and settings
+// read the state file and restore socket states and settings. the
+// snapshot is written before the card every time, so if the sockets got
+// their state from it, it's the newer one and only the file is brought
+// up to date
 int8_t recover_state()
 {
-	if(!SD.exists("STATE"))
+	uint8_t data[STATE_DATA_SIZE];
+	int32_t len = sd_state.mount(data, millis());
+	if(boot_source == BOOT_FROM_SNAPSHOT)
+		return 0;
+	if(len < 7)
 	{
 		CLEAR_LCD();
 		SET_TO_BEGINNING();
@@ -974,102 +2344,142 @@ int8_t recover_state()
 		delay(1000);
 		return -1;
 	}
-	File state_file = SD.open("STATE", FILE_READ);
-	state_file.seek(0);
-	for(int i = 0; i < 4; i++)
-		digitalWrite(get_socket_pin(i), state_file.read());
-	zd.set_state(state_file.read());
-	current_log_timer.set_state(state_file.read());
-	setting_current_limiter.set_val((uint8_t)state_file.read());
-	state_file.close();
+	apply_state(data, len);
+	boot_source = BOOT_FROM_STATE_FILE;
+	relays_restored_us = micros();
+	// so the snapshot gets it too
+	save_state();
 	return 0;
 }
 
-// fill a byte array with each byte in an int16_t, little endian
-void int16_to_char(int16_t int16, uint8_t *c)
+// set sockets and settings from a stored state, see save_state()
+void apply_state(const uint8_t *data, int32_t len)
 {
-	c[0] = int16 & 0xff;
-	c[1] = (int16 & 0xff00) >> 8;
+	for(int i = 0; i < 4; i++)
+		digitalWrite(get_socket_pin(i), data[i]);
+	zd.set_state(data[4]);
+	current_log_timer.set_state(data[5]);
+	setting_current_limiter.set_val(data[6]);
+	// state files from before the shedder end here
+	if(len >= STATE_SHED_DATA_SIZE)
+		shed_configure(&shedder, char_to_int16(data + 7), char_to_int16(data + 9), data + 11);
+	if(len >= STATE_LOG_DATA_SIZE)
+		log_filter_configure(&log_filter, char_to_int16(data + 15), char_to_int16(data + 17));
+	// older ones keep CURRENT_LIMIT_MA
+	if(len == STATE_DATA_SIZE)
+		for(int i = 0; i < 4; i++)
+			trip_limit_mA[i] = char_to_int16(data + 19 + 2 * i);
 }
 
-// extract an int16_t from a byte array, little endian
-int16_t char_to_int16(uint8_t* c)
+// send a response to the command with the same tag,
+// framed by build_frame()
+void send_reply(uint8_t tag, uint8_t *data, uint8_t len)
 {
-	int16_t ret = 0;
-	ret = c[0];
-	ret |= c[1] << 8;
-	return ret;
+	uint8_t frame[FRAME_SIZE(MAX_FRAME_DATA_SIZE)];
+	Serial3.write(frame, build_frame(frame, SLAVE_COMMAND_ACK, tag, data, len));
 }
 
-// fill a byte array with each byte in an int32_t, little endian
-void int32_to_char(int32_t int32, uint8_t *c)
+void send_default_ACK(uint8_t tag)
 {
-	c[0] = int32 & 0xff;
-	c[1] = (int32 & 0xff00) >> 8;
-	c[2] = (int32 & 0xff0000) >> 16;
-	c[3] = (int32 & 0xff000000) >> 24;
+	send_reply(tag, NULL, 0); // no data
 }
 
-// extract an int32_t from a byte array, little endian
-int32_t char_to_int32(uint8_t* c)
+// one bit for each socket's state
+uint8_t get_socket_status()
 {
-	int32_t ret = 0;
-	ret = c[0];
-	ret |= c[1] << 8;
-	ret |= c[2] << 16;
-	ret |= c[3] << 24;
-	return ret;
+	uint8_t socket_status = 0;	
+	socket_status |= (digitalRead(PCB_RELAY_PIN_3) << 3); // bit position 3 for socket 4's state
+	socket_status |= (digitalRead(PCB_RELAY_PIN_2) << 2);
+	socket_status |= (digitalRead(PCB_RELAY_PIN_1) << 1);
+	socket_status |= (digitalRead(PCB_RELAY_PIN_0) << 0); // bit position 0 for socket 1's state
+	return socket_status;
 }
 
-void send_default_ACK()
+void send_socket_status(uint8_t tag)
 {
-	Serial3.write(SLAVE_COMMAND_ACK);
-	Serial3.write(0); // no data
+	CLEAR_SEND_BUF();	
+	send_buf[0] = get_socket_status();
+	for(int i = 0; i < 4; i++)
+	{
+		int16_to_char(current_array_global[i], &send_buf[1 + 2 * i]);
+		int16_to_char(power_array_global[i], &send_buf[9 + 2 * i]);
+	}
+	int16_to_char(voltage_global, &send_buf[17]);
+	send_reply(tag, send_buf, SOCKET_STATUS_SIZE);
 }
 
-void send_socket_status()
+void send_trip_status(uint8_t tag)
 {
-	CLEAR_SEND_BUF();	
-	uint8_t socket_status = 0;	
-	socket_status |= (digitalRead(PCB_RELAY_PIN_3) << 3); // bit position 3 for socket 4's state
-	socket_status |= (digitalRead(PCB_RELAY_PIN_2) << 2);
-	socket_status |= (digitalRead(PCB_RELAY_PIN_1) << 1);
-	socket_status |= (digitalRead(PCB_RELAY_PIN_0) << 0); // bit position 0 for socket 1's state
-	
-	send_buf[0] = SLAVE_COMMAND_ACK;
-	send_buf[1] = 9; // 9 bytes of data
-	send_buf[2] = socket_status;
-	int16_to_char(current_array_global[0], &send_buf[3]);
-	int16_to_char(current_array_global[1], &send_buf[5]);
-	int16_to_char(current_array_global[2], &send_buf[7]);
-	int16_to_char(current_array_global[3], &send_buf[9]);
-	Serial3.write(send_buf, 11); // 2B header + 9B data
+	CLEAR_SEND_BUF();
+	for(int i = 0; i < 4; i++)
+	{
+		send_buf[3 * i] = c_reader.get_trip(i);
+		int16_to_char(c_reader.get_trip_latency_us(i), &send_buf[3 * i + 1]);
+	}
+	for(int i = 0; i < 4; i++)
+		int16_to_char(setting_current_limiter.get_val() ? trip_limit_mA[i] : 0, &send_buf[12 + 2 * i]);
+	send_reply(tag, send_buf, TRIP_STATUS_SIZE);
+}
+
+void send_boot_status(uint8_t tag)
+{
+	CLEAR_SEND_BUF();
+	send_buf[0] = boot_source;
+	int32_to_char(relays_restored_us, &send_buf[1]);
+	int32_to_char(card_mounted_ms, &send_buf[5]);
+	send_reply(tag, send_buf, BOOT_STATUS_SIZE);
+}
+
+void send_log_config(uint8_t tag)
+{
+	CLEAR_SEND_BUF();
+	int16_to_char(log_filter.deadband_mA, &send_buf[0]);
+	int16_to_char(log_filter.max_interval_sec, &send_buf[2]);
+	send_reply(tag, send_buf, LOG_CONFIG_SIZE);
 }
 
+void send_shed_status(uint8_t tag, uint16_t from_seq)
+{
+	uint8_t buf[SHED_STATUS_MAX_SIZE];
+	send_reply(tag, buf, shed_encode_status(&shedder, from_seq, buf));
+}
+
+// read whatever bytes are available from Serial3 without blocking
+// and queue up complete commands, returns 1 if there's a command
+// waiting to be executed.
+// frames are collected up to the next 0 and decoded by parse_frame(),
+// so a broken frame costs only itself
 int8_t get_serial_commands()
 {
-	uint8_t len;
-	if(Serial3.available())
+	static uint8_t rx_frame[FRAME_SIZE(BUF_SIZE)];
+	static int32_t rx_count = 0;
+	// leave the bytes in Serial3's buffer if there's no room
+	while(Serial3.available() && !cmd_queue.is_full())
 	{
-		char c = Serial3.read();
+		uint8_t c = Serial3.read();
 		Serial.print((char)c); // print it back through USB serial for debugging
-		if(c == MASTER_COMMAND_TRANSMISSION_START)
-		{
-			CLEAR_RECV_BUF();
-			while(Serial3.available() <= 0);
-			// get master command's data length
-			len = Serial3.read();
-			// read that much bytes
-			for(int i = 0; i < len; i++)
-			{
-				while(Serial3.available() <= 0);
-				recv_buf[i] = Serial3.read();
-			}	
-			return 1;
-		}
+		// too long to be a command, keep the 0s so the next frame gets through
+		if(rx_count == sizeof(rx_frame))
+			rx_count = 0;
+		rx_frame[rx_count++] = c;
+		if(c != 0)
+			continue;
+
+		int32_t head = 0;
+		uint8_t tag;
+		uint8_t *data;
+		int32_t len = parse_frame(rx_frame, &head, rx_count, MASTER_COMMAND_TRANSMISSION_START, &tag, &data);
+		rx_count = 0;
+		if(len <= 0 || len > BUF_SIZE)
+			continue;
+		master_command *cmd = cmd_queue.back();
+		cmd->tag = tag;
+		cmd->len = len;
+		memset(cmd->data, 0, BUF_SIZE);
+		memcpy(cmd->data, data, len);
+		cmd_queue.push();
 	}
-	else
-		return 0;
+	return !cmd_queue.is_empty();
 }
 
 time_t getTeensy3Time()
@@ -1091,12 +2501,5 @@ int8_t get_socket_pin(uint8_t socket_index)
 
 int8_t get_current_sensing_pin(uint8_t socket_index)
 {
-	switch(socket_index)
-	{
-		case 0:	return PCB_CURRENT_SENSE_PIN_0;
-		case 1:	return PCB_CURRENT_SENSE_PIN_1;
-		case 2:	return PCB_CURRENT_SENSE_PIN_2;
-		case 3:	return PCB_CURRENT_SENSE_PIN_3;
-		default:	return -1;
-	}
+	return socket_index < sizeof(current_sense_pin) ? current_sense_pin[socket_index] : -1;
 }
@@ -0,0 +1,432 @@
+// host test of the day log formats in powerduino_protocol.h. a year of
+// synthetic readings is written as version 3 files of fixed entries,
+// converted with powerduino_log, and every entry is read back from the
+// packed version 4 blocks and compared. exits 1 if a check fails.
+// with -b it times the encoder and the decoder instead, and counts what
+// the firmware's log writers do to the SD card
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../powerduino_protocol.h"
+
+#define PATH_SIZE 256
+#define COMMAND_SIZE (PATH_SIZE * 400)
+// 2001, a year of readings
+#define YEAR_START_UTC 978307200
+#define YEAR_DAYS 365
+#define DAY_ENTRIES (LOG_DAY_SEC / LOG_PERIOD_SEC)
+// the firmware's LOG_FLUSH_SEC
+#define FLUSH_SEC 300
+// same as the sim's, what a sector read or write costs the loop
+#define SD_US_PER_SECTOR 500
+#define SECTOR_SIZE 512
+// FAT16 on a 2GB card
+#define CLUSTER_SIZE 32768
+
+// what the readings of a day are made of, started over every day
+struct generator
+{
+    uint32_t rand_state;
+    uint16_t current[4];
+    uint16_t voltage;
+};
+
+// sector reads and writes of the log, and the longest the loop waited
+// on them for one entry
+struct card_ops
+{
+    uint64_t reads, writes;
+    uint64_t file_bytes;
+    uint32_t worst_us;
+};
+
+int32_t failures = 0;
+
+void check(int32_t ok, const char *format, ...);
+uint32_t next_rand(struct generator *g);
+void generator_init(struct generator *g, int32_t day);
+void next_entry(struct generator *g, int32_t day, int32_t index, struct log_entry *e);
+int32_t same_entry(const struct log_entry *a, const struct log_entry *b);
+int32_t write_fixed_log(const char *path, int32_t day);
+int32_t check_packed_log(const char *path, int32_t day, uint32_t *file_size);
+int64_t get_time_ns();
+void bench_codec();
+void bench_writers();
+void open_close_day(struct card_ops *ops, int32_t day);
+void block_writer_day(struct card_ops *ops, int32_t day, uint16_t deadband_mA);
+void print_card_ops(const char *name, const struct card_ops *ops);
+
+int32_t main(int32_t argc, char *argv[])
+{
+    char path[PATH_SIZE];
+    static char command[COMMAND_SIZE];
+    if(argc == 2 && strcmp(argv[1], "-b") == 0)
+    {
+        bench_codec();
+        bench_writers();
+        return 0;
+    }
+    if(argc != 3)
+    {
+        fprintf(stderr, "usage: test_log converter empty_dir\n");
+        fprintf(stderr, "       test_log -b\n");
+        return 1;
+    }
+    uint64_t fixed_size = 0, packed_size = 0;
+    int32_t len = snprintf(command, COMMAND_SIZE, "%s", argv[1]);
+    for(int32_t day = 0; day < YEAR_DAYS; day++)
+    {
+        snprintf(path, PATH_SIZE, "%s/%03d.LOG", argv[2], day);
+        int32_t size = write_fixed_log(path, day);
+        check(size > 0, "%s: can't write it", path);
+        fixed_size += size;
+        len += snprintf(command + len, COMMAND_SIZE - len, " %s", path);
+    }
+    snprintf(command + len, COMMAND_SIZE - len, " >/dev/null");
+    int64_t start = get_time_ns();
+    check(system(command) == 0, "%s failed", argv[1]);
+    double convert_sec = (double)(get_time_ns() - start) / 1e9;
+    int32_t wrong = 0;
+    for(int32_t day = 0; day < YEAR_DAYS; day++)
+    {
+        uint32_t size = 0;
+        snprintf(path, PATH_SIZE, "%s/%03d.LOG", argv[2], day);
+        wrong += check_packed_log(path, day, &size);
+        packed_size += size;
+    }
+    check(wrong == 0, "%d entries read back wrong", wrong);
+    uint64_t entries = (uint64_t)YEAR_DAYS * DAY_ENTRIES;
+    printf("%llu entries: version 1 %llu bytes, version 3 %llu, version 4 %llu, %.1f times smaller than version 3\n",
+        (unsigned long long)entries, (unsigned long long)entries * LOG_ENTRY_V1_SIZE, (unsigned long long)fixed_size,
+        (unsigned long long)packed_size, (double)fixed_size / packed_size);
+    printf("converted in %.2f s, %.0f entries/s, %d entries wrong\n", convert_sec, entries / convert_sec, wrong);
+    if(failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
+
+void check(int32_t ok, const char *format, ...)
+{
+    va_list args;
+    if(ok)
+        return;
+    failures++;
+    printf("FAIL: ");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
+
+// xorshift, so a day's readings can be made again to compare with
+uint32_t next_rand(struct generator *g)
+{
+    g->rand_state ^= g->rand_state << 13;
+    g->rand_state ^= g->rand_state >> 17;
+    g->rand_state ^= g->rand_state << 5;
+    return g->rand_state;
+}
+
+void generator_init(struct generator *g, int32_t day)
+{
+    memset(g, 0, sizeof(struct generator));
+    g->rand_state = 2654435761U * (day + 1);
+    g->voltage = 1200;
+}
+
+// readings of a strip with loads that wander a little and get switched
+// on and off now and then, the way a day of real logs looks
+void next_entry(struct generator *g, int32_t day, int32_t index, struct log_entry *e)
+{
+    e->time = YEAR_START_UTC + day * LOG_DAY_SEC + index * LOG_PERIOD_SEC;
+    for(int32_t i = 0; i < 4; i++)
+    {
+        uint32_t r = next_rand(g);
+        if(r % 1000 == 0)
+            g->current[i] = g->current[i] == 0 ? 200 + next_rand(g) % 10000 : 0;
+        else if(g->current[i] > 100)
+            g->current[i] += (int32_t)(r % 41) - 20;
+        e->current[i] = g->current[i];
+        // mA * 0.1V / 1000 is 0.1W, at a power factor of 0.7 to 1
+        e->power[i] = (uint32_t)g->current[i] * g->voltage / 1000 * (70 + i * 10) / 100;
+    }
+    if(next_rand(g) % 10 == 0)
+        g->voltage += (int32_t)(next_rand(g) % 5) - 2;
+    e->voltage = g->voltage;
+}
+
+// field by field, the struct has padding
+int32_t same_entry(const struct log_entry *a, const struct log_entry *b)
+{
+    for(int32_t i = 0; i < 4; i++)
+        if(a->current[i] != b->current[i] || a->power[i] != b->power[i])
+            return 0;
+    return a->time == b->time && a->voltage == b->voltage;
+}
+
+// a day of readings in version 3 blocks, the way the firmware wrote them
+// before they were packed. returns the file size, -1 if it fails
+int32_t write_fixed_log(const char *path, int32_t day)
+{
+    struct generator g;
+    struct log_entry e;
+    uint8_t block[LOG_BLOCK_SIZE];
+    int32_t per_block = LOG_BLOCK_ENTRIES(LOG_ENTRY_SIZE);
+    int32_t size = 0;
+    FILE *fp = fopen(path, "wb");
+    if(fp == NULL)
+        return -1;
+    generator_init(&g, day);
+    for(int32_t index = 0, seq = 0; index < DAY_ENTRIES; seq++)
+    {
+        int32_t count = 0;
+        memset(block, 0, LOG_BLOCK_SIZE);
+        for(; count < per_block && index < DAY_ENTRIES; count++, index++)
+        {
+            next_entry(&g, day, index, &e);
+            log_encode_entry(&e, block + LOG_BLOCK_HEADER_SIZE + count * LOG_ENTRY_SIZE);
+        }
+        memcpy(block, LOG_BLOCK_MAGIC, 4);
+        block[4] = LOG_FIXED_VERSION;
+        block[5] = LOG_ENTRY_SIZE;
+        block[6] = count;
+        block[7] = 0;
+        int32_to_char(seq, block + 8);
+        int16_to_char(crc16_ccitt(0xffff, block, LOG_BLOCK_SIZE - 2), block + LOG_BLOCK_SIZE - 2);
+        size += fwrite(block, 1, LOG_BLOCK_SIZE, fp);
+    }
+    if(fclose(fp) != 0)
+        return -1;
+    return size;
+}
+
+// read a converted day back a block at a time, like the firmware does,
+// and compare each entry with the readings it was made from. returns
+// how many are wrong or missing
+int32_t check_packed_log(const char *path, int32_t day, uint32_t *file_size)
+{
+    struct generator g;
+    struct log_entry expected;
+    struct log_layout layout;
+    struct log_cursor cursor;
+    uint8_t block[LOG_BLOCK_SIZE];
+    const struct log_entry *e;
+    int32_t index = 0, wrong = 0;
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL)
+        return DAY_ENTRIES;
+    int32_t len = fread(block, 1, LOG_HEADER_SIZE, fp);
+    fseek(fp, 0, SEEK_END);
+    *file_size = ftell(fp);
+    log_get_layout(&layout, block, len, *file_size);
+    generator_init(&g, day);
+    uint32_t count = log_block_count(&layout);
+    for(uint32_t b = 0; b < count; b++)
+    {
+        fseek(fp, log_block_offset(&layout, b), SEEK_SET);
+        len = fread(block, 1, log_block_length(&layout), fp);
+        int32_t entries = log_block_entries(&layout, b, block, len, &cursor);
+        check(entries >= 0 && block[4] == LOG_VERSION, "%s: block %u is torn or not version %d", path, b, LOG_VERSION);
+        while((e = log_next_entry(&cursor)) != NULL && index < DAY_ENTRIES)
+        {
+            next_entry(&g, day, index++, &expected);
+            wrong += !same_entry(e, &expected);
+        }
+    }
+    fclose(fp);
+    check(index == DAY_ENTRIES, "%s: %d entries, not %d", path, index, DAY_ENTRIES);
+    return wrong + DAY_ENTRIES - index;
+}
+
+int64_t get_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// pack a year of readings into blocks in RAM and unpack them again,
+// without the file system in the way
+void bench_codec()
+{
+    struct generator g;
+    struct log_entry e;
+    struct log_tail tail;
+    struct log_layout layout;
+    struct log_cursor cursor;
+    uint64_t entries = (uint64_t)YEAR_DAYS * DAY_ENTRIES;
+    uint8_t *blocks = malloc((size_t)YEAR_DAYS * DAY_ENTRIES * LOG_PACKED_ENTRY_MAX);
+    uint8_t *block = blocks;
+    uint32_t sink = 0;
+    int64_t start = get_time_ns();
+    for(int32_t day = 0; day < YEAR_DAYS; day++)
+    {
+        generator_init(&g, day);
+        log_recover_tail(&tail, block, 0, 0);
+        for(int32_t index = 0; index < DAY_ENTRIES; index++)
+        {
+            next_entry(&g, day, index, &e);
+            if(log_tail_append(&tail, block, &e, 0) == -1)
+            {
+                log_seal_block(block, tail.index, tail.count, tail.interval);
+                block += LOG_BLOCK_SIZE;
+                log_tail_next(&tail, block);
+                log_tail_append(&tail, block, &e, 0);
+            }
+        }
+        log_seal_block(block, tail.index, tail.count, tail.interval);
+        block += LOG_BLOCK_SIZE;
+    }
+    double encode_sec = (double)(get_time_ns() - start) / 1e9;
+    uint32_t total = (block - blocks) / LOG_BLOCK_SIZE;
+    memset(&layout, 0, sizeof layout);
+    layout.blocked = 1;
+    layout.entry_size = LOG_ENTRY_SIZE;
+    start = get_time_ns();
+    for(uint32_t b = 0, seq = 0; b < total; b++, seq++)
+    {
+        // sequence numbers start over with each day's file
+        if(memcmp(blocks + b * LOG_BLOCK_SIZE + 8, "\0\0\0\0", 4) == 0)
+            seq = 0;
+        log_block_entries(&layout, seq, blocks + b * LOG_BLOCK_SIZE, LOG_BLOCK_SIZE, &cursor);
+        const struct log_entry *p;
+        while((p = log_next_entry(&cursor)) != NULL)
+            sink += p->current[0];
+    }
+    double decode_sec = (double)(get_time_ns() - start) / 1e9;
+    // generating the readings is timed with the encoder, time it alone
+    start = get_time_ns();
+    for(int32_t day = 0; day < YEAR_DAYS; day++)
+    {
+        generator_init(&g, day);
+        for(int32_t index = 0; index < DAY_ENTRIES; index++)
+        {
+            next_entry(&g, day, index, &e);
+            sink += e.current[1];
+        }
+    }
+    encode_sec -= (double)(get_time_ns() - start) / 1e9;
+    printf("%llu entries in %u blocks, %.2f bytes each\n", (unsigned long long)entries, total, (double)total * LOG_BLOCK_SIZE / entries);
+    printf("encode: %.1f M entries/s\n", entries / encode_sec / 1e6);
+    printf("decode: %.1f M entries/s, %.0f MB/s of blocks\n", entries / decode_sec / 1e6, (double)total * LOG_BLOCK_SIZE / decode_sec / 1e6);
+    free(blocks);
+    // keeps the loops from being optimized away
+    if(sink == 1)
+        printf("\n");
+}
+
+// write amplification and loop stalls of logging a year, the old way
+// and through the firmware's log_writer
+void bench_writers()
+{
+    struct card_ops ops;
+    memset(&ops, 0, sizeof ops);
+    for(int32_t day = 0; day < YEAR_DAYS; day++)
+        open_close_day(&ops, day);
+    print_card_ops("open, write, close", &ops);
+    memset(&ops, 0, sizeof ops);
+    for(int32_t day = 0; day < YEAR_DAYS; day++)
+        block_writer_day(&ops, day, 0);
+    print_card_ops("block writer", &ops);
+    memset(&ops, 0, sizeof ops);
+    for(int32_t day = 0; day < YEAR_DAYS; day++)
+        block_writer_day(&ops, day, 50);
+    print_card_ops("block writer, 50 mA deadband", &ops);
+}
+
+// append_current_log() before the log writer: SD.open() reads the
+// directory and the last sector of the file, close() writes the sector
+// back, the directory entry with the new size, and the FAT when the file
+// grew into a new cluster
+void open_close_day(struct card_ops *ops, int32_t day)
+{
+    uint32_t size = 0;
+    (void)day;
+    for(int32_t index = 0; index < DAY_ENTRIES; index++)
+    {
+        uint32_t reads = 1 + (size % SECTOR_SIZE != 0);
+        uint32_t writes = 2 + (size % CLUSTER_SIZE == 0);
+        // an entry can straddle two sectors
+        writes += size / SECTOR_SIZE != (size + LOG_ENTRY_V1_SIZE - 1) / SECTOR_SIZE;
+        size += LOG_ENTRY_V1_SIZE;
+        ops->reads += reads;
+        ops->writes += writes;
+        if((reads + writes) * SD_US_PER_SECTOR > ops->worst_us)
+            ops->worst_us = (reads + writes) * SD_US_PER_SECTOR;
+    }
+    ops->file_bytes += size;
+}
+
+// log_writer on a new day's file: the block being filled is written
+// when it's full, and with the directory entry on every flush
+void block_writer_day(struct card_ops *ops, int32_t day, uint16_t deadband_mA)
+{
+    struct generator g;
+    struct log_entry e;
+    struct log_tail tail;
+    struct log_filter filter;
+    uint8_t block[LOG_BLOCK_SIZE];
+    uint32_t file_size = 0;
+    int32_t block_dirty = 0;
+    time_t last_flush = YEAR_START_UTC + day * LOG_DAY_SEC;
+    generator_init(&g, day);
+    log_filter_init(&filter);
+    log_filter_configure(&filter, deadband_mA, LOG_DEFAULT_MAX_INTERVAL_SEC);
+    log_recover_tail(&tail, block, 0, 0);
+    // opening the file looks it up in the directory
+    ops->reads++;
+    for(int32_t index = 0; index <= DAY_ENTRIES; index++)
+    {
+        uint32_t writes = 0;
+        int32_t last = index == DAY_ENTRIES;
+        if(!last)
+            next_entry(&g, day, index, &e);
+        if(!last && log_filter_pass(&filter, &e))
+        {
+            uint8_t interval = log_filter_interval(&filter);
+            if(log_tail_append(&tail, block, &e, interval) == -1)
+            {
+                writes++;
+                log_tail_next(&tail, block);
+                log_tail_append(&tail, block, &e, interval);
+            }
+            block_dirty = 1;
+        }
+        // the day ends with the file being closed, which flushes it
+        if(last || e.time - last_flush >= FLUSH_SEC)
+        {
+            uint32_t grown = (tail.index + 1) * LOG_BLOCK_SIZE;
+            writes += block_dirty;
+            if(grown > file_size)
+            {
+                writes += file_size == 0 || (file_size - 1) / CLUSTER_SIZE != (grown - 1) / CLUSTER_SIZE;
+                file_size = grown;
+            }
+            // the directory entry
+            writes++;
+            block_dirty = 0;
+            last_flush = e.time;
+        }
+        ops->writes += writes;
+        if(writes * SD_US_PER_SECTOR > ops->worst_us)
+            ops->worst_us = writes * SD_US_PER_SECTOR;
+    }
+    ops->file_bytes += file_size;
+}
+
+void print_card_ops(const char *name, const struct card_ops *ops)
+{
+    double bytes = (double)ops->writes * SECTOR_SIZE;
+    printf("%s: %.0f sectors written and %.0f read a day, %.0f bytes written per reading, %.1f per byte of log,"
+        " %.0f ms a day and at most %.1f ms at a time spent on the card\n", name,
+        (double)ops->writes / YEAR_DAYS, (double)ops->reads / YEAR_DAYS, bytes / ((double)YEAR_DAYS * DAY_ENTRIES),
+        bytes / ops->file_bytes, (double)(ops->reads + ops->writes) * SD_US_PER_SECTOR / 1000 / YEAR_DAYS,
+        (double)ops->worst_us / 1000);
+}
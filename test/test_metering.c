@@ -0,0 +1,522 @@
+// host tests of powerduino_metering.h on synthetic waveforms, the same
+// code the firmware runs on its DMA blocks. exits 1 if a check fails.
+// with -b it times the kernels instead
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "../powerduino_metering.h"
+
+// like the firmware, a spare slot after the sockets
+#define CHANNELS 4
+#define STRIDE 5
+#define LIMIT_MA 5000
+// fault waveforms start at these points of the cycle
+#define PHASE_STEP 4
+#define WINDOW_TRIALS 2000
+// the kernel before the streaming one: 83 samples of 3 sensors kept for
+// a two pass mean and variance in doubles, and a 10 reading average
+#define OLD_SAMPLES 83
+#define OLD_CHANNELS 3
+#define OLD_AVERAGE 10
+#define OLD_ADC_COUNTS 8192
+#define BENCH_WINDOWS 20000
+#define MAINS_DV 1200
+
+int32_t failures = 0;
+uint32_t rand_state = 1;
+
+// what the old kernel kept between readings
+struct old_reader
+{
+    int16_t sample_array[OLD_CHANNELS][OLD_SAMPLES];
+    uint16_t output_buf[OLD_CHANNELS][OLD_AVERAGE];
+    uint8_t buffer_index;
+};
+
+void check(int32_t ok, const char *format, ...);
+uint32_t next_rand();
+int64_t get_time_ns();
+uint16_t sine_sample(double rms_mA, int32_t round, double phase);
+int32_t run_fault(double before_mA, double fault_mA, int32_t fault_rounds, int32_t start, uint8_t *fault, uint32_t *latency_rounds);
+void test_trip_quiet();
+void test_trip_step(const char *name, double fault_mA, uint8_t expected);
+void test_trip_half_cycle(const char *name, double fault_mA, uint8_t expected);
+void test_trip_spike();
+void test_trip_latched();
+void test_isqrt64();
+void test_finish_window();
+void test_block_sizes();
+void test_power_factor();
+void phase_window(uint16_t *current, uint16_t *voltage, double rms_mA, double phase_deg);
+void random_window(uint16_t *current, uint16_t *voltage, int32_t rounds);
+void bench_kernels();
+void old_read_current(struct old_reader *r, const uint16_t *samples, uint16_t current_array[OLD_CHANNELS]);
+
+int32_t main(int32_t argc, char *argv[])
+{
+    srand(1);
+    if(argc == 2 && strcmp(argv[1], "-b") == 0)
+    {
+        bench_kernels();
+        return 0;
+    }
+    test_isqrt64();
+    test_finish_window();
+    test_block_sizes();
+    test_power_factor();
+    test_trip_quiet();
+    // under 2x the limit's peak, only the half cycle RMS can catch it
+    test_trip_step("rms step", LIMIT_MA * 1.5, TRIP_RMS);
+    // a short trips on whichever check sees it first
+    test_trip_step("short step", LIMIT_MA * 5, TRIP_NONE);
+    test_trip_half_cycle("rms half cycle", LIMIT_MA * 1.3, TRIP_RMS);
+    test_trip_half_cycle("peak half cycle", LIMIT_MA * 3, TRIP_PEAK);
+    test_trip_spike();
+    test_trip_latched();
+    if(failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
+
+void check(int32_t ok, const char *format, ...)
+{
+    va_list args;
+    if(ok)
+        return;
+    failures++;
+    printf("FAIL: ");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
+
+// xorshift, so the checks see the same values on every host
+uint32_t next_rand()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+int64_t get_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the root has to be the largest r with r * r <= v
+void test_isqrt64()
+{
+    int32_t wrong = 0;
+    for(uint64_t v = 0; v < (1 << 20); v++)
+    {
+        uint64_t r = isqrt64(v);
+        wrong += r * r > v || (r + 1) * (r + 1) <= v;
+    }
+    // squares, and one either side of them, up to the top of the range
+    for(int32_t i = 0; i < 1000000; i++)
+    {
+        uint64_t k = i < 1000 ? 0xffffffffULL - i : next_rand();
+        uint64_t sq = k * k;
+        wrong += isqrt64(sq) != k || (k > 0 && isqrt64(sq - 1) != k - 1) || (k < 0xffffffffULL && isqrt64(sq + 1) != k);
+    }
+    for(int32_t i = 0; i < 1000000; i++)
+    {
+        uint64_t v = (uint64_t)next_rand() << 32 | next_rand();
+        v >>= next_rand() % 64;
+        unsigned __int128 r = isqrt64(v);
+        wrong += r * r > v || (r + 1) * (r + 1) <= v;
+    }
+    wrong += isqrt64(UINT64_MAX) != 0xffffffffU;
+    check(wrong == 0, "isqrt64: %d wrong roots", wrong);
+    printf("isqrt64: %d wrong roots\n", wrong);
+}
+
+// METERING_WINDOW_SAMPLES rounds of random sines, with random DC offsets,
+// phases and noise, interleaved like the DMA blocks
+void random_window(uint16_t *current, uint16_t *voltage, int32_t rounds)
+{
+    double amplitude[STRIDE], phase[STRIDE], offset[STRIDE];
+    double voltage_amplitude = (1000 + next_rand() % 600) * sqrt(2) * METERING_ADC_COUNTS / METERING_FULL_SCALE_DV;
+    for(int32_t ch = 0; ch < STRIDE; ch++)
+    {
+        amplitude[ch] = next_rand() % 20000 * sqrt(2) * METERING_ADC_COUNTS / METERING_FULL_SCALE_MA;
+        phase[ch] = next_rand() % 1000 * M_PI / 1000;
+        offset[ch] = (int32_t)(next_rand() % 401) - 200;
+    }
+    for(int32_t n = 0; n < rounds; n++)
+        for(int32_t ch = 0; ch < STRIDE; ch++)
+        {
+            double a = 2 * M_PI * n / METERING_SAMPLES_PER_CYCLE;
+            current[n * STRIDE + ch] = METERING_ADC_COUNTS / 2 + offset[ch] + amplitude[ch] * sin(a - phase[ch]) + (int32_t)(next_rand() % 41) - 20;
+            voltage[n * STRIDE + ch] = METERING_ADC_COUNTS / 2 + voltage_amplitude * sin(a) + (int32_t)(next_rand() % 41) - 20;
+        }
+}
+
+// the integer window against the same sums taken in doubles. the roots
+// and products are rounded down, then the scaled results again, so they
+// can be up to a count of each plus 1 under
+void test_finish_window()
+{
+    static uint16_t current[METERING_WINDOW_SAMPLES * STRIDE];
+    static uint16_t voltage[METERING_WINDOW_SAMPLES * STRIDE];
+    struct metering m;
+    double worst_mA = 0, worst_dW = 0, worst_dV = 0;
+    double max_mA = 1 + (double)METERING_FULL_SCALE_MA / METERING_ADC_COUNTS;
+    double max_dW = 1 + (double)METERING_FULL_SCALE_MA * METERING_FULL_SCALE_DV / ((double)METERING_ADC_COUNTS * METERING_ADC_COUNTS * 1000);
+    // and the average of the channels once more
+    double max_dV = 2 + (double)METERING_FULL_SCALE_DV / METERING_ADC_COUNTS;
+    metering_init(&m, CHANNELS, STRIDE);
+    for(int32_t trial = 0; trial < WINDOW_TRIALS; trial++)
+    {
+        random_window(current, voltage, METERING_WINDOW_SAMPLES);
+        // in blocks of a few rounds, like the DMA half buffers
+        for(int32_t n = 0; n < METERING_WINDOW_SAMPLES; n += 16)
+            metering_feed(&m, current + n * STRIDE, voltage + n * STRIDE, 16 * STRIDE);
+        double dV = 0;
+        for(int32_t ch = 0; ch < CHANNELS; ch++)
+        {
+            double sum_i = 0, sum_v = 0, sqsum_i = 0, sqsum_v = 0, sum_vi = 0;
+            for(int32_t n = 0; n < METERING_WINDOW_SAMPLES; n++)
+            {
+                double i = current[n * STRIDE + ch], v = voltage[n * STRIDE + ch];
+                sum_i += i;
+                sum_v += v;
+                sqsum_i += i * i;
+                sqsum_v += v * v;
+                sum_vi += i * v;
+            }
+            double n = METERING_WINDOW_SAMPLES;
+            double mA = sqrt(sqsum_i / n - sum_i * sum_i / (n * n)) * METERING_FULL_SCALE_MA / METERING_ADC_COUNTS;
+            double dW = (sum_vi / n - sum_i * sum_v / (n * n)) * METERING_FULL_SCALE_MA * METERING_FULL_SCALE_DV / ((double)METERING_ADC_COUNTS * METERING_ADC_COUNTS * 1000);
+            dV += sqrt(sqsum_v / n - sum_v * sum_v / (n * n)) * METERING_FULL_SCALE_DV / METERING_ADC_COUNTS;
+            // noise floor readings are 0, and take their power with them
+            if(mA <= METERING_NOISE_FLOOR_MA + 1)
+                continue;
+            double err_mA = mA - m.window_mA[ch];
+            double err_dW = fabs(dW - m.window_dW[ch]);
+            check(err_mA >= 0 && err_mA < max_mA, "window %d socket %d: %u mA, %.3f in doubles", trial, ch + 1, m.window_mA[ch], mA);
+            check(err_dW < max_dW, "window %d socket %d: %d dW, %.3f in doubles", trial, ch + 1, m.window_dW[ch], dW);
+            worst_mA = fmax(worst_mA, err_mA);
+            worst_dW = fmax(worst_dW, err_dW);
+        }
+        double err_dV = dV / CHANNELS - m.window_dV;
+        check(err_dV >= 0 && err_dV < max_dV, "window %d: %u dV, %.3f in doubles", trial, m.window_dV, dV / CHANNELS);
+        worst_dV = fmax(worst_dV, err_dV);
+    }
+    printf("metering_finish_window: %d windows, off by at most %.3f mA, %.3f dW, %.3f dV, bounds %.3f, %.3f, %.3f\n",
+        WINDOW_TRIALS, worst_mA, worst_dW, worst_dV, max_mA, max_dW, max_dV);
+}
+
+// a window of every socket drawing a sine of rms_mA, phase_deg behind
+// the mains voltage, which is MAINS_DV
+void phase_window(uint16_t *current, uint16_t *voltage, double rms_mA, double phase_deg)
+{
+    double amplitude = rms_mA * sqrt(2) * METERING_ADC_COUNTS / METERING_FULL_SCALE_MA;
+    double voltage_amplitude = MAINS_DV * sqrt(2) * METERING_ADC_COUNTS / METERING_FULL_SCALE_DV;
+    for(int32_t n = 0; n < METERING_WINDOW_SAMPLES; n++)
+        for(int32_t ch = 0; ch < STRIDE; ch++)
+        {
+            double a = 2 * M_PI * n / METERING_SAMPLES_PER_CYCLE;
+            current[n * STRIDE + ch] = METERING_ADC_COUNTS / 2 + amplitude * sin(a - phase_deg * M_PI / 180) + (int32_t)(next_rand() % 41) - 20;
+            voltage[n * STRIDE + ch] = METERING_ADC_COUNTS / 2 + voltage_amplitude * sin(a) + (int32_t)(next_rand() % 41) - 20;
+        }
+}
+
+// the DMA half buffers can end anywhere in a window, the readings must
+// come out the same however the samples are split up
+void test_block_sizes()
+{
+    static uint16_t current[METERING_WINDOW_SAMPLES * STRIDE];
+    static uint16_t voltage[METERING_WINDOW_SAMPLES * STRIDE];
+    struct metering whole, split;
+    int32_t wrong = 0;
+    metering_init(&whole, CHANNELS, STRIDE);
+    metering_init(&split, CHANNELS, STRIDE);
+    for(int32_t trial = 0; trial < 200; trial++)
+    {
+        random_window(current, voltage, METERING_WINDOW_SAMPLES);
+        check(metering_feed(&whole, current, voltage, METERING_WINDOW_SAMPLES * STRIDE) == 1, "whole window didn't complete");
+        int32_t completed = 0;
+        for(int32_t n = 0; n < METERING_WINDOW_SAMPLES;)
+        {
+            int32_t rounds = 1 + next_rand() % 97;
+            if(rounds > METERING_WINDOW_SAMPLES - n)
+                rounds = METERING_WINDOW_SAMPLES - n;
+            completed += metering_feed(&split, current + n * STRIDE, voltage + n * STRIDE, rounds * STRIDE);
+            n += rounds;
+        }
+        check(completed == 1, "split window completed %d times", completed);
+        wrong += memcmp(whole.window_mA, split.window_mA, sizeof whole.window_mA) != 0
+            || memcmp(whole.window_dW, split.window_dW, sizeof whole.window_dW) != 0 || whole.window_dV != split.window_dV;
+    }
+    check(wrong == 0, "block sizes: %d windows differ", wrong);
+    printf("block sizes: %d of 200 windows differ\n", wrong);
+}
+
+// real power and power factor of loads from resistive to purely
+// reactive, against V * I * cos(phase). readings are averages of
+// METERING_AVERAGE_WINDOWS windows
+void test_power_factor()
+{
+    static uint16_t current[METERING_WINDOW_SAMPLES * STRIDE];
+    static uint16_t voltage[METERING_WINDOW_SAMPLES * STRIDE];
+    double phases[] = {0, 15, 30, 45, 60, 75, 90, -30, -60};
+    double loads_mA[] = {500, 5000, 15000};
+    double worst_dW = 0;
+    int32_t worst_pf = 0;
+    for(uint32_t p = 0; p < sizeof phases / sizeof phases[0]; p++)
+        for(uint32_t l = 0; l < sizeof loads_mA / sizeof loads_mA[0]; l++)
+        {
+            struct metering m;
+            metering_init(&m, CHANNELS, STRIDE);
+            for(int32_t w = 0; w < METERING_AVERAGE_WINDOWS; w++)
+            {
+                phase_window(current, voltage, loads_mA[l], phases[p]);
+                metering_feed(&m, current, voltage, METERING_WINDOW_SAMPLES * STRIDE);
+            }
+            double cos_phase = cos(phases[p] * M_PI / 180);
+            double dW = MAINS_DV * loads_mA[l] / 1000 * cos_phase;
+            for(int32_t ch = 0; ch < CHANNELS; ch++)
+            {
+                double err_mA = fabs(metering_current(&m, ch) - loads_mA[l]);
+                double err_dW = fabs(metering_power(&m, ch) - dW);
+                int32_t err_pf = abs(metering_power_factor(&m, ch) - (int32_t)lround(cos_phase * 1000));
+                check(err_mA <= loads_mA[l] / 100 + 2, "%.0f mA at %.0f deg: reads %u mA", loads_mA[l], phases[p], metering_current(&m, ch));
+                // 1% of the apparent power
+                check(err_dW <= MAINS_DV * loads_mA[l] / 100000 + 1, "%.0f mA at %.0f deg: %d dW, not %.0f", loads_mA[l], phases[p], metering_power(&m, ch), dW);
+                check(err_pf <= 10, "%.0f mA at %.0f deg: power factor %d", loads_mA[l], phases[p], metering_power_factor(&m, ch));
+                worst_dW = fmax(worst_dW, err_dW / (MAINS_DV * loads_mA[l] / 1000));
+                worst_pf = err_pf > worst_pf ? err_pf : worst_pf;
+            }
+            check(abs(metering_voltage(&m) - MAINS_DV) <= MAINS_DV / 200, "%.0f mA at %.0f deg: reads %u dV", loads_mA[l], phases[p], metering_voltage(&m));
+        }
+    printf("power factor: real power off by at most %.2f%% of VA, power factor by %d/1000\n", worst_dW * 100, worst_pf);
+}
+
+// time per sample and RAM of the streaming kernel and the old one, on
+// this host. the Teensy has no double FPU, so the old kernel does worse
+// there than here
+void bench_kernels()
+{
+    static uint16_t current[METERING_WINDOW_SAMPLES * STRIDE];
+    static uint16_t voltage[METERING_WINDOW_SAMPLES * STRIDE];
+    static uint16_t old_samples[OLD_SAMPLES * OLD_CHANNELS];
+    struct metering m;
+    struct old_reader r;
+    uint16_t readings[OLD_CHANNELS];
+    uint32_t sink = 0;
+    random_window(current, voltage, METERING_WINDOW_SAMPLES);
+    for(int32_t n = 0; n < OLD_SAMPLES; n++)
+        for(int32_t ch = 0; ch < OLD_CHANNELS; ch++)
+            old_samples[n * OLD_CHANNELS + ch] = current[n * STRIDE + ch] >> 3;
+    metering_init(&m, CHANNELS, STRIDE);
+    int64_t start = get_time_ns();
+    for(int32_t w = 0; w < BENCH_WINDOWS; w++)
+    {
+        metering_feed(&m, current, voltage, METERING_WINDOW_SAMPLES * STRIDE);
+        sink += metering_current(&m, w % CHANNELS);
+    }
+    double new_ns = (double)(get_time_ns() - start) / ((double)BENCH_WINDOWS * METERING_WINDOW_SAMPLES * CHANNELS);
+    memset(&r, 0, sizeof r);
+    start = get_time_ns();
+    for(int32_t w = 0; w < BENCH_WINDOWS; w++)
+    {
+        old_read_current(&r, old_samples, readings);
+        sink += readings[w % OLD_CHANNELS];
+    }
+    double old_ns = (double)(get_time_ns() - start) / ((double)BENCH_WINDOWS * OLD_SAMPLES * OLD_CHANNELS);
+    printf("streaming kernel: %.2f ns per sample, current and voltage, %zu bytes\n", new_ns, sizeof(struct metering));
+    printf("old kernel: %.2f ns per sample, current only, %zu bytes\n", old_ns, sizeof(struct old_reader));
+    // keeps the loops from being optimized away
+    if(sink == 1)
+        printf("\n");
+}
+
+// read_current_internal() and calc_avg() as they were, on samples
+// already read
+void old_read_current(struct old_reader *r, const uint16_t *samples, uint16_t current_array[OLD_CHANNELS])
+{
+    int32_t sqsum[OLD_CHANNELS] = {0, 0, 0};
+    int32_t sum[OLD_CHANNELS] = {0, 0, 0};
+    int16_t avg[OLD_CHANNELS] = {0, 0, 0};
+    r->buffer_index = (r->buffer_index + 1) % OLD_AVERAGE;
+    for(int32_t i = 0; i < OLD_SAMPLES; i++)
+        for(int32_t j = 0; j < OLD_CHANNELS; j++)
+        {
+            r->sample_array[j][i] = samples[i * OLD_CHANNELS + j];
+            sum[j] += r->sample_array[j][i];
+        }
+    for(int32_t j = 0; j < OLD_CHANNELS; j++)
+    {
+        avg[j] = sum[j] / OLD_SAMPLES;
+        for(int32_t i = 0; i < OLD_SAMPLES; i++)
+        {
+            r->sample_array[j][i] -= avg[j];
+            sqsum[j] += r->sample_array[j][i] * r->sample_array[j][i];
+        }
+    }
+    for(int32_t j = 0; j < OLD_CHANNELS; j++)
+    {
+        double current = (((double)OLD_ADC_COUNTS / 2 + sqrt((double)sqsum[j] / OLD_SAMPLES)) / OLD_ADC_COUNTS) * 50 - 25;
+        if(j == 0)
+            current = current - 0.06 < 0 ? 0 : current - 0.06;
+        r->output_buf[j][r->buffer_index] = current <= 0.06 ? 0 : current * 1000;
+    }
+    for(int32_t j = 0; j < OLD_CHANNELS; j++)
+    {
+        int32_t total = 0;
+        for(int32_t i = 0; i < OLD_AVERAGE; i++)
+            total += r->output_buf[j][i];
+        current_array[j] = total / OLD_AVERAGE;
+    }
+}
+
+// a current sensor reading of a sine of rms_mA, with a bit of noise
+uint16_t sine_sample(double rms_mA, int32_t round, double phase)
+{
+    double amplitude = rms_mA * sqrt(2) * METERING_ADC_COUNTS / METERING_FULL_SCALE_MA;
+    double v = METERING_ADC_COUNTS / 2 + amplitude * sin(2 * M_PI * round / METERING_SAMPLES_PER_CYCLE + phase) + rand() % 41 - 20;
+    return v < 0 ? 0 : v > METERING_ADC_COUNTS - 1 ? METERING_ADC_COUNTS - 1 : v;
+}
+
+// feed socket 1 ten cycles of before_mA, then fault_mA for fault_rounds
+// starting start rounds into a cycle, then before_mA again, a round at a
+// time. returns the rounds from the start of the fault to the trip, -1
+// if it didn't trip
+int32_t run_fault(double before_mA, double fault_mA, int32_t fault_rounds, int32_t start, uint8_t *fault, uint32_t *latency_rounds)
+{
+    struct trip_detector t;
+    uint16_t samples[STRIDE];
+    int32_t fault_round = 10 * METERING_SAMPLES_PER_CYCLE + start;
+    trip_init(&t, CHANNELS, STRIDE);
+    trip_set_limit(&t, 0, LIMIT_MA);
+    for(int32_t round = 0; round < fault_round + fault_rounds + 4 * METERING_SAMPLES_PER_CYCLE; round++)
+    {
+        int32_t in_fault = round >= fault_round && round < fault_round + fault_rounds;
+        samples[0] = sine_sample(in_fault ? fault_mA : before_mA, round, 0);
+        for(int32_t ch = 1; ch < STRIDE; ch++)
+            samples[ch] = sine_sample(0, round, 0);
+        if(trip_feed(&t, samples, STRIDE) & 1)
+        {
+            *fault = t.ch[0].fault;
+            *latency_rounds = t.ch[0].latency_rounds;
+            return round - fault_round;
+        }
+    }
+    *fault = TRIP_NONE;
+    *latency_rounds = 0;
+    return -1;
+}
+
+// stepping up to a load just under the limit never trips
+void test_trip_quiet()
+{
+    uint8_t fault;
+    uint32_t latency;
+    int32_t rounds = run_fault(LIMIT_MA * 0.5, LIMIT_MA * 0.95, 60 * METERING_SAMPLES_PER_CYCLE, 0, &fault, &latency);
+    check(rounds == -1, "%.0f mA tripped after %d rounds", LIMIT_MA * 0.95, rounds);
+}
+
+// a fault that stays on has to trip within a half cycle of starting,
+// wherever in the cycle it starts. TRIP_NONE takes either kind of trip
+void test_trip_step(const char *name, double fault_mA, uint8_t expected)
+{
+    int32_t worst = 0;
+    for(int32_t start = 0; start < METERING_SAMPLES_PER_CYCLE; start += PHASE_STEP)
+    {
+        uint8_t fault;
+        uint32_t latency;
+        int32_t rounds = run_fault(LIMIT_MA * 0.5, fault_mA, 60 * METERING_SAMPLES_PER_CYCLE, start, &fault, &latency);
+        check(rounds >= 0 && rounds <= TRIP_HALF_CYCLE, "%s at %d: tripped after %d rounds", name, start, rounds);
+        check(expected == TRIP_NONE ? fault != TRIP_NONE : fault == expected, "%s at %d: fault %d, not %d", name, start, fault, expected);
+        check(latency <= TRIP_HALF_CYCLE, "%s at %d: latency %u rounds", name, start, latency);
+        if(rounds > worst)
+            worst = rounds;
+    }
+    printf("%s: worst %d rounds (%u us), bound %d (%u us)\n", name, worst, trip_rounds_to_us(worst),
+        TRIP_HALF_CYCLE, trip_rounds_to_us(TRIP_HALF_CYCLE));
+}
+
+// a fault lasting only one half cycle has to be caught within it
+void test_trip_half_cycle(const char *name, double fault_mA, uint8_t expected)
+{
+    int32_t worst = 0;
+    // the half cycle starts at a zero crossing
+    for(int32_t start = 0; start < METERING_SAMPLES_PER_CYCLE; start += TRIP_HALF_CYCLE)
+    {
+        uint8_t fault;
+        uint32_t latency;
+        int32_t rounds = run_fault(LIMIT_MA * 0.5, fault_mA, TRIP_HALF_CYCLE, start, &fault, &latency);
+        check(rounds >= 0 && rounds < TRIP_HALF_CYCLE, "%s at %d: tripped after %d rounds", name, start, rounds);
+        check(fault == expected, "%s at %d: fault %d, not %d", name, start, fault, expected);
+        if(rounds > worst)
+            worst = rounds;
+    }
+    printf("%s: worst %d rounds (%u us), bound %d (%u us)\n", name, worst, trip_rounds_to_us(worst),
+        TRIP_HALF_CYCLE, trip_rounds_to_us(TRIP_HALF_CYCLE));
+}
+
+// two samples at the crest, too few to move the half cycle RMS past the
+// limit, only the peak check sees them
+void test_trip_spike()
+{
+    uint8_t fault;
+    uint32_t latency;
+    int32_t rounds = run_fault(LIMIT_MA * 0.5, LIMIT_MA * 3, 2, METERING_SAMPLES_PER_CYCLE / 4 - 1, &fault, &latency);
+    check(rounds >= 0 && rounds < 2, "peak spike: tripped after %d rounds", rounds);
+    check(fault == TRIP_PEAK, "peak spike: fault %d, not %d", fault, TRIP_PEAK);
+    printf("peak spike: %d rounds (%u us)\n", rounds, trip_rounds_to_us(rounds));
+}
+
+// a custom function switching every socket on each round, with the trip
+// timer holding the latched ones open as the firmware does. the fault
+// stays on socket 1, so it has to stay off until trip_clear()
+void test_trip_latched()
+{
+    struct trip_detector t;
+    uint16_t samples[STRIDE];
+    uint8_t relays = 0;
+    int32_t tripped_at = -1, reported = 0, on_after = 0;
+    trip_init(&t, CHANNELS, STRIDE);
+    for(int32_t ch = 0; ch < CHANNELS; ch++)
+        trip_set_limit(&t, ch, LIMIT_MA);
+    for(int32_t round = 0; round < 60 * METERING_SAMPLES_PER_CYCLE; round++)
+    {
+        relays = 0xf;
+        relays &= ~trip_latched(&t);
+        if(tripped_at >= 0 && (relays & 1))
+            on_after++;
+        samples[0] = sine_sample(relays & 1 ? (round < 10 * METERING_SAMPLES_PER_CYCLE ? LIMIT_MA * 0.5 : LIMIT_MA * 3) : 0, round, 0);
+        for(int32_t ch = 1; ch < STRIDE; ch++)
+            samples[ch] = sine_sample(ch < CHANNELS ? LIMIT_MA * 0.5 : 0, round, 0);
+        uint8_t tripped = trip_feed(&t, samples, STRIDE);
+        if(tripped & 1)
+        {
+            reported++;
+            if(tripped_at < 0)
+                tripped_at = round;
+        }
+        check(!(tripped & 0xe), "latched: socket %x tripped at %d", tripped, round);
+    }
+    check(tripped_at >= 0, "latched: never tripped");
+    check(reported == 1, "latched: trip reported %d times", reported);
+    check(on_after == 0, "latched: socket 1 on for %d rounds after the trip", on_after);
+    check(trip_latched(&t) == 1 && (relays & 0xe) == 0xe, "latched: mask 0x%x, relays 0x%x", trip_latched(&t), relays);
+    trip_clear(&t, 0);
+    check(trip_latched(&t) == 0, "latched: still 0x%x after trip_clear()", trip_latched(&t));
+    printf("latched trip: socket 1 off for %d rounds after tripping at %d\n",
+        60 * METERING_SAMPLES_PER_CYCLE - tripped_at - 1, tripped_at);
+}